@@ -0,0 +1,503 @@
+/// image16bit - 16-bit graymap images.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "image16bit.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pgmReader.h"
+#include "pixelPool.h"
+
+const uint16 PixMax16 = 65535;
+
+// Alignment of rows in the pixel array, in pixels (a cache line)
+#define ROWALIGN16 32
+
+// The data structure
+//
+// As in image8bit, rows are padded to a multiple of ROWALIGN16 pixels,
+// and the pixel array comes from the pixel pool (see pixelPool.h).
+// Levels are stored in the native byte order.
+struct image16
+{
+  int width;
+  int height;
+  int maxval;
+  int stride;       // distance in pixels between the starts of consecutive rows
+  uint16 *pixel;
+};
+
+// Error handling, as in image8bit: functions that fail set errno and
+// errCause (see Image16ErrMsg).
+static _Thread_local char *errCause;
+
+/// Error cause of the last failed operation of this thread.
+char *Image16ErrMsg(void)
+{ ///
+  return errCause;
+}
+
+// Check a condition and set errCause to failmsg in case of failure.
+static int check(int condition, const char *failmsg)
+{
+  errCause = (char *)(condition ? "" : failmsg);
+  return condition;
+}
+
+// Pointer to the first pixel of row y of img.
+static inline uint16 *row(Image16 img, int y)
+{
+  return img->pixel + (size_t)img->stride * y;
+}
+
+// Pixel loops for 16-bit pixels: negativeRow16, blendRow16, etc.
+// Sums of pixels are doubles, which are exact for any window of 16-bit levels.
+#define PIXEL uint16
+#define PIXELSUM double
+#define KERNEL(name) name##16
+#include "pixelKernels.h"
+
+// Vector of 8 levels (GCC vector extension: SSE2 on x86, NEON on ARM)
+typedef uint16 Levels8 __attribute__((vector_size(16)));
+
+// Swap the two bytes of each of n levels (big-endian <-> native),
+// 8 levels at a time.
+static void swapRow(uint16 *r, int n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  int x = 0;
+  for (; x + 8 <= n; x += 8)
+  {
+    Levels8 v;
+    memcpy(&v, r + x, sizeof(v));
+    v = v << 8 | v >> 8;
+    memcpy(r + x, &v, sizeof(v));
+  }
+  for (; x < n; x++)
+    r[x] = (uint16)(r[x] << 8 | r[x] >> 8);
+#else
+  (void)r;
+  (void)n;  // already big-endian
+#endif
+}
+
+// Whether none of the n levels at r is above maxval, 8 levels at a time.
+static int levelsInRange(const uint16 *r, int n, uint16 maxval)
+{
+  Levels8 max = (Levels8){0} + maxval, over = {0};
+  int x = 0;
+  for (; x + 8 <= n; x += 8)
+  {
+    Levels8 v;
+    memcpy(&v, r + x, sizeof(v));
+    over |= (Levels8)(v > max);
+  }
+  unsigned any = 0;
+  for (int k = 0; k < 8; k++)
+    any |= over[k];
+  for (; x < n; x++)
+    any |= r[x] > maxval;
+  return any == 0;
+}
+
+// Create a new image, with pixels set to zero if zero is nonzero,
+// or left uninitialized otherwise.
+static Image16 image16New(int width, int height, uint16 maxval, int zero)
+{
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(maxval > 0);
+
+  Image16 img = malloc(sizeof(struct image16));
+  if (!check(img != NULL, "Não foi possível alocar memória para a nova imagem"))
+  {
+    errno = ENOMEM;
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->stride = (width + ROWALIGN16 - 1) / ROWALIGN16 * ROWALIGN16;
+  size_t size = (size_t)img->stride * height * sizeof(uint16);
+  img->pixel = zero ? PoolCalloc(size, NULL) : PoolAlloc(size, NULL);
+  if (!check(img->pixel != NULL, "Não foi possível alocar memória para os pixeis da nova imagem"))
+  {
+    free(img);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return img;
+}
+
+Image16 Image16Create(int width, int height, uint16 maxval)
+{ ///
+  return image16New(width, height, maxval, 1);
+}
+
+void Image16Destroy(Image16 *imgp)
+{ ///
+  assert(imgp != NULL);
+  if (*imgp == NULL)
+    return;
+  PoolFree((*imgp)->pixel);
+  free(*imgp);
+  *imgp = NULL;
+}
+
+// Scale level v from maxval from to maxval to, rounding.
+static inline unsigned scaleLevel(unsigned v, unsigned from, unsigned to)
+{
+  return (unsigned)(((uint64_t)v * to + from / 2) / from);
+}
+
+Image16 Image16FromImage(Image img, uint16 maxval)
+{ ///
+  assert(img != NULL);
+  Image16 img16 = image16New(ImageWidth(img), ImageHeight(img), maxval, 0);
+  if (img16 == NULL)
+    return NULL;
+  // Tabela de conversão dos níveis de img para os da nova imagem
+  // (completa: níveis acima do maxval de img dão maxval)
+  unsigned from = (unsigned)ImageMaxval(img);
+  uint16 table[256];
+  for (unsigned v = 0; v < 256; v++)
+    table[v] = (uint16)scaleLevel(v < from ? v : from, from, maxval);
+  for (int y = 0; y < img16->height; y++)
+  { // ler a linha para a segunda metade da linha de 16 bits, e alargá-la
+    // da esquerda para a direita, sem escrever bytes ainda por converter
+    uint16 *p = row(img16, y);
+    uint8 *bytes = (uint8 *)(p + img16->width) - img16->width;
+    ImageGetRow(img, 0, y, img16->width, bytes);
+    for (int x = 0; x < img16->width; x++)
+      p[x] = table[bytes[x]];
+  }
+  return img16;
+}
+
+Image Image16ToImage(Image16 img, uint8 maxval)
+{ ///
+  assert(img != NULL);
+  Image img8 = ImageCreateUninitialized(img->width, img->height, maxval);
+  if (img8 == NULL)
+    return NULL;
+  // Tabela de conversão dos níveis, e uma linha convertida
+  uint8 *table = malloc((size_t)img->maxval + 1);
+  uint8 *line = malloc(img->width > 0 ? (size_t)img->width : 1);
+  int success = check(table != NULL && line != NULL,
+                      "Não foi possível alocar memória para converter a imagem");
+  if (success)
+  {
+    for (unsigned v = 0; v <= (unsigned)img->maxval; v++)
+      table[v] = (uint8)scaleLevel(v, (unsigned)img->maxval, maxval);
+  }
+  else
+    errno = ENOMEM;
+  for (int y = 0; success && y < img->height; y++)
+  {
+    const uint16 *p = row(img, y);
+    for (int x = 0; x < img->width; x++)
+      line[x] = table[p[x]];
+    success = ImageSetRow(img8, 0, y, img->width, line);
+  }
+  free(table);
+  free(line);
+  if (!success)
+    ImageDestroy(&img8);
+  return img8;
+}
+
+// Read the samples of a raw PGM file into the rows of img:
+// 1-byte samples are widened, 2-byte samples are byte-swapped.
+// Fails on samples above maxval, as the conversions index tables by level.
+static int readRows(Image16 img, PgmReader r)
+{
+  if (img->maxval > 255 && img->stride == img->width)
+  {
+    // No padding: read and swap all rows at once
+    size_t n = (size_t)img->width * img->height;
+    if (!PgmReadBytes(r, img->pixel, n * sizeof(uint16)))
+      return 0;
+    for (size_t k = 0; k < n; k += INT_MAX / 8 * 8)
+    {
+      int m = n - k < INT_MAX / 8 * 8 ? (int)(n - k) : INT_MAX / 8 * 8;
+      swapRow(img->pixel + k, m);
+      if (!levelsInRange(img->pixel + k, m, img->maxval))
+        return 0;
+    }
+    return 1;
+  }
+  for (int y = 0; y < img->height; y++)
+  {
+    uint16 *dst = row(img, y);
+    if (img->maxval > 255)
+    {
+      if (!PgmReadBytes(r, dst, (size_t)img->width * sizeof(uint16)))
+        return 0;
+      swapRow(dst, img->width);
+    }
+    else
+    {
+      // Read the bytes into the second half of the row, then widen from
+      // the left, which never overwrites a byte still to be widened
+      uint8 *bytes = (uint8 *)(dst + img->width) - img->width;
+      if (!PgmReadBytes(r, bytes, (size_t)img->width))
+        return 0;
+      for (int x = 0; x < img->width; x++)
+        dst[x] = bytes[x];
+    }
+    if (!levelsInRange(dst, img->width, img->maxval))
+      return 0;
+  }
+  return 1;
+}
+
+// Read the levels of a plain PGM file into the rows of img.
+static int readPlainRows(Image16 img, PgmReader r)
+{
+  for (int y = 0; y < img->height; y++)
+    if (!PgmReadPlain16(r, row(img, y), img->width, img->maxval))
+      return 0;
+  return 1;
+}
+
+Image16 Image16Load(const char *filename)
+{ ///
+  int w, h, maxval, plain;
+  Image16 img = NULL;
+  FILE *f = NULL;
+  PgmReader r = NULL;
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check((r = PgmReaderCreate(f)) != NULL, "Out of memory") &&
+      check(PgmReadMagic(r, &plain), "Invalid file format") &&
+      check(PgmSkipComments(r) >= 0 && PgmReadNumber(r, &w) && w >= 0, "Invalid width") &&
+      check(PgmSkipComments(r) >= 0 && PgmReadNumber(r, &h) && h >= 0, "Invalid height") &&
+      check(PgmSkipComments(r) >= 0 && PgmReadNumber(r, &maxval) &&
+            0 < maxval && maxval <= (int)PixMax16, "Invalid maxval") &&
+      check(PgmSkipOneWhite(r), "Whitespace expected");
+  if (!success && f != NULL && r != NULL)
+    errno = EINVAL;
+  if (success && (img = image16New(w, h, (uint16)maxval, 0)) != NULL &&
+      !check(plain ? readPlainRows(img, r) : readRows(img, r), "Reading pixels"))
+  {
+    Image16Destroy(&img);
+    errno = EINVAL; // ficheiro truncado ou nível inválido
+  }
+  int errsave = errno;
+  PgmReaderDestroy(&r);
+  if (f != NULL)
+    fclose(f);
+  errno = errsave;
+  return img;
+}
+
+int Image16Save(Image16 img, const char *filename)
+{ ///
+  assert(img != NULL);
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL)
+    return 0;
+  int wide = img->maxval > 255;
+  int success = fprintf(f, "P5\n%d %d\n%d\n", img->width, img->height, img->maxval) > 0;
+  // One row of samples, in file order
+  size_t nbytes = (size_t)img->width * (wide ? 2 : 1);
+  uint16 *line = malloc(nbytes > 0 ? nbytes : 1);
+  success = success && line != NULL;
+  for (int y = 0; success && y < img->height; y++)
+  {
+    const uint16 *src = row(img, y);
+    if (wide)
+    {
+      memcpy(line, src, nbytes);
+      swapRow(line, img->width);
+    }
+    else
+    {
+      uint8 *bytes = (uint8 *)line;
+      for (int x = 0; x < img->width; x++)
+        bytes[x] = (uint8)src[x];
+    }
+    success = fwrite(line, 1, nbytes, f) == nbytes;
+  }
+  free(line);
+  if (fclose(f) != 0)
+    success = 0;
+  return success;
+}
+
+int Image16Width(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->width;
+}
+
+int Image16Height(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->height;
+}
+
+int Image16Maxval(Image16 img)
+{ ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+void Image16Stats(Image16 img, uint16 *min, uint16 *max)
+{ ///
+  assert(img != NULL);
+  uint16 lo = PixMax16, hi = 0;
+  for (int y = 0; y < img->height; y++)
+    minMaxRow16(row(img, y), img->width, &lo, &hi);
+  *min = lo;
+  *max = hi;
+}
+
+int Image16ValidPos(Image16 img, int x, int y)
+{ ///
+  assert(img != NULL);
+  return (0 <= x && x < img->width) && (0 <= y && y < img->height);
+}
+
+int Image16ValidRect(Image16 img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  return 0 <= x && 0 <= y && 0 <= w && 0 <= h &&
+         x + w <= img->width && y + h <= img->height;
+}
+
+uint16 Image16GetPixel(Image16 img, int x, int y)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidPos(img, x, y));
+  return row(img, y)[x];
+}
+
+void Image16SetPixel(Image16 img, int x, int y, uint16 level)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidPos(img, x, y));
+  row(img, y)[x] = level;
+}
+
+void Image16Negative(Image16 img)
+{ ///
+  assert(img != NULL);
+  for (int y = 0; y < img->height; y++)
+    negativeRow16(row(img, y), img->width, (uint16)img->maxval);
+}
+
+void Image16Threshold(Image16 img, uint16 thr)
+{ ///
+  assert(img != NULL);
+  for (int y = 0; y < img->height; y++)
+    thresholdRow16(row(img, y), img->width, thr, (uint16)img->maxval);
+}
+
+void Image16Brighten(Image16 img, double factor)
+{ ///
+  assert(img != NULL);
+  assert(factor >= 0.0);
+  for (int y = 0; y < img->height; y++)
+    brightenRow16(row(img, y), img->width, factor, (uint16)img->maxval);
+}
+
+Image16 Image16Rotate(Image16 img)
+{ ///
+  assert(img != NULL);
+  Image16 rot = image16New(img->height, img->width, (uint16)img->maxval, 0);
+  if (rot == NULL)
+    return NULL;
+  rotateRows16(rot->pixel, (size_t)rot->stride, img->pixel, (size_t)img->stride,
+               img->width, img->height);
+  return rot;
+}
+
+Image16 Image16Mirror(Image16 img)
+{ ///
+  assert(img != NULL);
+  Image16 mir = image16New(img->width, img->height, (uint16)img->maxval, 0);
+  if (mir == NULL)
+    return NULL;
+  for (int y = 0; y < img->height; y++)
+    mirrorRow16(row(mir, y), row(img, y), img->width);
+  return mir;
+}
+
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h)
+{ ///
+  assert(img != NULL);
+  assert(Image16ValidRect(img, x, y, w, h));
+  Image16 crop = image16New(w, h, (uint16)img->maxval, 0);
+  if (crop == NULL)
+    return NULL;
+  for (int i = 0; i < h; i++)
+    memcpy(row(crop, i), row(img, y + i) + x, (size_t)w * sizeof(uint16));
+  return crop;
+}
+
+void Image16Paste(Image16 img1, int x, int y, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+  for (int i = 0; i < img2->height; i++)
+    memcpy(row(img1, y + i) + x, row(img2, i), (size_t)img2->width * sizeof(uint16));
+}
+
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+  for (int i = 0; i < img2->height; i++)
+    blendRow16(row(img1, y + i) + x, row(img2, i), img2->width, alpha, (uint16)img1->maxval);
+}
+
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(Image16ValidRect(img1, x, y, img2->width, img2->height));
+  for (int i = 0; i < img2->height; i++)
+    if (memcmp(row(img1, y + i) + x, row(img2, i), (size_t)img2->width * sizeof(uint16)) != 0)
+      return 0;
+  return 1;
+}
+
+int Image16LocateSubImage(Image16 img1, int *px, int *py, Image16 img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  for (int y = 0; y <= img1->height - img2->height; y++)
+    for (int x = 0; x <= img1->width - img2->width; x++)
+      if (Image16MatchSubImage(img1, x, y, img2))
+      {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+  return 0;
+}
+
+void Image16Blur(Image16 img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+  Image16 result = image16New(img->width, img->height, (uint16)img->maxval, 0);
+  if (result == NULL)  // no memory: the image is left unchanged
+    return;
+  blurRows16(result->pixel, (size_t)result->stride, img->pixel, (size_t)img->stride,
+             img->width, img->height, dx, dy);
+  // Swap the arrays: img gets the result, and result the original
+  uint16 *original = img->pixel;
+  img->pixel = result->pixel;
+  result->pixel = original;
+  Image16Destroy(&result);
+}
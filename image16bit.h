@@ -0,0 +1,155 @@
+/// image16bit - 16-bit graymap images.
+///
+/// Images with up to 16 bits per pixel (maxval up to 65535), such as the
+/// 12- and 16-bit PGM files produced by scientific sensors.
+/// The operations are the same as in the image8bit module, and most of
+/// them are generated from the same pixel loops (see pixelKernels.h), so
+/// they give the same results for images with the same levels, except:
+/// blends with alpha outside [0.0, 1.0], which only wrap around above 65535,
+/// and blurs, which add up pixels in double precision (and so may round a
+/// mean that is very close to .5 the other way).
+///
+/// This module follows the conventions of the image8bit module:
+/// design-by-contract, and functions that return NULL or 0 on failure,
+/// with errno and the error cause (see Image16ErrMsg) set accordingly.
+/// Unlike 8-bit images, 16-bit images are never sparse nor shared.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef IMAGE16BIT_H
+#define IMAGE16BIT_H
+
+#include "image8bit.h"
+
+// Type for 16-bit pixel levels
+typedef uint16_t uint16;
+
+// Maximum value you can store in a 16-bit pixel (maximum maxval accepted)
+extern const uint16 PixMax16;
+
+// Type Image16 is a pointer to 16-bit image objects
+typedef struct image16 *Image16;
+
+/// Error cause of the last failed operation of this module (in this
+/// thread), to use with errno, as ImageErrMsg.
+char* Image16ErrMsg(void) ;
+
+/// Image management functions
+
+/// Create a new black image.
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno is set accordingly.
+Image16 Image16Create(int width, int height, uint16 maxval) ;
+
+/// Destroy the image pointed to by (*imgp).
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+void Image16Destroy(Image16* imgp) ;
+
+/// Conversion to and from 8-bit images
+
+/// Create a 16-bit image from img, with levels scaled (and rounded) from
+/// the maxval of img to maxval.
+/// On failure, returns NULL and errno/Image16ErrMsg are set accordingly.
+Image16 Image16FromImage(Image img, uint16 maxval) ;
+
+/// Create an 8-bit image from img, with levels scaled (and rounded) from
+/// the maxval of img to maxval.
+/// On failure, returns NULL and errno/ImageErrMsg are set accordingly.
+Image Image16ToImage(Image16 img, uint8 maxval) ;
+
+/// PGM file operations
+
+/// Load a PGM file, raw (P5) or plain (P2), with any maxval up to 65535.
+/// Raw files with maxval > 255 have 2-byte samples, most significant
+/// byte first.
+/// On failure, returns NULL and errno/Image16ErrMsg are set accordingly
+/// (errno is EINVAL if the file is not a valid PGM file).
+Image16 Image16Load(const char* filename) ;
+
+/// Save image to raw PGM file: 2-byte samples (most significant byte
+/// first) if maxval > 255, 1-byte samples otherwise.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno is set, and a partial and invalid file may
+/// be left in the system.
+int Image16Save(Image16 img, const char* filename) ;
+
+/// Information queries
+
+/// Get image width
+int Image16Width(Image16 img) ;
+
+/// Get image height
+int Image16Height(Image16 img) ;
+
+/// Get image maximum gray level
+int Image16Maxval(Image16 img) ;
+
+/// Find the minimum and maximum gray levels in image.
+void Image16Stats(Image16 img, uint16* min, uint16* max) ;
+
+/// Check if pixel position (x,y) is inside img.
+int Image16ValidPos(Image16 img, int x, int y) ;
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int Image16ValidRect(Image16 img, int x, int y, int w, int h) ;
+
+/// Get the pixel (level) at position (x,y).
+uint16 Image16GetPixel(Image16 img, int x, int y) ;
+
+/// Set the pixel at position (x,y) to new level.
+void Image16SetPixel(Image16 img, int x, int y, uint16 level) ;
+
+/// Pixel transformations (in-place, never fail), as in image8bit
+
+/// Transform image to negative image.
+void Image16Negative(Image16 img) ;
+
+/// Transform levels below thr to black (0) and the others to white (maxval).
+void Image16Threshold(Image16 img, uint16 thr) ;
+
+/// Multiply each pixel level by a factor, but saturate at maxval.
+void Image16Brighten(Image16 img, double factor) ;
+
+/// Geometric transformations (new images; NULL and errno on failure)
+
+/// Rotate an image 90 degrees anti-clockwise.
+Image16 Image16Rotate(Image16 img) ;
+
+/// Mirror an image = flip left-right.
+Image16 Image16Mirror(Image16 img) ;
+
+/// Crop a rectangular subimage from img.
+/// Requires: the rectangle (x,y,w,h) must be inside img.
+Image16 Image16Crop(Image16 img, int x, int y, int w, int h) ;
+
+/// Operations on two images
+
+/// Paste img2 into position (x, y) of img1, in-place.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Paste(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Blend img2 into position (x, y) of img1, in-place, as ImageBlend.
+/// Requires: img2 must fit inside img1 at position (x, y).
+void Image16Blend(Image16 img1, int x, int y, Image16 img2, double alpha) ;
+
+/// Returns 1 (true) if img2 matches the subimage of img1 at pos (x, y).
+/// Returns 0, otherwise.
+int Image16MatchSubImage(Image16 img1, int x, int y, Image16 img2) ;
+
+/// Locate img2 inside img1, as ImageLocateSubImage.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int Image16LocateSubImage(Image16 img1, int* px, int* py, Image16 img2) ;
+
+/// Filtering
+
+/// Blur an image with a (2dx+1)x(2dy+1) mean filter, as ImageBlur.
+/// The image is changed in-place; if there is no memory for the result,
+/// the image is left unchanged.
+void Image16Blur(Image16 img, int dx, int dy) ;
+
+#endif
@@ -0,0 +1,308 @@
+/// image1bit - Bit-packed binary images.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "image1bit.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The data structure
+//
+// Each row is stored in wpr (words per row) 64-bit words.
+// Pixel (x,y) is bit x%64 (counting from the least significant bit) of
+// word x/64 of row y.  Bits past the width in the last word of a row are
+// always 0, so that whole words can be counted and compared.
+struct bitimage {
+  int width;
+  int height;
+  int wpr;          // words per row
+  uint64_t* bits;   // rows of packed pixels
+};
+
+// Pointer to the first word of row y.
+static inline uint64_t* bitRow(BitImage bimg, int y)
+{
+  return bimg->bits + (size_t)bimg->wpr * y;
+}
+
+// Mask of the valid bits in word k of a row of width pixels.
+static inline uint64_t wordMask(int width, int k)
+{
+  int bits = width - 64 * k;
+  return bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+
+// The 64 pixels of a row starting at pixel pos (a shifted word compare).
+// Pixels past the end of the row read as 0.
+static inline uint64_t extractWord(const uint64_t* row, int wpr, int pos)
+{
+  int q = pos >> 6;
+  int s = pos & 63;
+  uint64_t v = row[q] >> s;
+  if (s != 0 && q + 1 < wpr)
+    v |= row[q + 1] << (64 - s);
+  return v;
+}
+
+BitImage BitImageCreate(int width, int height)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+
+  BitImage bimg = malloc(sizeof(struct bitimage));
+  if (bimg == NULL)
+    return NULL;
+  bimg->width = width;
+  bimg->height = height;
+  bimg->wpr = (width + 63) / 64;
+  size_t nwords = (size_t)bimg->wpr * height;
+  bimg->bits = calloc(nwords > 0 ? nwords : 1, sizeof(uint64_t));
+  if (bimg->bits == NULL) {
+    free(bimg);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return bimg;
+}
+
+void BitImageDestroy(BitImage* bimgp)
+{ ///
+  assert(bimgp != NULL);
+  if (*bimgp == NULL)
+    return;
+  free((*bimgp)->bits);
+  free(*bimgp);
+  *bimgp = NULL;
+}
+
+BitImage BitImageFromImage(Image img, uint8 thr)
+{ ///
+  assert(img != NULL);
+  int width = ImageWidth(img);
+  BitImage bimg = BitImageCreate(width, ImageHeight(img));
+  if (bimg == NULL)
+    return NULL;
+  // Each row is read whole, then packed 64 pixels per word
+  uint8* line = malloc(64 * (size_t)(bimg->wpr > 0 ? bimg->wpr : 1));
+  if (line == NULL) {
+    BitImageDestroy(&bimg);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (int y = 0; y < bimg->height; y++) {
+    ImageGetRow(img, 0, y, width, line);
+    uint64_t* row = bitRow(bimg, y);
+    for (int k = 0; k < bimg->wpr; k++) {
+      const uint8* p = line + 64 * k;
+      int n = width - 64 * k < 64 ? width - 64 * k : 64;
+      uint64_t word = 0;
+      for (int i = 0; i < n; i++)
+        word |= (uint64_t)(p[i] >= thr) << i;
+      row[k] = word;
+    }
+  }
+  free(line);
+  return bimg;
+}
+
+Image BitImageToImage(BitImage bimg, uint8 maxval)
+{ ///
+  assert(bimg != NULL);
+  Image img = ImageCreateUninitialized(bimg->width, bimg->height, maxval);
+  if (img == NULL)
+    return NULL;
+  // Each row is unpacked 64 pixels per word, then written whole
+  uint8* line = malloc(64 * (size_t)(bimg->wpr > 0 ? bimg->wpr : 1));
+  int success = line != NULL;
+  if (!success)
+    errno = ENOMEM;
+  for (int y = 0; success && y < bimg->height; y++) {
+    const uint64_t* row = bitRow(bimg, y);
+    for (int k = 0; k < bimg->wpr; k++) {
+      uint64_t word = row[k];
+      uint8* p = line + 64 * k;
+      for (int i = 0; i < 64; i++)
+        p[i] = (word >> i) & 1 ? maxval : 0;
+    }
+    success = ImageSetRow(img, 0, y, bimg->width, line);
+  }
+  free(line);
+  if (!success)
+    ImageDestroy(&img);
+  return img;
+}
+
+// Reverse the order of the bits in a byte.
+static inline unsigned reverseByte(unsigned b)
+{
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+  return b;
+}
+
+int BitImageSavePBM(BitImage bimg, const char* filename)
+{ ///
+  assert(bimg != NULL);
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL)
+    return 0;
+  int success = fprintf(f, "P4\n%d %d\n", bimg->width, bimg->height) > 0;
+  int nbytes = (bimg->width + 7) / 8;
+  unsigned char* line = malloc(nbytes > 0 ? nbytes : 1);
+  success = success && line != NULL;
+  // Padding bits of the last byte of each row are written as 0
+  unsigned lastmask = bimg->width % 8 == 0 ? 0xFF : (0xFF00 >> (bimg->width % 8)) & 0xFF;
+  for (int y = 0; success && y < bimg->height; y++) {
+    const uint64_t* row = bitRow(bimg, y);
+    // PBM stores the leftmost pixel in the most significant bit, and 1 is black
+    for (int b = 0; b < nbytes; b++)
+      line[b] = ~reverseByte((row[b >> 3] >> (8 * (b & 7))) & 0xFF) & 0xFF;
+    if (nbytes > 0)
+      line[nbytes - 1] &= lastmask;
+    success = fwrite(line, 1, nbytes, f) == (size_t)nbytes;
+  }
+  free(line);
+  if (fclose(f) != 0)
+    success = 0;
+  return success;
+}
+
+int BitImageWidth(BitImage bimg)
+{ ///
+  assert(bimg != NULL);
+  return bimg->width;
+}
+
+int BitImageHeight(BitImage bimg)
+{ ///
+  assert(bimg != NULL);
+  return bimg->height;
+}
+
+long BitImageCount(BitImage bimg)
+{ ///
+  assert(bimg != NULL);
+  long count = 0;
+  size_t nwords = (size_t)bimg->wpr * bimg->height;
+  for (size_t i = 0; i < nwords; i++)
+    count += __builtin_popcountll(bimg->bits[i]);
+  return count;
+}
+
+int BitImageGetPixel(BitImage bimg, int x, int y)
+{ ///
+  assert(bimg != NULL);
+  assert(0 <= x && x < bimg->width && 0 <= y && y < bimg->height);
+  return (bitRow(bimg, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+void BitImageSetPixel(BitImage bimg, int x, int y, int bit)
+{ ///
+  assert(bimg != NULL);
+  assert(0 <= x && x < bimg->width && 0 <= y && y < bimg->height);
+  uint64_t* word = &bitRow(bimg, y)[x >> 6];
+  uint64_t mask = (uint64_t)1 << (x & 63);
+  *word = bit ? *word | mask : *word & ~mask;
+}
+
+void BitImageNegative(BitImage bimg)
+{ ///
+  assert(bimg != NULL);
+  for (int y = 0; y < bimg->height; y++) {
+    uint64_t* row = bitRow(bimg, y);
+    for (int k = 0; k < bimg->wpr; k++)
+      row[k] = ~row[k] & wordMask(bimg->width, k);  // keep the padding at 0
+  }
+}
+
+BitImage BitImageCrop(BitImage bimg, int x, int y, int w, int h)
+{ ///
+  assert(bimg != NULL);
+  assert(0 <= x && 0 <= y && 0 <= w && 0 <= h);
+  assert(x + w <= bimg->width && y + h <= bimg->height);
+
+  BitImage crop = BitImageCreate(w, h);
+  if (crop == NULL)
+    return NULL;
+  for (int i = 0; i < h; i++) {
+    const uint64_t* src = bitRow(bimg, y + i);
+    uint64_t* dst = bitRow(crop, i);
+    for (int k = 0; k < crop->wpr; k++)
+      dst[k] = extractWord(src, bimg->wpr, x + 64 * k) & wordMask(w, k);
+  }
+  return crop;
+}
+
+void BitImagePaste(BitImage bimg1, int x, int y, BitImage bimg2)
+{ ///
+  assert(bimg1 != NULL);
+  assert(bimg2 != NULL);
+  assert(0 <= x && 0 <= y);
+  assert(x + bimg2->width <= bimg1->width && y + bimg2->height <= bimg1->height);
+
+  for (int i = 0; i < bimg2->height; i++) {
+    const uint64_t* src = bitRow(bimg2, i);
+    uint64_t* dst = bitRow(bimg1, y + i);
+    for (int k = 0; k < bimg2->wpr; k++) {
+      // Word k of src goes to bits s.. of dst[q], and the rest to dst[q+1]
+      uint64_t m = wordMask(bimg2->width, k);
+      int q = (x + 64 * k) >> 6;
+      int s = (x + 64 * k) & 63;
+      dst[q] = (dst[q] & ~(m << s)) | (src[k] << s);
+      if (s != 0 && (m >> (64 - s)) != 0)
+        dst[q + 1] = (dst[q + 1] & ~(m >> (64 - s))) | (src[k] >> (64 - s));
+    }
+  }
+}
+
+int BitImageMatchSubImage(BitImage bimg1, int x, int y, BitImage bimg2)
+{ ///
+  assert(bimg1 != NULL);
+  assert(bimg2 != NULL);
+  assert(0 <= x && 0 <= y);
+  assert(x + bimg2->width <= bimg1->width && y + bimg2->height <= bimg1->height);
+
+  for (int i = 0; i < bimg2->height; i++) {
+    const uint64_t* r1 = bitRow(bimg1, y + i);
+    const uint64_t* r2 = bitRow(bimg2, i);
+    for (int k = 0; k < bimg2->wpr; k++)
+      if ((extractWord(r1, bimg1->wpr, x + 64 * k) & wordMask(bimg2->width, k)) != r2[k])
+        return 0;
+  }
+  return 1;
+}
+
+int BitImageLocateSubImage(BitImage bimg1, int* px, int* py, BitImage bimg2)
+{ ///
+  assert(bimg1 != NULL);
+  assert(bimg2 != NULL);
+
+  if (bimg2->width == 0 || bimg2->height == 0) {
+    if (bimg2->width > bimg1->width || bimg2->height > bimg1->height)
+      return 0;
+    *px = *py = 0;
+    return 1;
+  }
+  // Candidate positions are filtered by comparing the first word of the
+  // first row of bimg2 with the word of bimg1 at each position.
+  uint64_t first = bimg2->bits[0];
+  uint64_t mask = wordMask(bimg2->width, 0);
+  for (int y = 0; y <= bimg1->height - bimg2->height; y++) {
+    const uint64_t* row = bitRow(bimg1, y);
+    for (int x = 0; x <= bimg1->width - bimg2->width; x++) {
+      if ((extractWord(row, bimg1->wpr, x) & mask) == first &&
+          BitImageMatchSubImage(bimg1, x, y, bimg2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
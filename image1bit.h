@@ -0,0 +1,102 @@
+/// image1bit - Bit-packed binary images.
+///
+/// A binary image stores one bit per pixel, packed in 64-bit words, so it
+/// takes 8 times less memory than an 8-bit image, and most operations
+/// process 64 pixels per word operation.
+/// Binary images are meant for images that only have two levels, such as
+/// the result of ImageThreshold: bit 1 is white, bit 0 is black.
+///
+/// This module follows the conventions of the image8bit module:
+/// design-by-contract, and functions that return NULL or 0 on failure,
+/// with errno set accordingly.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef IMAGE1BIT_H
+#define IMAGE1BIT_H
+
+#include "image8bit.h"
+
+// Type BitImage is a pointer to binary image objects
+typedef struct bitimage *BitImage;
+
+/// Binary image management functions
+
+/// Create a new black binary image.
+/// Requires: width and height must be non-negative.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno is set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*bimgp).
+/// If (*bimgp)==NULL, no operation is performed.
+/// Ensures: (*bimgp)==NULL.
+void BitImageDestroy(BitImage* bimgp) ;
+
+/// Conversion to and from 8-bit images
+
+/// Create a binary image from img:
+/// pixels with level>=thr become white (1), others black (0).
+/// (This is the same rule as ImageThreshold.)
+/// On failure, returns NULL and errno is set accordingly.
+BitImage BitImageFromImage(Image img, uint8 thr) ;
+
+/// Create an 8-bit image from bimg: white pixels get level maxval,
+/// black pixels get level 0.
+/// On failure, returns NULL and errno/ImageErrMsg are set accordingly.
+Image BitImageToImage(BitImage bimg, uint8 maxval) ;
+
+/// PBM file operations
+
+/// Save binary image to raw PBM file (P4).
+/// In PBM files 1 is black, so bits are inverted on the way out.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno is set, and a partial and invalid file may
+/// be left in the system.
+int BitImageSavePBM(BitImage bimg, const char* filename) ;
+
+/// Information queries
+
+/// Get binary image width
+int BitImageWidth(BitImage bimg) ;
+
+/// Get binary image height
+int BitImageHeight(BitImage bimg) ;
+
+/// Count the white pixels in bimg (with popcount).
+/// The number of black pixels is width*height minus this count.
+long BitImageCount(BitImage bimg) ;
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitImageGetPixel(BitImage bimg, int x, int y) ;
+
+/// Set the pixel at position (x,y) to bit (0 or 1).
+void BitImageSetPixel(BitImage bimg, int x, int y, int bit) ;
+
+/// Operations
+
+/// Transform binary image to its negative, in-place.
+void BitImageNegative(BitImage bimg) ;
+
+/// Crop a rectangular subimage from bimg.
+/// Requires: the rectangle (x,y,w,h) must be inside bimg.
+/// On failure, returns NULL and errno is set accordingly.
+BitImage BitImageCrop(BitImage bimg, int x, int y, int w, int h) ;
+
+/// Paste bimg2 into position (x, y) of bimg1, in-place.
+/// Requires: bimg2 must fit inside bimg1 at position (x, y).
+void BitImagePaste(BitImage bimg1, int x, int y, BitImage bimg2) ;
+
+/// Returns 1 (true) if bimg2 matches the subimage of bimg1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: bimg2 must fit inside bimg1 at position (x, y).
+int BitImageMatchSubImage(BitImage bimg1, int x, int y, BitImage bimg2) ;
+
+/// Locate bimg2 inside bimg1, as ImageLocateSubImage.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage bimg1, int* px, int* py, BitImage bimg2) ;
+
+#endif
@@ -23,21 +23,43 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "instrumentation.h"
+#include "parallel.h"
+#include "pgmReader.h"
+#include "pixelPool.h"
+#include "tileCodec.h"
 
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing 5 fields:
 // Two integers store the image width and height.
 // The other field is a pointer to an array that stores the 8-bit gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
-// For example, in a 100-pixel wide image (img->width == 100),
+// Each row occupies img->stride bytes, which is the width rounded up to a
+// multiple of ROWALIGN, so that every row starts at an aligned address
+// (the pixel array itself is aligned to ROWALIGN, see pixelPool.h).
+// The padding bytes at the end of each row are not part of the image.
+// For example, in a 100-pixel wide image (img->stride == 128),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
-//   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//   pixel position (x,y) = (22,1) is stored in img->pixel[150].
+//
+// A sparse image (see ImageCreateSparse) has no pixel array.  Its pixels
+// are stored in square tiles of TILESIZE x TILESIZE pixels, which are only
+// allocated when written.  img->tiles has a pointer per tile, in raster
+// order, which is NULL for tiles never written: those read as 0.
+// Pixel (x,y) is stored at offset (y%TILESIZE)*TILESIZE + x%TILESIZE of
+// tile (x/TILESIZE, y/TILESIZE).
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -46,13 +68,24 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Alignment of rows in the pixel array (a cache line)
+#define ROWALIGN 64
+
+// Side of the tiles of sparse images (a multiple of ROWALIGN)
+#define TILESIZE 256
+#define TILEBYTES ((size_t)TILESIZE * TILESIZE)
+
 // Internal structure for storing 8-bit graymap images
 struct image
 {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
+  int stride;   // distance in bytes between the starts of consecutive rows
+  size_t size;  // size in bytes of the pixel array
   uint8 *pixel; // pixel data (a raster scan)
+  uint8 **tiles; // tiles of a sparse image (NULL for normal images)
+  int tilesx;   // number of columns of tiles
 };
 
 // This module follows "design-by-contract" principles.
@@ -77,8 +110,8 @@ struct image
 // Variable to preserve errno temporarily
 static int errsave = 0;
 
-// Error cause
-static char *errCause;
+// Error cause (one per thread, so concurrent clients get their own)
+static _Thread_local char *errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -142,32 +175,51 @@ static int check(int condition, const char *failmsg)
 }
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of instrumentation counters.
+/// (Calibration is deferred until InstrPrint needs it.)
 void ImageInit(void)
 { ///
-  InstrCalibrate();
-  InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
-  // Name other counters here...
+  // Os contadores estão definidos em instrumentation.h
+  InstrName[INSTR_PIXMEM] = "pixmem";
+  InstrName[INSTR_POOLHIT] = "poolhit";
+  InstrName[INSTR_POOLMISS] = "poolmiss";
+  InstrName[INSTR_COWCOPY] = "cowcopy";
+}
+
+/// Version of the library in use (see IMAGE8BIT_VERSION).
+int ImageVersion(void)
+{ ///
+  return IMAGE8BIT_VERSION;
 }
 
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-// Add more macros here...
+#define PIXMEM InstrCount[INSTR_PIXMEM]
+#define POOLHIT InstrCount[INSTR_POOLHIT]
+#define POOLMISS InstrCount[INSTR_POOLMISS]
+#define COWCOPY InstrCount[INSTR_COWCOPY]
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval)
-{ ///
+// Pointer to the first pixel of row y of img.
+static inline uint8 *row(Image img, int y)
+{
+  return img->pixel + (size_t)img->stride * y;
+}
+
+// Pixel loops for 8-bit pixels: negativeRow8, blendRow8, etc.
+#define PIXEL uint8
+#define PIXELSUM float
+#define KERNEL(name) name##8
+#include "pixelKernels.h"
+
+// Create a new image, with pixels set to zero if zero is nonzero,
+// or left uninitialized otherwise.
+// Pixel buffers come from the pixel pool (see pixelPool.h).
+static Image imageNew(int width, int height, uint8 maxval, int zero)
+{
+  _Static_assert(POOL_ALIGN % ROWALIGN == 0, "pool buffers must be row-aligned");
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
@@ -186,9 +238,16 @@ Image ImageCreate(int width, int height, uint8 maxval)
   createdImage->width = width;
   createdImage->height = height;
   createdImage->maxval = maxval;
+  // Linhas arredondadas a um múltiplo de ROWALIGN bytes
+  createdImage->stride = (width + ROWALIGN - 1) / ROWALIGN * ROWALIGN;
+  createdImage->tiles = NULL;
+  createdImage->tilesx = 0;
 
-  // Usando o calloc a memória será inicializada com o valor 0
-  createdImage->pixel = calloc(width * height, sizeof(uint8));
+  // Buffer do pool, inicializado a 0 apenas se pedido
+  size_t size = (size_t)createdImage->stride * height * sizeof(uint8);
+  createdImage->size = size;
+  int hit;
+  createdImage->pixel = zero ? PoolCalloc(size, &hit) : PoolAlloc(size, &hit);
 
   if (createdImage->pixel == NULL) // Se houver erros na alocação de memória para os pixeis
   {
@@ -197,10 +256,247 @@ Image ImageCreate(int width, int height, uint8 maxval)
     errno = 12; // número 12 para errno significa falha de alocação de memória
     return NULL;
   }
+  if (hit)
+    POOLHIT += 1;
+  else
+    POOLMISS += 1;
 
   return createdImage;
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval)
+{ ///
+  return imageNew(width, height, maxval, 1);
+}
+
+/// Create a new image with undefined pixel levels.
+/// Same as ImageCreate, but pixels are not initialized, which saves
+/// time when the caller is going to set every pixel anyway.
+Image ImageCreateUninitialized(int width, int height, uint8 maxval)
+{ ///
+  return imageNew(width, height, maxval, 0);
+}
+
+// Number of tiles of sparse image img.
+static size_t numTiles(Image img)
+{
+  return (size_t)img->tilesx * ((img->height + TILESIZE - 1) / TILESIZE);
+}
+
+/// Create a new sparse black image.
+/// Same as ImageCreate, but pixels are stored in tiles that are only
+/// allocated when written, so huge, mostly black images (such as a canvas
+/// for a mosaic) take little memory.
+/// Sparse images may only be used by: ImageGetPixel, ImageSetPixel,
+/// ImageGetRow, ImageSetRow, ImageSave, ImageStats, ImageCrop (the
+/// source), ImagePaste and ImageBlend (img1, the destination), ImageClone,
+/// and the information queries.  Other operations require normal images.
+/// When writing to a sparse image needs a tile that cannot be allocated,
+/// the operation leaves the image unchanged, as for clones (see ImageClone).
+Image ImageCreateSparse(int width, int height, uint8 maxval)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+
+  Image img = malloc(sizeof(struct image));
+  if (img == NULL)
+  {
+    errCause = "Não foi possível alocar memória para nova imagem";
+    errno = 12;
+    return NULL;
+  }
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->stride = 0; // sem array de pixeis
+  img->size = 0;
+  img->pixel = NULL;
+  img->tilesx = (width + TILESIZE - 1) / TILESIZE;
+  size_t ntiles = numTiles(img);
+  img->tiles = calloc(ntiles > 0 ? ntiles : 1, sizeof(uint8 *)); // todos os tiles por escrever
+  if (img->tiles == NULL)
+  {
+    free(img);
+    errCause = "Não foi possível alocar memória para os tiles da nova imagem";
+    errno = 12;
+    return NULL;
+  }
+  return img;
+}
+
+/// Check if img is sparse (created by ImageCreateSparse, or a clone of one).
+int ImageIsSparse(Image img)
+{ ///
+  assert(img != NULL);
+  return img->tiles != NULL;
+}
+
+// Tile of sparse img that contains pixel (x,y) (NULL if never written).
+static inline uint8 *tileAt(Image img, int x, int y)
+{
+  return img->tiles[(size_t)(y / TILESIZE) * img->tilesx + x / TILESIZE];
+}
+
+// Offset of pixel (x,y) in its tile.
+static inline size_t tileOffset(int x, int y)
+{
+  return (size_t)(y % TILESIZE) * TILESIZE + x % TILESIZE;
+}
+
+// Make the tile of sparse img that contains pixel (x,y) writable: allocate
+// it (black) if it was never written, or copy it if it is shared with clones.
+// Returns the tile, or NULL (and errno/errCause are set) if out of memory.
+static uint8 *writableTile(Image img, int x, int y)
+{
+  uint8 **tile = &img->tiles[(size_t)(y / TILESIZE) * img->tilesx + x / TILESIZE];
+  if (*tile != NULL && !PoolShared(*tile))
+    return *tile;
+  int hit;
+  uint8 *newTile = PoolAlloc(TILEBYTES, &hit);
+  if (newTile == NULL)
+  {
+    errCause = "Não foi possível alocar memória para um tile da imagem";
+    errno = 12;
+    return NULL;
+  }
+  if (hit)
+    POOLHIT += 1;
+  else
+    POOLMISS += 1;
+  if (*tile == NULL)
+    memset(newTile, 0, TILEBYTES);
+  else
+  { // tile partilhado com clones: copiá-lo
+    memcpy(newTile, *tile, TILEBYTES);
+    COWCOPY += 1;
+    PoolFree(*tile);
+  }
+  *tile = newTile;
+  return newTile;
+}
+
+// Make all tiles of sparse img that meet rectangle (x,y,w,h) writable.
+// Returns nonzero on success.  On failure, the pixels of img are unchanged
+// (newly allocated tiles are black, as before).
+static int writableRect(Image img, int x, int y, int w, int h)
+{
+  if (w <= 0 || h <= 0)
+    return 1;
+  for (int ty = y / TILESIZE; ty <= (y + h - 1) / TILESIZE; ty++)
+    for (int tx = x / TILESIZE; tx <= (x + w - 1) / TILESIZE; tx++)
+      if (writableTile(img, tx * TILESIZE, ty * TILESIZE) == NULL)
+        return 0;
+  return 1;
+}
+
+// Copy n pixels of row y of sparse img, from x on, to buf.
+static void sparseGetRow(Image img, int x, int y, int n, uint8 *buf)
+{
+  while (n > 0)
+  { // um segmento por tile
+    int len = TILESIZE - x % TILESIZE;
+    if (len > n)
+      len = n;
+    const uint8 *tile = tileAt(img, x, y);
+    if (tile != NULL)
+      memcpy(buf, tile + tileOffset(x, y), (size_t)len);
+    else
+      memset(buf, 0, (size_t)len);
+    buf += len;
+    x += len;
+    n -= len;
+  }
+}
+
+/// Clone an image.
+/// Returns a new image with the same size, maxval and pixels as img, in
+/// constant time: both images share one pixel array until either of them
+/// is modified in-place, which first gives that image a private copy
+/// (copy-on-write).  If the copy cannot be allocated, the in-place
+/// operation leaves the image unchanged, and errno/errCause are set.
+/// Clones are destroyed with ImageDestroy, as any other image.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img)
+{ ///
+  assert(img != NULL);
+
+  Image clone = malloc(sizeof(struct image));
+  if (clone == NULL)
+  {
+    errCause = "Não foi possível alocar memória para nova imagem";
+    errno = 12;
+    return NULL;
+  }
+  *clone = *img; // mesmas dimensões e o mesmo array de pixeis
+  if (img->tiles != NULL)
+  { // imagem esparsa: partilhar cada tile
+    size_t ntiles = numTiles(img);
+    clone->tiles = malloc((ntiles > 0 ? ntiles : 1) * sizeof(uint8 *));
+    if (clone->tiles == NULL)
+    {
+      free(clone);
+      errCause = "Não foi possível alocar memória para os tiles da nova imagem";
+      errno = 12;
+      return NULL;
+    }
+    for (size_t t = 0; t < ntiles; t++)
+    {
+      clone->tiles[t] = img->tiles[t];
+      if (clone->tiles[t] != NULL)
+        PoolRetain(clone->tiles[t]);
+    }
+  }
+  else
+    PoolRetain(clone->pixel); // que passa a ter mais uma referência
+  return clone;
+}
+
+// Give img a private copy of its shared pixel array (see unshare).
+static int unshareCopy(Image img)
+{
+  int hit;
+  uint8 *copy = PoolAlloc(img->size, &hit);
+  if (copy == NULL)
+  {
+    errCause = "Não foi possível alocar memória para os pixeis da imagem";
+    errno = 12;
+    return 0;
+  }
+  if (hit)
+    POOLHIT += 1;
+  else
+    POOLMISS += 1;
+  COWCOPY += 1;
+  memcpy(copy, img->pixel, img->size);
+  PIXMEM += 2 * (unsigned long)img->width * img->height; // copiar cada pixel
+  PoolFree(img->pixel); // largar a referência ao array partilhado
+  img->pixel = copy;
+  return 1;
+}
+
+// Give img a private copy of its pixel array, if it is shared with clones.
+// Must be called before modifying the pixels of img in-place.
+// Inline, as it is cheap when the array is not shared (ImageSetPixel).
+// Returns nonzero on success.
+// On failure, returns 0, errno/errCause are set, and img is not modified.
+static inline int unshare(Image img)
+{
+  assert(img->tiles == NULL); // os tiles de imagens esparsas são tratados à parte
+  return !PoolShared(img->pixel) || unshareCopy(img);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -209,8 +505,17 @@ Image ImageCreate(int width, int height, uint8 maxval)
 void ImageDestroy(Image *imgp)
 { ///
   assert(imgp != NULL);
-
-  free((*imgp)->pixel); // libertar memória alocada para o array pixel de imgp
+  if (*imgp == NULL)
+    return;
+
+  if ((*imgp)->tiles != NULL)
+  { // imagem esparsa: devolver os tiles escritos
+    size_t ntiles = numTiles(*imgp);
+    for (size_t t = 0; t < ntiles; t++)
+      PoolFree((*imgp)->tiles[t]);
+    free((*imgp)->tiles);
+  }
+  PoolFree((*imgp)->pixel); // devolver o array pixel de imgp ao pool
   free(*imgp);          // libertar memória associada com imgp
   *imgp = NULL;         // faz com que o ponteiro para imgp se torne NULL por razões de segurança
 }
@@ -220,49 +525,334 @@ void ImageDestroy(Image *imgp)
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE *f)
+// Read the packed rows of a raw PGM file into the (padded) rows of img.
+// Returns nonzero if all rows were read.
+static int readRows(Image img, PgmReader r)
+{
+  if (img->stride == img->width) // sem padding: ler tudo de uma vez
+    return PgmReadBytes(r, img->pixel, img->size);
+  for (int y = 0; y < img->height; y++)
+    if (!PgmReadBytes(r, row(img, y), (size_t)img->width))
+      return 0;
+  return 1;
+}
+
+// Read the levels of a plain PGM file into the rows of img.
+// Returns nonzero if all levels were read and are not above maxval.
+static int readPlainRows(Image img, PgmReader r)
+{
+  for (int y = 0; y < img->height; y++)
+    if (!PgmReadPlain8(r, row(img, y), img->width, img->maxval))
+      return 0;
+  return 1;
+}
+
+// Write the (padded) rows of img as the packed rows of a raw PGM file.
+// Returns nonzero if all rows were written.
+static int writeRows(Image img, FILE *f)
+{
+  static const uint8 zeros[TILESIZE]; // tiles por escrever
+  if (img->tiles != NULL)
+  { // imagem esparsa: escrever cada linha tile a tile
+    for (int y = 0; y < img->height; y++)
+      for (int x = 0; x < img->width; x += TILESIZE)
+      {
+        int len = img->width - x < TILESIZE ? img->width - x : TILESIZE;
+        const uint8 *tile = tileAt(img, x, y);
+        const uint8 *src = tile != NULL ? tile + tileOffset(x, y) : zeros;
+        if (fwrite(src, sizeof(uint8), len, f) != (size_t)len)
+          return 0;
+      }
+    return 1;
+  }
+  if (img->stride == img->width)
+    return fwrite(img->pixel, sizeof(uint8), img->size, f) == img->size;
+  for (int y = 0; y < img->height; y++)
+    if (fwrite(img->pixel + (size_t)y * img->stride, sizeof(uint8), img->width, f) != (size_t)img->width)
+      return 0;
+  return 1;
+}
+
+// Levels per line of a plain PGM file ("255 " x 17 = 68 < 70 characters).
+#define PLAINPERLINE 17
+
+// Size of the output buffer for plain PGM files
+#define WRITEBUF 65536
+
+// Write the rows of img as the levels of a plain PGM file.
+// Each level is formatted in a 32-bit word, "ddd " with the leading zeros
+// shifted out, and stored with a single 4-byte copy.
+// Returns nonzero if all levels were written.
+static int writePlainRows(Image img, FILE *f)
+{
+  char *out = malloc(WRITEBUF + 4 * PLAINPERLINE);
+  uint8 *line = malloc(img->width > 0 ? (size_t)img->width : 1); // para imagens esparsas
+  int success = out != NULL && line != NULL;
+  size_t n = 0;
+  for (int y = 0; success && y < img->height; y++)
+  {
+    const uint8 *src;
+    if (img->tiles != NULL)
+    {
+      sparseGetRow(img, 0, y, img->width, line);
+      src = line;
+    }
+    else
+      src = img->pixel + (size_t)y * img->stride;
+    for (int x = 0; x < img->width; x += PLAINPERLINE)
+    {
+      int end = img->width - x < PLAINPERLINE ? img->width : x + PLAINPERLINE;
+      for (int i = x; i < end; i++)
+      {
+        unsigned v = src[i];
+        int len = 1 + (v >= 10) + (v >= 100); // número de dígitos
+        uint32_t word = (uint32_t)('0' + v / 100) | (uint32_t)('0' + v / 10 % 10) << 8 |
+                        (uint32_t)('0' + v % 10) << 16 | (uint32_t)' ' << 24;
+        word >>= 8 * (3 - len);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        memcpy(out + n, &word, sizeof(word));
+        n += (size_t)len + 1;
+      }
+      out[n - 1] = '\n'; // o último espaço da linha passa a fim de linha
+      if (n >= WRITEBUF)
+      {
+        success = fwrite(out, 1, n, f) == n;
+        n = 0;
+      }
+    }
+  }
+  if (success && n > 0)
+    success = fwrite(out, 1, n, f) == n;
+  free(line);
+  free(out);
+  return success;
+}
+
+// A tiled file has a header, with little-endian 32-bit fields:
+//   "IMT1", width, height, maxval, tile size
+// followed by an index of ntiles+1 little-endian 64-bit file offsets, and
+// the tiles, coded by TileEncode, in raster order: tile t is stored from
+// offset index[t] up to index[t+1].
+// Tiles are square, except those on the right and bottom edges, which are
+// cut at the image size.  Since each tile is coded on its own, any region
+// may be loaded by reading and decoding just the tiles it touches.
+#define TILEDMAGIC "IMT1"
+#define TILEDHEADER 20
+#define TILEDMAXSIZE 4096 // maior tamanho de tile aceite ao ler
+
+// Number of tiles coded in each parallel batch when saving
+#define TILEDBATCH 64
+
+static void put32(uint8 *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = (uint8)(v >> 8 * i);
+}
+
+static void put64(uint8 *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = (uint8)(v >> 8 * i);
+}
+
+static uint32_t get32(const uint8 *p)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static uint64_t get64(const uint8 *p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Check if the open file f is a tiled file, and rewind it.
+static int isTiled(FILE *f)
+{
+  char magic[4];
+  int tiled = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+              memcmp(magic, TILEDMAGIC, sizeof(magic)) == 0;
+  rewind(f);
+  return tiled;
+}
+
+// Work shared by the threads of loadTiled: the tiles touched by a region
+// of the image in a tiled file, ntx per row, from tile (tx0, ty0), are
+// decoded into img, which holds the region.
+typedef struct
+{
+  int fd;
+  int width, height; // da imagem no ficheiro
+  int tilesize;
+  int tilesx;
+  const uint8 *index;
+  Image img;
+  int x, y; // posição da região
+  int tx0, ty0, ntx;
+  int64_t ntouched; // tiles tocados pela região
+  int per;          // tiles por item de ParallelFor
+  int failed;
+} TiledLoad;
+
+// Read and decode the k-th tile touched by the region.
+static void decodeTile(TiledLoad *l, int64_t k)
+{
+  Image img = l->img;
+  int ts = l->tilesize;
+  int tx = l->tx0 + (int)(k % l->ntx);
+  int ty = l->ty0 + (int)(k / l->ntx);
+  size_t t = (size_t)ty * l->tilesx + tx;
+  uint64_t start = get64(l->index + 8 * t);
+  uint64_t end = get64(l->index + 8 * (t + 1));
+  int x0 = tx * ts;
+  int y0 = ty * ts;
+  int w = l->width - x0 < ts ? l->width - x0 : ts;
+  int h = l->height - y0 < ts ? l->height - y0 : ts;
+  // intersecção do tile com a região
+  int ix0 = x0 > l->x ? x0 : l->x;
+  int iy0 = y0 > l->y ? y0 : l->y;
+  int ix1 = x0 + w < l->x + img->width ? x0 + w : l->x + img->width;
+  int iy1 = y0 + h < l->y + img->height ? y0 + h : l->y + img->height;
+  size_t n = (size_t)(end - start);
+  uint8 *coded = NULL;
+  uint8 *buf = NULL;
+
+  int ok = start <= end && n <= TileBound(w, h) &&
+           (coded = malloc(n > 0 ? n : 1)) != NULL &&
+           pread(l->fd, coded, n, (off_t)start) == (ssize_t)n;
+  if (ok && ix0 == x0 && iy0 == y0 && ix1 == x0 + w && iy1 == y0 + h)
+    // tile todo dentro da região: descodificar diretamente na imagem
+    ok = TileDecode(coded, n, row(img, y0 - l->y) + (x0 - l->x), img->stride, w, h);
+  else if (ok)
+  { // descodificar à parte e copiar a intersecção
+    ok = (buf = malloc((size_t)w * h)) != NULL && TileDecode(coded, n, buf, (size_t)w, w, h);
+    for (int y = iy0; ok && y < iy1; y++)
+      memcpy(row(img, y - l->y) + (ix0 - l->x), buf + (size_t)(y - y0) * w + (ix0 - x0), (size_t)(ix1 - ix0));
+  }
+  free(buf);
+  free(coded);
+  if (!ok)
+    __atomic_store_n(&l->failed, 1, __ATOMIC_RELAXED);
+}
+
+// Read and decode the k-th group of l->per tiles touched by the region
+// (there may be more tiles than ParallelFor items).
+static void decodeTiles(void *arg, int k)
+{
+  TiledLoad *l = arg;
+  int64_t end = ((int64_t)k + 1) * l->per;
+  for (int64_t t = (int64_t)k * l->per; t < end && t < l->ntouched; t++)
+    decodeTile(l, t);
+}
+
+// Load the region (x, y, w, h) of the image in the tiled file f (w < 0
+// loads the whole image).
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image loadTiled(FILE *f, int x, int y, int w, int h)
 {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n')
+  uint8 header[TILEDHEADER];
+  TiledLoad l = {fileno(f), 0, 0, 0, 0, NULL, NULL, x, y, 0, 0, 0, 0, 1, 0};
+  uint8 *index = NULL;
+  Image img = NULL;
+  uint64_t ntiles = 0;
+  int maxval = 0;
+  struct stat st;
+  int indexFits = 0;
+
+  int success =
+      check(fread(header, 1, TILEDHEADER, f) == TILEDHEADER, "Invalid file format") &&
+      check(get32(header + 4) <= INT_MAX && get32(header + 8) <= INT_MAX, "Invalid width or height") &&
+      check((maxval = (int)get32(header + 12)) > 0 && maxval <= (int)PixMax, "Invalid maxval") &&
+      check((l.tilesize = (int)get32(header + 16)) > 0 && l.tilesize <= TILEDMAXSIZE, "Invalid tile size");
+  if (success)
+  {
+    l.width = (int)get32(header + 4);
+    l.height = (int)get32(header + 8);
+    l.tilesx = (int)(((int64_t)l.width + l.tilesize - 1) / l.tilesize);
+    ntiles = (uint64_t)l.tilesx * (uint64_t)(((int64_t)l.height + l.tilesize - 1) / l.tilesize);
+    if (w < 0)
+    {
+      l.x = l.y = 0;
+      w = l.width;
+      h = l.height;
+    }
+    // o índice (ntiles+1 offsets de 8 bytes) tem de caber no ficheiro
+    indexFits = fstat(l.fd, &st) == 0 && st.st_size >= TILEDHEADER &&
+                ntiles < (uint64_t)(st.st_size - TILEDHEADER) / 8;
+    if (!(0 <= l.x && l.x <= l.width - w && 0 <= l.y && l.y <= l.height - h) || !indexFits)
+      errno = EINVAL;
+  }
+  success = success &&
+            check(0 <= l.x && l.x <= l.width - w && 0 <= l.y && l.y <= l.height - h, "Region outside image") &&
+            check(indexFits, "Invalid index") &&
+            check((index = malloc(8 * ((size_t)ntiles + 1))) != NULL, "Out of memory") &&
+            check(fread(index, 8, ntiles + 1, f) == ntiles + 1, "Reading index failed") &&
+            (img = ImageCreateUninitialized(w, h, (uint8)maxval)) != NULL;
+  if (success && w > 0 && h > 0)
+  {
+    l.index = index;
+    l.img = img;
+    l.tx0 = l.x / l.tilesize;
+    l.ty0 = l.y / l.tilesize;
+    l.ntx = (l.x + w - 1) / l.tilesize - l.tx0 + 1;
+    int nty = (l.y + h - 1) / l.tilesize - l.ty0 + 1;
+    l.ntouched = (int64_t)l.ntx * nty;
+    l.per = (int)((l.ntouched + INT_MAX - 1) / INT_MAX);
+    ParallelFor("loadtiled", (int)((l.ntouched + l.per - 1) / l.per), decodeTiles, &l);
+    if (l.failed)
+      errno = EINVAL;
+    success = check(!l.failed, "Reading pixels");
+  }
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
+
+  // Cleanup
+  if (!success)
   {
-    i++;
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
   }
-  return i;
+  free(index);
+  return img;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char *filename)
-{ ///
-  int w, h;
+// Parse a PGM header, up to the whitespace before the pixels.
+// Returns nonzero on success, or 0 and sets errCause.
+static int readHeader(PgmReader r, int *w, int *h, int *maxval, int *plain)
+{
+  return check(PgmReadMagic(r, plain), "Invalid file format") &&
+         PgmSkipComments(r) >= 0 &&
+         check(PgmReadNumber(r, w) && *w >= 0, "Invalid width") &&
+         PgmSkipComments(r) >= 0 &&
+         check(PgmReadNumber(r, h) && *h >= 0, "Invalid height") &&
+         PgmSkipComments(r) >= 0 &&
+         check(PgmReadNumber(r, maxval) && 0 < *maxval && *maxval <= (int)PixMax, "Invalid maxval") &&
+         check(PgmSkipOneWhite(r), "Whitespace expected");
+}
+
+// Read a PGM image, header and pixels, from r.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image readImage(PgmReader r)
+{
+  int w = 0, h = 0;
   int maxval;
-  char c;
-  FILE *f = NULL;
+  int plain;
   Image img = NULL;
 
   int success =
-      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
-      // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      readHeader(r, &w, &h, &maxval, &plain) &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      (img = ImageCreateUninitialized(w, h, (uint8)maxval)) != NULL &&
       // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h, "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check(plain ? readPlainRows(img, r) : readRows(img, r), "Reading pixels");
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
 
   // Cleanup
   if (!success)
@@ -271,6 +861,33 @@ Image ImageLoad(const char *filename)
     ImageDestroy(&img);
     errno = errsave;
   }
+  return img;
+}
+
+/// Load a PGM file, raw (P5) or plain (P2), or a tiled file.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char *filename)
+{ ///
+  FILE *f = NULL;
+  PgmReader r = NULL;
+  Image img = NULL;
+
+  if ((f = fopen(filename, "rb")) != NULL && isTiled(f))
+  { // ficheiro em tiles (ver ImageSaveTiled)
+    img = loadTiled(f, 0, 0, -1, -1);
+    fclose(f);
+    return img;
+  }
+
+  if (check(f != NULL, "Open failed") &&
+      check((r = PgmReaderCreate(f)) != NULL, "Out of memory"))
+    img = readImage(r);
+
+  // Cleanup
+  PgmReaderDestroy(&r);
   if (f != NULL)
     fclose(f);
   return img;
@@ -291,8 +908,8 @@ int ImageSave(Image img, const char *filename)
   int success =
       check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
       check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
-      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h, "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check(writeRows(img, f), "Writing pixels failed");
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
 
   // Cleanup
   if (f != NULL)
@@ -300,56 +917,733 @@ int ImageSave(Image img, const char *filename)
   return success;
 }
 
-/// Information queries
-
-/// These functions do not modify the image and never fail.
-
-/// Get image width
-int ImageWidth(Image img)
+/// Save image to plain PGM file (P2).
+/// Same as ImageSave, but levels are written as decimal numbers.
+int ImageSavePlain(Image img, const char *filename)
 { ///
   assert(img != NULL);
-  return img->width;
-}
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  FILE *f = NULL;
 
-/// Get image height
-int ImageHeight(Image img)
-{ ///
-  assert(img != NULL);
-  return img->height;
-}
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P2\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
+      check(writePlainRows(img, f), "Writing pixels failed");
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
 
-/// Get image maximum gray level
-int ImageMaxval(Image img)
-{ ///
-  assert(img != NULL);
-  return img->maxval;
+  // Cleanup
+  if (f != NULL && fclose(f) != 0 && success)
+    success = check(0, "Writing pixels failed");
+  return success;
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8 *min, uint8 *max)
-{ ///
-  assert(img != NULL);
-
-  uint8 *maxpixel, *minpixel; // criar ponteiros para guardar o pixel com valor máximo e minimo da imagem
-  // iniciar ponteiros
-  maxpixel = &(img->pixel[0]);
-  minpixel = &(img->pixel[0]);
+/// In-memory files
 
-  for (int i = 1; i < img->width * img->height; i++)
-  { // percorrer o array de pixeis
-    if (*maxpixel < img->pixel[i])
-      maxpixel = &(img->pixel[i]); // fornecer novo valor ao maxpixel
+/// Load an image from the len bytes of a PGM file at buf.
+/// The bytes are read through a memory stream (fmemopen), so the parsing
+/// is the same as in ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadFromBuffer(const void *buf, size_t len)
+{ ///
+  assert(buf != NULL || len == 0);
+  FILE *f = NULL;
+  PgmReader r = NULL;
+  Image img = NULL;
 
-    if (*minpixel > img->pixel[i])
-      minpixel = &(img->pixel[i]); // fornecer novo valor ao minpixel
-  }
+  // fmemopen não aceita buffers vazios, mas esses também não têm imagem
+  if (!check(len > 0, "Invalid file format"))
+    errno = EINVAL;
+  else if (check((f = fmemopen((void *)buf, len, "rb")) != NULL, "Open failed") &&
+           check((r = PgmReaderCreate(f)) != NULL, "Out of memory"))
+    img = readImage(r);
 
-  *min = *minpixel;
-  *max = *maxpixel;
+  // Cleanup
+  PgmReaderDestroy(&r);
+  if (f != NULL)
+    fclose(f);
+  return img;
+}
+
+/// Save image in raw PGM format to a new buffer.
+/// The buffer is allocated with its final size, and the rows are copied
+/// into it after the header.
+/// On success, returns nonzero, and (*buf) and (*len) are set.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageSaveToBuffer(Image img, void **buf, size_t *len)
+{ ///
+  assert(img != NULL);
+  assert(buf != NULL && len != NULL);
+  int w = img->width;
+  int h = img->height;
+  char header[32];
+  int hlen = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", w, h, img->maxval);
+  size_t size = (size_t)hlen + (size_t)w * h;
+  uint8 *data = malloc(size);
+  if (!check(data != NULL, "Out of memory"))
+    return 0;
+
+  memcpy(data, header, (size_t)hlen);
+  uint8 *dst = data + hlen;
+  for (int y = 0; y < h; y++, dst += w)
+    if (img->tiles != NULL)
+      sparseGetRow(img, 0, y, w, dst);
+    else
+      memcpy(dst, row(img, y), (size_t)w);
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
+
+  *buf = data;
+  *len = size;
+  return 1;
+}
+
+/// PGM streams
+
+// A stream is read with one PgmReader, frame after frame.
+// The index of frames (their file offsets) is built on demand, by parsing
+// the headers and skipping the pixels of raw frames.
+struct imageStream
+{
+  FILE *f;
+  PgmReader r;       // NULL for streams being written
+  long long *index;  // file offsets of the frames, or NULL if not built yet
+  int nframes;       // number of frames in the index
+};
+
+/// Open a PGM stream for reading.
+ImageStream ImageStreamOpen(const char *filename)
+{ ///
+  ImageStream s = calloc(1, sizeof(*s));
+  int success =
+      check(s != NULL, "Out of memory") &&
+      check((s->f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check((s->r = PgmReaderCreate(s->f)) != NULL, "Out of memory");
+  if (!success)
+  {
+    errsave = errno;
+    ImageStreamClose(&s);
+    errno = errsave;
+    return NULL;
+  }
+  // ler antecipadamente: o ficheiro é lido do princípio ao fim
+  posix_fadvise(fileno(s->f), 0, 0, POSIX_FADV_SEQUENTIAL);
+  return s;
+}
+
+/// Create a PGM stream for writing (or truncate an existing file).
+ImageStream ImageStreamCreate(const char *filename)
+{ ///
+  ImageStream s = calloc(1, sizeof(*s));
+  int success =
+      check(s != NULL, "Out of memory") &&
+      check((s->f = fopen(filename, "wb")) != NULL, "Open failed");
+  if (!success)
+  {
+    errsave = errno;
+    ImageStreamClose(&s);
+    errno = errsave;
+    return NULL;
+  }
+  return s;
+}
+
+/// Check if there are no more frames to read.
+int ImageStreamEnd(ImageStream s)
+{ ///
+  assert(s != NULL && s->r != NULL);
+  PgmSkipComments(s->r); // espaços entre imagens
+  return PgmAtEnd(s->r);
+}
+
+/// Read the next frame.
+Image ImageStreamRead(ImageStream s)
+{ ///
+  assert(s != NULL && s->r != NULL);
+  PgmSkipComments(s->r);
+  return readImage(s->r);
+}
+
+/// Count the frames of the stream, building the index if needed.
+int ImageStreamCount(ImageStream s)
+{ ///
+  assert(s != NULL && s->r != NULL);
+  if (s->index != NULL)
+    return s->nframes;
+  long long here = PgmTell(s->r);
+  int cap = 0;
+  int n = 0;
+  long long *index = NULL;
+  uint8 *line = NULL;
+  int success = check(PgmSeek(s->r, 0), "Seek failed");
+  while (success && !ImageStreamEnd(s))
+  {
+    int w, h, maxval, plain;
+    if (n == cap)
+    {
+      cap = cap > 0 ? 2 * cap : 64;
+      long long *bigger = realloc(index, sizeof(long long) * cap);
+      if (!(success = check(bigger != NULL, "Out of memory")))
+        break;
+      index = bigger;
+    }
+    index[n++] = PgmTell(s->r);
+    success = readHeader(s->r, &w, &h, &maxval, &plain);
+    if (success && !plain)
+      success = check(PgmSkipBytes(s->r, (size_t)w * h), "Reading pixels");
+    else if (success)
+    { // imagem plain: é preciso ler os níveis para os saltar
+      free(line);
+      success = check((line = malloc(w > 0 ? (size_t)w : 1)) != NULL, "Out of memory");
+      for (int y = 0; success && y < h; y++)
+        success = check(PgmReadPlain8(s->r, line, w, maxval), "Reading pixels");
+    }
+  }
+  success = success && check(PgmSeek(s->r, here), "Seek failed");
+  free(line);
+  if (!success)
+  {
+    errsave = errno;
+    free(index);
+    errno = errsave;
+    return -1;
+  }
+  s->index = index;
+  s->nframes = n;
+  return n;
+}
+
+/// Read frame i (counting from 0) of the stream.
+Image ImageStreamFrame(ImageStream s, int i)
+{ ///
+  assert(s != NULL && s->r != NULL);
+  assert(i >= 0);
+  if (ImageStreamCount(s) < 0)
+    return NULL;
+  if (i >= s->nframes)
+  {
+    errno = EINVAL;
+    check(0, "No such frame");
+    return NULL;
+  }
+  if (!check(PgmSeek(s->r, s->index[i]), "Seek failed"))
+    return NULL;
+  return ImageStreamRead(s);
+}
+
+/// Write img as the next frame of the stream.
+int ImageStreamWrite(ImageStream s, Image img)
+{ ///
+  assert(s != NULL && s->r == NULL);
+  assert(img != NULL);
+  int success =
+      check(fprintf(s->f, "P5\n%d %d\n%u\n", img->width, img->height, img->maxval) > 0,
+            "Writing header failed") &&
+      check(writeRows(img, s->f), "Writing pixels failed");
+  PIXMEM += (unsigned long)img->width * img->height; // count pixel memory accesses
+  return success;
+}
+
+/// Close the stream pointed to by (*sp).
+int ImageStreamClose(ImageStream *sp)
+{ ///
+  assert(sp != NULL);
+  ImageStream s = *sp;
+  if (s == NULL)
+    return 1;
+  int success = 1;
+  PgmReaderDestroy(&s->r);
+  if (s->f != NULL && fclose(s->f) != 0)
+    success = check(0, "Writing pixels failed");
+  free(s->index);
+  free(s);
+  *sp = NULL;
+  return success;
+}
+
+/// Asynchronous saves
+
+// Maximum number of buffers per writev call (the POSIX minimum of IOV_MAX)
+#define SAVEIOV 1024
+
+// A save in progress
+struct imageSaveJob
+{
+  Image img;         // clone of the image being saved
+  char *filename;
+  int flags;
+  pthread_t thread;
+  int threaded;      // 0 if the save ran in the calling thread
+  int success;
+  int err;           // errno and errCause of a failure
+  const char *cause;
+};
+
+// Number of temporary files created, for their names
+static unsigned long tmpcount = 0;
+
+// Set (*piov) to an array with the header and the packed rows of img,
+// ready for writev.  Returns the number of buffers, or 0 if out of memory.
+static size_t saveBuffers(Image img, char *header, size_t hlen, struct iovec **piov)
+{
+  static uint8 zeros[TILESIZE]; // tiles por escrever (só lidos)
+  size_t n;
+  if (img->tiles != NULL)
+    n = 1 + (size_t)img->height * img->tilesx;
+  else if (img->stride == img->width)
+    n = 2;
+  else
+    n = 1 + (size_t)img->height;
+  struct iovec *iov = malloc(n * sizeof(struct iovec));
+  if (iov == NULL)
+    return 0;
+  iov[0].iov_base = header;
+  iov[0].iov_len = hlen;
+  size_t k = 1;
+  if (img->tiles != NULL)
+  { // imagem esparsa: cada linha tile a tile
+    for (int y = 0; y < img->height; y++)
+      for (int x = 0; x < img->width; x += TILESIZE)
+      {
+        uint8 *tile = tileAt(img, x, y);
+        iov[k].iov_base = tile != NULL ? tile + tileOffset(x, y) : zeros;
+        iov[k++].iov_len = (size_t)(img->width - x < TILESIZE ? img->width - x : TILESIZE);
+      }
+  }
+  else if (img->stride == img->width)
+  {
+    iov[k].iov_base = img->pixel;
+    iov[k++].iov_len = img->size;
+  }
+  else
+    for (int y = 0; y < img->height; y++)
+    {
+      iov[k].iov_base = row(img, y);
+      iov[k++].iov_len = (size_t)img->width;
+    }
+  *piov = iov;
+  return n;
+}
+
+// Write the n buffers of iov to fd, SAVEIOV buffers per writev call,
+// resuming after partial writes.  Returns nonzero if all were written.
+static int writeAll(int fd, struct iovec *iov, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t done = writev(fd, iov, n < SAVEIOV ? (int)n : SAVEIOV);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done < 0)
+      return 0;
+    // saltar os buffers escritos, e a parte escrita do seguinte
+    while (n > 0 && (size_t)done >= iov->iov_len)
+    {
+      done -= (ssize_t)iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0)
+    {
+      iov->iov_base = (uint8 *)iov->iov_base + done;
+      iov->iov_len -= (size_t)done;
+    }
+  }
+  return 1;
+}
+
+// Save job->img to a temporary file, and rename it to job->filename.
+// (Runs in the save thread: errCause is only set by ImageSaveWait.)
+static void *saveThread(void *arg)
+{
+  ImageSaveJob job = arg;
+  Image img = job->img;
+  char header[64];
+  int hlen = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", img->width, img->height, img->maxval);
+  size_t tmplen = strlen(job->filename) + 48;
+  char *tmp = malloc(tmplen);
+  struct iovec *iov = NULL;
+  size_t niov = 0;
+  int fd = -1;
+
+  job->cause = "Out of memory";
+  int success = tmp != NULL && (niov = saveBuffers(img, header, (size_t)hlen, &iov)) > 0;
+  if (success)
+  { // no mesmo diretório, para o rename ser atómico
+    snprintf(tmp, tmplen, "%s.tmp%ld.%lu", job->filename, (long)getpid(),
+             __atomic_add_fetch(&tmpcount, 1, __ATOMIC_RELAXED));
+    job->cause = "Open failed";
+    success = (fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666)) >= 0;
+  }
+  if (success)
+  {
+    job->cause = "Writing pixels failed";
+    success = writeAll(fd, iov, niov);
+    if (success && (job->flags & IMAGE_SAVE_DONTNEED))
+    { // só as páginas já escritas no disco podem ser largadas
+      success = fdatasync(fd) == 0;
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+  }
+  if (fd >= 0 && close(fd) != 0)
+    success = 0;
+  if (success)
+  {
+    job->cause = "Rename failed";
+    success = rename(tmp, job->filename) == 0;
+  }
+  job->success = success;
+  if (!success)
+  {
+    job->err = errno;
+    if (fd >= 0)
+      unlink(tmp);
+  }
+  free(iov);
+  free(tmp);
+  ImageDestroy(&job->img);
+  return NULL;
+}
+
+/// Save image to PGM file, in a background thread.
+/// If the thread cannot be created, the save runs in the calling thread.
+ImageSaveJob ImageSaveAsync(Image img, const char *filename, int flags)
+{ ///
+  assert(img != NULL);
+  assert(filename != NULL);
+  ImageSaveJob job = NULL;
+
+  int success =
+      check((job = calloc(1, sizeof(*job))) != NULL &&
+                (job->filename = strdup(filename)) != NULL,
+            "Out of memory") &&
+      (job->img = ImageClone(img)) != NULL;
+  PIXMEM += (unsigned long)img->width * img->height; // count pixel memory accesses
+
+  if (!success)
+  {
+    errsave = errno;
+    if (job != NULL)
+      free(job->filename);
+    free(job);
+    errno = errsave;
+    return NULL;
+  }
+  job->flags = flags;
+  job->threaded = pthread_create(&job->thread, NULL, saveThread, job) == 0;
+  if (!job->threaded)
+    saveThread(job);
+  return job;
+}
+
+/// Wait for the save (*jobp) to complete, and release it.
+int ImageSaveWait(ImageSaveJob *jobp)
+{ ///
+  assert(jobp != NULL && *jobp != NULL);
+  ImageSaveJob job = *jobp;
+  if (job->threaded)
+    pthread_join(job->thread, NULL);
+  int success = job->success;
+  if (!success)
+  { // (after a success, errno/errCause are preserved)
+    check(0, job->cause);
+    errno = job->err;
+  }
+  free(job->filename);
+  free(job);
+  *jobp = NULL;
+  return success;
+}
+
+/// Tiled image files
+
+// Work shared by the threads of ImageSaveTiled: tiles first .. first+n-1
+// of img are coded into out (bound bytes for each), with sizes in len.
+typedef struct
+{
+  Image img;
+  int tilesx;
+  size_t first;
+  size_t bound;
+  uint8 *out;
+  size_t *len;
+  int failed;
+} TiledSave;
+
+// Code tile first+k.
+static void encodeTile(void *arg, int k)
+{
+  TiledSave *s = arg;
+  Image img = s->img;
+  size_t t = s->first + (size_t)k;
+  int x0 = (int)(t % s->tilesx) * TILESIZE;
+  int y0 = (int)(t / s->tilesx) * TILESIZE;
+  int w = img->width - x0 < TILESIZE ? img->width - x0 : TILESIZE;
+  int h = img->height - y0 < TILESIZE ? img->height - y0 : TILESIZE;
+  uint8 *out = s->out + s->bound * k;
+  if (img->tiles != NULL && tileAt(img, x0, y0) == NULL)
+  { // tile esparso por escrever: tudo a preto
+    out[0] = TILE_UNIFORM;
+    out[1] = 0;
+    s->len[k] = 2;
+    return;
+  }
+  if (img->tiles != NULL)
+    s->len[k] = TileEncode(tileAt(img, x0, y0), TILESIZE, w, h, out);
+  else
+    s->len[k] = TileEncode(row(img, y0) + x0, img->stride, w, h, out);
+  if (s->len[k] == 0)
+    __atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+}
+
+/// Save image to a tiled file.
+/// Tiles are coded in parallel, in batches of TILEDBATCH, and written in
+/// order, and the index is written last.
+int ImageSaveTiled(Image img, const char *filename)
+{ ///
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  int tilesx = (w + TILESIZE - 1) / TILESIZE;
+  size_t ntiles = (size_t)tilesx * ((h + TILESIZE - 1) / TILESIZE);
+  size_t batch = ntiles > 0 && ntiles < TILEDBATCH ? ntiles : TILEDBATCH;
+  size_t indexSize = 8 * (ntiles + 1);
+  uint8 header[TILEDHEADER];
+  memcpy(header, TILEDMAGIC, 4);
+  put32(header + 4, (uint32_t)w);
+  put32(header + 8, (uint32_t)h);
+  put32(header + 12, img->maxval);
+  put32(header + 16, TILESIZE);
+  TiledSave s = {img, tilesx, 0, TileBound(TILESIZE, TILESIZE), NULL, NULL, 0};
+  uint8 *index = NULL;
+  FILE *f = NULL;
+
+  int success =
+      check((index = calloc(indexSize, 1)) != NULL &&
+                (s.out = malloc(batch * s.bound)) != NULL &&
+                (s.len = malloc(batch * sizeof(size_t))) != NULL,
+            "Out of memory") &&
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fwrite(header, 1, TILEDHEADER, f) == TILEDHEADER &&
+                fwrite(index, 1, indexSize, f) == indexSize, // reservar espaço para o índice
+            "Writing header failed");
+  uint64_t offset = TILEDHEADER + indexSize;
+  put64(index, offset);
+  for (size_t t = 0; success && t < ntiles; t += batch)
+  {
+    int n = (int)(ntiles - t < batch ? ntiles - t : batch);
+    s.first = t;
+    ParallelFor("savetiled", n, encodeTile, &s);
+    if (s.failed)
+      errno = ENOMEM;
+    success = check(!s.failed, "Out of memory");
+    for (int k = 0; success && k < n; k++)
+    {
+      success = check(fwrite(s.out + s.bound * k, 1, s.len[k], f) == s.len[k], "Writing pixels failed");
+      offset += s.len[k];
+      put64(index + 8 * (t + k + 1), offset);
+    }
+  }
+  success = success &&
+            check(fseek(f, TILEDHEADER, SEEK_SET) == 0 &&
+                      fwrite(index, 1, indexSize, f) == indexSize,
+                  "Writing header failed");
+  PIXMEM += (unsigned long)w * h; // count pixel memory accesses
+
+  // Cleanup
+  if (f != NULL && fclose(f) != 0 && success)
+    success = check(0, "Writing pixels failed");
+  free(s.len);
+  free(s.out);
+  free(index);
+  return success;
+}
+
+/// Load a rectangular region of an image file.
+/// Tiled files read and decode only the tiles the region touches;
+/// PGM files are loaded whole and cropped.
+Image ImageLoadRegion(const char *filename, int x, int y, int w, int h)
+{ ///
+  assert(w >= 0 && h >= 0);
+  FILE *f = fopen(filename, "rb");
+  if (!check(f != NULL, "Open failed"))
+    return NULL;
+  if (isTiled(f))
+  {
+    Image img = loadTiled(f, x, y, w, h);
+    fclose(f);
+    return img;
+  }
+  fclose(f);
+
+  Image img = ImageLoad(filename);
+  Image region = NULL;
+  if (img == NULL)
+    return NULL;
+  if (ImageValidRect(img, x, y, w, h))
+    region = ImageCrop(img, x, y, w, h);
+  else
+  {
+    errno = EINVAL;
+    check(0, "Region outside image");
+  }
+  errsave = errno;
+  ImageDestroy(&img);
+  errno = errsave;
+  return region;
+}
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img)
+{ ///
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img)
+{ ///
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img)
+{ ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+void ImageStats(Image img, uint8 *min, uint8 *max)
+{ ///
+  assert(img != NULL);
+
+  if (img->tiles != NULL)
+  { // imagem esparsa: percorrer os tiles, os tiles por escrever são pretos
+    uint8 minval = PixMax, maxval = 0;
+    for (int ty = 0; ty * TILESIZE < img->height; ty++)
+      for (int tx = 0; tx < img->tilesx; tx++)
+      {
+        const uint8 *tile = tileAt(img, tx * TILESIZE, ty * TILESIZE);
+        if (tile == NULL)
+        {
+          minval = 0;
+          continue;
+        }
+        // parte do tile dentro da imagem
+        int w = img->width - tx * TILESIZE < TILESIZE ? img->width - tx * TILESIZE : TILESIZE;
+        int h = img->height - ty * TILESIZE < TILESIZE ? img->height - ty * TILESIZE : TILESIZE;
+        for (int y = 0; y < h; y++)
+          minMaxRow8(tile + (size_t)y * TILESIZE, w, &minval, &maxval);
+      }
+    *min = minval;
+    *max = maxval;
+    return;
+  }
+
+  uint8 minval = img->pixel[0], maxval = img->pixel[0]; // iniciar com o primeiro pixel
+
+  for (int y = 0; y < img->height; y++) // percorrer as linhas
+    minMaxRow8(row(img, y), img->width, &minval, &maxval);
+
+  *min = minval;
+  *max = maxval;
+}
+
+// Content hashing: 8 lanes of 32 bits, in two vectors of 4 (GCC vector
+// extension: SSE2 on x86, NEON on ARM), each lane updated as in xxHash32,
+// and all mixed into 64 bits at the end.
+typedef uint32_t HashLanes __attribute__((vector_size(16)));
+
+#define HASHPRIME1 2654435761u
+#define HASHPRIME2 2246822519u
+#define HASHBLOCK (2 * (int)sizeof(HashLanes))
+
+// Add one block of pixels, at p, to lanes a and b.
+static inline void hashBlock(HashLanes *a, HashLanes *b, const uint8 *p)
+{
+  HashLanes va, vb;
+  memcpy(&va, p, sizeof(va));
+  memcpy(&vb, p + sizeof(va), sizeof(vb));
+  va = *a + va * HASHPRIME2;
+  vb = *b + vb * HASHPRIME2;
+  *a = (va << 13 | va >> 19) * HASHPRIME1;
+  *b = (vb << 13 | vb >> 19) * HASHPRIME1;
+}
+
+// Hash the n pixels at p into lanes[0..1], a block at a time.
+// A row may be given in several segments, all but the last one of a whole
+// number of blocks; the last block of a row is padded with zeros.
+static void hashPixels(HashLanes lanes[2], const uint8 *p, int n)
+{
+  HashLanes a = lanes[0], b = lanes[1];
+  int x = 0;
+  for (; x + HASHBLOCK <= n; x += HASHBLOCK)
+    hashBlock(&a, &b, p + x);
+  if (x < n)
+  { // último bloco da linha, incompleto
+    uint8 tail[HASHBLOCK] = {0};
+    memcpy(tail, p + x, (size_t)(n - x));
+    hashBlock(&a, &b, tail);
+  }
+  lanes[0] = a;
+  lanes[1] = b;
+}
+
+// Mix v into hash h (with the splitmix64 finalizer).
+static uint64_t hashMix(uint64_t h, uint64_t v)
+{
+  h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  return h ^ h >> 31;
+}
+
+/// Content hash.
+/// A 64-bit hash of the width, height, maxval and pixels of img, which
+/// does not depend on how the pixels are stored.
+uint64_t ImageHash(Image img)
+{ ///
+  _Static_assert(TILESIZE % HASHBLOCK == 0, "tile rows must be whole blocks");
+  assert(img != NULL);
+  HashLanes lanes[2];
+  for (int i = 0; i < 8; i++) // cada pista com uma semente diferente
+    lanes[i / 4][i % 4] = HASHPRIME1 * (uint32_t)(i + 1);
+
+  if (img->tiles != NULL)
+  { // imagem esparsa: cada linha tile a tile (TILESIZE é múltiplo do bloco)
+    static const uint8 zeros[TILESIZE];
+    for (int y = 0; y < img->height; y++)
+      for (int x = 0; x < img->width; x += TILESIZE)
+      {
+        int len = img->width - x < TILESIZE ? img->width - x : TILESIZE;
+        const uint8 *tile = tileAt(img, x, y);
+        hashPixels(lanes, tile != NULL ? tile + tileOffset(x, y) : zeros, len);
+      }
+  }
+  else
+  {
+    for (int y = 0; y < img->height; y++)
+      hashPixels(lanes, row(img, y), img->width);
+  }
+
+  uint64_t h = hashMix((uint64_t)img->width << 32 | (uint32_t)img->height, (uint64_t)img->maxval);
+  for (int i = 0; i < 8; i++)
+    h = hashMix(h, lanes[i / 4][i % 4]);
+  return h;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -367,12 +1661,13 @@ int ImageValidRect(Image img, int x, int y, int w, int h)
   int rectwidthpos = x + w;  // localização da posição em x máxima
   int rectheightpos = y + h; // localização da posição em y máxima
 
-  if (rectheightpos > img->height || rectwidthpos > img->width)
+  if (x < 0 || y < 0 || w < 0 || h < 0 ||
+      rectheightpos > img->height || rectwidthpos > img->width)
   {
 
     errCause = "O retângulo é inválido pois está fora dos limites da imagem";
     errno = 22; // número 22 para errno significa que o argumento para a função é inválido;
-    return -1;
+    return 0;
   }
 
   return 1;
@@ -387,15 +1682,14 @@ int ImageValidRect(Image img, int x, int y, int w, int h)
 
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel.
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y)
+// The returned index must satisfy (0 <= index < img->stride*img->height)
+static inline size_t G(Image img, int x, int y)
 {
-  int index;
+  size_t index;
 
-  int imgwidth = img->width; // tamanho de uma linha
-  index = imgwidth * y + x;  // index é o valor se transformadas as coordenadas para um array
+  index = (size_t)img->stride * y + x; // index é o valor se transformadas as coordenadas para um array
 
-  assert(0 <= index && index < img->width * img->height); // verificar que o index se encontra dentro dos limites
+  assert(index < img->size); // verificar que o index se encontra dentro dos limites
   return index;
 }
 
@@ -405,6 +1699,11 @@ uint8 ImageGetPixel(Image img, int x, int y)
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
   PIXMEM += 1; // count one pixel access (read)
+  if (img->tiles != NULL)
+  { // imagem esparsa: tiles por escrever são pretos
+    const uint8 *tile = tileAt(img, x, y);
+    return tile != NULL ? tile[tileOffset(x, y)] : 0;
+  }
   return img->pixel[G(img, x, y)];
 }
 
@@ -413,15 +1712,68 @@ void ImageSetPixel(Image img, int x, int y, uint8 level)
 { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
+  if (img->tiles != NULL)
+  { // imagem esparsa
+    uint8 *tile = writableTile(img, x, y);
+    if (tile == NULL) // sem memória para o tile: a imagem fica inalterada
+      return;
+    PIXMEM += 1;
+    tile[tileOffset(x, y)] = level;
+    return;
+  }
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return;
   PIXMEM += 1; // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 }
 
+/// Copy the n pixels of row y of img, from column x on, to buf.
+void ImageGetRow(Image img, int x, int y, int n, uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, n, 1));
+  PIXMEM += (unsigned long)n; // count pixel memory accesses
+  if (img->tiles != NULL)
+    sparseGetRow(img, x, y, n, buf);
+  else
+    memcpy(buf, row(img, y) + x, (size_t)n);
+}
+
+/// Set the n pixels of row y of img, from column x on, to the levels in buf.
+int ImageSetRow(Image img, int x, int y, int n, const uint8 *buf)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, n, 1));
+  if (img->tiles != NULL)
+  { // imagem esparsa: alocar os tiles antes de alterar algum
+    if (!writableRect(img, x, y, n, 1))
+      return 0;
+    while (n > 0)
+    { // um segmento por tile
+      int len = TILESIZE - x % TILESIZE;
+      if (len > n)
+        len = n;
+      memcpy(tileAt(img, x, y) + tileOffset(x, y), buf, (size_t)len);
+      PIXMEM += (unsigned long)len;
+      buf += len;
+      x += len;
+      n -= len;
+    }
+    return 1;
+  }
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return 0;
+  PIXMEM += (unsigned long)n; // count pixel memory accesses
+  memcpy(row(img, y) + x, buf, (size_t)n);
+  return 1;
+}
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the pixels are shared with a clone (see ImageClone).
 /// They never fail.
 
 /// Transform image to negative image.
@@ -430,9 +1782,12 @@ void ImageSetPixel(Image img, int x, int y, uint8 level)
 void ImageNegative(Image img)
 { ///
   assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return;
 
-  for (int i = 0; i < img->width * img->height; i++) // percorrer array de pixeis
-    img->pixel[i] = img->maxval - img->pixel[i];     // modificação do pixel i para o seu negativo
+  for (int y = 0; y < img->height; y++) // percorrer as linhas
+    negativeRow8(row(img, y), img->width, img->maxval);
 }
 
 /// Apply threshold to image.
@@ -441,14 +1796,12 @@ void ImageNegative(Image img)
 void ImageThreshold(Image img, uint8 thr)
 { ///
   assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return;
 
-  for (int i = 0; i < img->width * img->height; i++)
-  {                          // percorrer array de pixeis //sizeof(img->pixel) fornece o tamanho do array em bytes logo é melhor utilizar isto
-    if (img->pixel[i] < thr) // valor do pixel não chegou ao limite
-      img->pixel[i] = 0;     // então dá-lhes o valor de 0 para que fiquem pretos
-    else
-      img->pixel[i] = img->maxval; // caso contrário dá lhes o valor máximo permitido pela img
-  }
+  for (int y = 0; y < img->height; y++) // preto abaixo do limite, branco caso contrário
+    thresholdRow8(row(img, y), img->width, thr, img->maxval);
 }
 
 /// Brighten image by a factor.
@@ -458,20 +1811,14 @@ void ImageThreshold(Image img, uint8 thr)
 void ImageBrighten(Image img, double factor)
 { ///
   assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
 
   assert(factor >= 0.0);
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return;
 
-  for (int i = 0; i < img->width * img->height; i++)
-  { // percorrer array de pixeis //size of pixel devolve o tamanho do array em bytes logo assim é melhor
-
-    double newPixel = img->pixel[i] * factor; // desnecessário mas melhor para leitura, dentro do ciclo for pois é desnecessário fora
-
-    if (newPixel > img->maxval)    // novo valor é maior que maxval
-      img->pixel[i] = img->maxval; // então o novo valor fica maxval
-
-    else // valor multiplicado normalmente, soma com 0.5 para evitar erros de arredondamento
-      img->pixel[i] = (uint8)(newPixel + 0.5);
-  }
+  for (int y = 0; y < img->height; y++) // saturar em maxval, somar 0.5 para arredondar
+    brightenRow8(row(img, y), img->width, factor, img->maxval);
 }
 
 /// Geometric transformations
@@ -499,19 +1846,62 @@ Image ImageRotate(Image img)
 { ///
   assert(img != NULL);
 
-  Image newImg = ImageCreate(img->height, img->width, img->maxval); // alocação de espaço para nova imagem
-
-  for (int x = 0; x < img->width; x++)    // percorrer todo x
-    for (int y = 0; y < img->height; y++) // para todo x percorrer todo y
-    {
-
-      ImageSetPixel(newImg, y, img->width - x - 1, ImageGetPixel(img, x, y)); // rodar imagem 90 graus anti-clockwise
-    }
+  Image newImg = ImageCreateUninitialized(img->height, img->width, img->maxval); // alocação de espaço para nova imagem
+  if (newImg == NULL)
+    return NULL;
 
+  ImageRotateInto(img, newImg); // não falha: newImg já tem o tamanho certo
   return newImg;
 }
 
-/// Mirror an image = flip left-right.
+/// Rotate an image into an existing image.
+/// Same as ImageRotate, but the result is stored in dst, reusing its pixel
+/// array when it is large enough: dst takes the rotated dimensions and the
+/// maxval of img.
+/// Requires: dst != img.
+/// Ensures: The original img is not modified.
+/// On success, returns nonzero.
+/// On failure (the larger pixel array could not be allocated), returns 0,
+/// errno/errCause are set accordingly, and dst is not modified.
+int ImageRotateInto(Image img, Image dst)
+{ ///
+  assert(img != NULL);
+  assert(dst != NULL && dst != img);
+  assert(img->tiles == NULL && dst->tiles == NULL); // requer imagens normais
+
+  int width = img->width, height = img->height;
+  int stride = (height + ROWALIGN - 1) / ROWALIGN * ROWALIGN; // stride da imagem rodada
+  size_t size = (size_t)stride * width;
+  if (size > dst->size || PoolShared(dst->pixel))
+  { // o array de dst é pequeno demais ou partilhado: substituí-lo
+    int hit;
+    uint8 *pixel = PoolAlloc(size, &hit);
+    if (pixel == NULL)
+    {
+      errCause = "Não foi possível alocar memória para os pixeis da nova imagem";
+      errno = 12;
+      return 0;
+    }
+    if (hit)
+      POOLHIT += 1;
+    else
+      POOLMISS += 1;
+    PoolFree(dst->pixel);
+    dst->pixel = pixel;
+    dst->size = size;
+  }
+  dst->width = height;
+  dst->height = width;
+  dst->maxval = img->maxval;
+  dst->stride = stride;
+
+  // rodar imagem 90 graus anti-clockwise, por blocos
+  rotateRows8(dst->pixel, (size_t)stride, img->pixel, (size_t)img->stride, width, height);
+  PIXMEM += 2 * (unsigned long)width * height; // uma leitura e uma escrita por pixel
+  return 1;
+}
+
+/// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
 ///
@@ -521,24 +1911,39 @@ Image ImageRotate(Image img)
 Image ImageMirror(Image img)
 { ///
   assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
 
-  Image newImg = ImageCreate(img->width, img->height, img->maxval);
+  Image newImg = ImageCreateUninitialized(img->width, img->height, img->maxval);
   if (newImg == NULL)
   {
     // Erro já foi feito em ImageCreate
     return NULL;
   }
 
-  for (int x = 0; x < img->width; x++)    // percorrer todo x
-    for (int y = 0; y < img->height; y++) // para x percorrer todos os y
-    {
-
-      ImageSetPixel(newImg, img->width - x - 1, y, ImageGetPixel(img, x, y));
-    }
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) // inverter cada linha
+    mirrorRow8(row(newImg, y), row(img, y), width);
+  PIXMEM += 2 * (unsigned long)width * img->height;
 
   return newImg;
 }
 
+/// Mirror an image in-place = flip left-right.
+/// Same result as ImageMirror, but img is modified in-place (see ImageClone).
+/// Never fails.
+void ImageMirrorInPlace(Image img)
+{ ///
+  assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  if (!unshare(img)) // sem memória para a cópia: a imagem fica inalterada
+    return;
+
+  int width = img->width;
+  for (int y = 0; y < img->height; y++) // trocar os pixeis das duas metades
+    reverseRow8(row(img, y), width);
+  PIXMEM += 4 * (unsigned long)(width / 2) * img->height;
+}
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -556,38 +1961,316 @@ Image ImageCrop(Image img, int x, int y, int w, int h)
   assert(img != NULL);
   assert(ImageValidRect(img, x, y, w, h));
 
-  Image newImage = ImageCreate(w, h, img->maxval);
+  Image newImage = ImageCreateUninitialized(w, h, img->maxval);
 
   if (newImage == NULL)
     return NULL;
 
-  for (int i = 0; i < h; i++)                                          // variável i corresponde à coordenada y da newImage
-    for (int j = 0; j < w; j++)                                        // variável j corresponde à coordenada x da new image
-      ImageSetPixel(newImage, j, i, ImageGetPixel(img, x + j, x + i)); // x+j e x+i correspondem ao pixel correspondente da img
+  for (int i = 0; i < h; i++) // variável i corresponde à coordenada y da newImage
+    if (img->tiles != NULL)
+      sparseGetRow(img, x, y + i, w, row(newImage, i));
+    else
+      memcpy(row(newImage, i), row(img, y + i) + x, (size_t)w); // copiar a linha y+i a partir de x
+  PIXMEM += 2 * (unsigned long)w * h;
 
   return newImage;
 }
 
+// Resizing
+
+// ImageResize is separable: each row of the result is first resized
+// vertically, into a row of the width of img, with 8 fractional bits, and
+// then horizontally.  Each axis has a table with the weights of the source
+// pixels of each output pixel, so the inner loops only multiply and add:
+// the vertical one over whole rows, which the compiler vectorizes.  Rows of
+// the result are independent, so they are computed in parallel.
+
+// Fixed-point precision of the weights: they add up to 1 << RESIZEBITS
+#define RESIZEBITS 14
+
+// Largest block of the integer-factor fast path (see resizeBox)
+#define RESIZEMAXBOX 2048
+
+// Weights of one axis of a resize.
+// Output pixel i is the sum of the ntaps source pixels from first[i],
+// times the weights in weight[i*ntaps ...] (some may be zero).
+typedef struct
+{
+  int ntaps;
+  int *first;
+  uint16_t *weight;
+} ResizeAxis;
+
+// Work shared by the threads of a resize
+typedef struct
+{
+  Image src, dst;
+  ResizeAxis x, y;   // caminho geral
+  int fx, fy;        // fatores do caminho rápido (blocos), ou 0
+  uint64_t boxmul;   // recíproco de 2*fx*fy, ver resizeBox
+  int nbands;
+  uint32_t *acc;     // linhas auxiliares de cada banda, com a largura de src
+  uint16_t *mid;
+} Resize;
+
+// Smallest integer >= v (v >= 0), at most n.
+static inline int resizeCeil(double v, int n)
+{
+  int c = (int)v;
+  c += c < v;
+  return c < n ? c : n;
+}
+
+// Fill the weights of axis a, to resize n source pixels to m with filter.
+// Returns 0 if out of memory.
+static int resizeAxisInit(ResizeAxis *a, int n, int m, ResizeFilter filter)
+{
+  double scale = (double)n / m;
+  // taps: os pixeis de origem sob cada pixel (área) ou à volta do centro
+  a->ntaps = n > 1 ? 2 : 1;
+  if (filter != RESIZE_BILINEAR)
+    for (int i = 0; i < m; i++)
+    {
+      int j0 = (int)(i * scale);
+      int j1 = resizeCeil((i + 1) * scale, n);
+      if (j1 - j0 > a->ntaps)
+        a->ntaps = j1 - j0;
+    }
+  a->first = malloc(sizeof(int) * m);
+  a->weight = calloc((size_t)m * a->ntaps, sizeof(uint16_t));
+  if (a->first == NULL || a->weight == NULL)
+    return 0;
+
+  for (int i = 0; i < m; i++)
+  {
+    double w[2]; // pesos do bilinear
+    int j0, j1;
+    double lo = i * scale, hi = (i + 1) * scale;
+    if (filter == RESIZE_BILINEAR)
+    {
+      double c = (i + 0.5) * scale - 0.5; // centro, nas coordenadas de img
+      c = c < 0.0 ? 0.0 : c > n - 1 ? n - 1 : c;
+      j0 = (int)c;
+      j1 = j0 + 1 < n ? j0 + 2 : j0 + 1;
+      w[1] = c - j0;
+      w[0] = 1.0 - w[1];
+    }
+    else
+    {
+      j0 = (int)lo;
+      j1 = resizeCeil(hi, n);
+    }
+    int first = j0 < n - a->ntaps ? j0 : n - a->ntaps;
+    uint16_t *wt = a->weight + (size_t)i * a->ntaps;
+    // cada peso é a diferença entre somas acumuladas arredondadas, para a
+    // soma ser exatamente 1 << RESIZEBITS sem nenhum peso sair do intervalo
+    double cum = 0.0;
+    int prev = 0;
+    for (int j = j0; j < j1; j++)
+    {
+      double v = filter == RESIZE_BILINEAR ? w[j - j0]
+                 : ((j + 1 < hi ? j + 1 : hi) - (j > lo ? j : lo)) / scale; // parte coberta
+      cum += v > 0.0 ? v : 0.0;
+      int next = j + 1 == j1 ? 1 << RESIZEBITS : (int)(cum * (1 << RESIZEBITS) + 0.5);
+      if (next > 1 << RESIZEBITS)
+        next = 1 << RESIZEBITS;
+      wt[j - first] = (uint16_t)(next - prev);
+      prev = next;
+    }
+    a->first[i] = first;
+  }
+  return 1;
+}
+
+static void resizeAxisFree(ResizeAxis *a)
+{
+  free(a->first);
+  free(a->weight);
+}
+
+// Fast path over output row y: the means of blocks of fx*fy pixels.
+// The sums of the columns of the block rows go in mid (at most 257 rows
+// of 255, so they fit in 16 bits), then those of fx columns in s.  The
+// mean is round(s/n) = (2s+n)/(2n), computed as (2s+n)*boxmul >> 32, with
+// boxmul = 2^32/(2n) + 1, which is exact for s <= 255n if n <= RESIZEMAXBOX.
+static void resizeBox(Resize *r, int y, uint16_t *restrict mid)
+{
+  int sw = r->src->width, fx = r->fx, fy = r->fy, n = fx * fy;
+  const uint8 *s = row(r->src, y * fy);
+  for (int x = 0; x < sw; x++)
+    mid[x] = s[x];
+  for (int t = 1; t < fy; t++)
+  {
+    s = row(r->src, y * fy + t);
+    for (int x = 0; x < sw; x++)
+      mid[x] += s[x];
+  }
+  uint8 *out = row(r->dst, y);
+  for (int x = 0; x < r->dst->width; x++)
+  {
+    uint32_t sum = 0;
+    for (int t = 0; t < fx; t++)
+      sum += mid[x * fx + t];
+    out[x] = (uint8)(((uint64_t)(2 * sum + n) * r->boxmul) >> 32);
+  }
+}
+
+// General path over output row y: vertical taps into acc (rounded to 8
+// fractional bits in mid), then horizontal taps.
+static void resizeRow(Resize *r, int y, uint32_t *restrict acc, uint16_t *restrict mid)
+{
+  int sw = r->src->width, ntaps = r->y.ntaps;
+  const uint16_t *wy = r->y.weight + (size_t)y * ntaps;
+  const uint8 *s = row(r->src, r->y.first[y]);
+  uint32_t wt = wy[0];
+  for (int x = 0; x < sw; x++)
+    acc[x] = wt * s[x];
+  for (int t = 1; t < ntaps; t++)
+  {
+    if ((wt = wy[t]) == 0)
+      continue;
+    s = row(r->src, r->y.first[y] + t);
+    for (int x = 0; x < sw; x++)
+      acc[x] += wt * s[x];
+  }
+  for (int x = 0; x < sw; x++)
+    mid[x] = (uint16_t)((acc[x] + (1 << (RESIZEBITS - 9))) >> (RESIZEBITS - 8));
+
+  // horizontal: no máximo 255<<8 vezes 1<<RESIZEBITS, cabe em 32 bits
+  uint8 *out = row(r->dst, y);
+  ntaps = r->x.ntaps;
+  if (ntaps == 2) // bilinear e ampliações por área: o ciclo comum
+  {
+    for (int x = 0; x < r->dst->width; x++)
+    {
+      const uint16_t *wx = r->x.weight + 2 * (size_t)x;
+      const uint16_t *m = mid + r->x.first[x];
+      uint32_t sum = (uint32_t)m[0] * wx[0] + (uint32_t)m[1] * wx[1];
+      out[x] = (uint8)((sum + (1u << (RESIZEBITS + 7))) >> (RESIZEBITS + 8));
+    }
+    return;
+  }
+  for (int x = 0; x < r->dst->width; x++)
+  {
+    const uint16_t *wx = r->x.weight + (size_t)x * ntaps;
+    const uint16_t *m = mid + r->x.first[x];
+    uint32_t sum = 0;
+    for (int t = 0; t < ntaps; t++)
+      sum += (uint32_t)m[t] * wx[t];
+    out[x] = (uint8)((sum + (1u << (RESIZEBITS + 7))) >> (RESIZEBITS + 8));
+  }
+}
+
+// Resize the rows of band b.
+static void resizeBand(void *arg, int b)
+{
+  Resize *r = arg;
+  int h = r->dst->height;
+  uint32_t *acc = r->acc + (size_t)b * r->src->width;
+  uint16_t *mid = r->mid + (size_t)b * r->src->width;
+  for (int y = (int)((long)h * b / r->nbands); y < (int)((long)h * (b + 1) / r->nbands); y++)
+    if (r->fx > 0)
+      resizeBox(r, y, mid);
+    else
+      resizeRow(r, y, acc, mid);
+}
+
+/// Resize an image to width w and height h, with filter (see ResizeFilter).
+/// Integer factors (with RESIZE_BOX or RESIZE_AREA) take a fast path that
+/// adds up blocks, and other cases use weight tables.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeFilter filter)
+{ ///
+  assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  assert(w >= 0 && h >= 0);
+  assert(w == 0 || h == 0 || (img->width > 0 && img->height > 0));
+  assert(filter != RESIZE_BOX ||
+         ((w == 0 || img->width % w == 0) && (h == 0 || img->height % h == 0)));
+
+  Image result = ImageCreateUninitialized(w, h, img->maxval);
+  if (result == NULL || w == 0 || h == 0)
+    return result;
+
+  int sw = img->width, sh = img->height;
+  Resize r = {img, result};
+  if (filter != RESIZE_BILINEAR && sw % w == 0 && sh % h == 0 && sh / h <= 257 &&
+      (long)(sw / w) * (sh / h) <= RESIZEMAXBOX)
+  { // blocos inteiros: caminho rápido
+    r.fx = sw / w;
+    r.fy = sh / h;
+    r.boxmul = (1ull << 32) / (2 * r.fx * r.fy) + 1;
+  }
+  r.nbands = ParallelThreads() < h ? ParallelThreads() : h;
+  r.acc = malloc((size_t)r.nbands * sw * sizeof(uint32_t));
+  r.mid = malloc((size_t)r.nbands * sw * sizeof(uint16_t));
+  int success = r.acc != NULL && r.mid != NULL &&
+                (r.fx > 0 || (resizeAxisInit(&r.x, sw, w, filter) &&
+                              resizeAxisInit(&r.y, sh, h, filter)));
+  if (success)
+  {
+    ParallelFor("resize", r.nbands, resizeBand, &r);
+    // leituras das linhas de img usadas, e uma escrita por pixel
+    PIXMEM += (unsigned long)(r.fx > 0 ? r.fy : r.y.ntaps) * sw * h + (unsigned long)w * h;
+  }
+  resizeAxisFree(&r.x);
+  resizeAxisFree(&r.y);
+  free(r.acc);
+  free(r.mid);
+  if (!success)
+  {
+    ImageDestroy(&result);
+    errCause = "Não foi possível alocar memória para redimensionar a imagem";
+    errno = 12;
+  }
+  return result;
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img2->tiles == NULL);
+  PIXMEM += 2 * (unsigned long)img2->width * img2->height;
+
+  if (img1->tiles != NULL)
+  { // imagem esparsa: copiar cada linha tile a tile
+    if (!writableRect(img1, x, y, img2->width, img2->height)) // sem memória: a imagem fica inalterada
+      return;
+    for (int i = 0; i < img2->height; i++)
+    {
+      const uint8 *src = row(img2, i);
+      for (int j = 0; j < img2->width;)
+      {
+        int len = TILESIZE - (x + j) % TILESIZE;
+        if (len > img2->width - j)
+          len = img2->width - j;
+        memcpy(tileAt(img1, x + j, y + i) + tileOffset(x + j, y + i), src + j, (size_t)len);
+        j += len;
+      }
+    }
+    return;
+  }
 
-  for (int i = 0; i < img2->height; i++)                            // variável i corresponde à coordenada y da newImage
-    for (int j = 0; j < img2->width; j++)                           // variável j corresponde à coordenada x da newImage
-      ImageSetPixel(img1, x + j, y + i, ImageGetPixel(img2, j, i)); // x+j e y+i correspondem ao pixel a ser mudado na img1
+  if (!unshare(img1)) // sem memória para a cópia: a imagem fica inalterada
+    return;
+  for (int i = 0; i < img2->height; i++) // variável i corresponde à coordenada y da img2
+    memcpy(row(img1, y + i) + x, row(img2, i), (size_t)img2->width); // linha i da img2 vai para a linha y+i da img1
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -596,21 +2279,166 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img2->tiles == NULL);
+  PIXMEM += 3 * (unsigned long)img2->width * img2->height;
+
+  if (img1->tiles != NULL)
+  { // imagem esparsa: misturar cada linha tile a tile
+    if (!writableRect(img1, x, y, img2->width, img2->height)) // sem memória: a imagem fica inalterada
+      return;
+    for (int i = 0; i < img2->height; i++)
+    {
+      const uint8 *src = row(img2, i);
+      for (int j = 0; j < img2->width;)
+      {
+        int len = TILESIZE - (x + j) % TILESIZE;
+        if (len > img2->width - j)
+          len = img2->width - j;
+        blendRow8(tileAt(img1, x + j, y + i) + tileOffset(x + j, y + i), src + j, len, alpha, img1->maxval);
+        j += len;
+      }
+    }
+    return;
+  }
 
-  for (int i = 0; i < img2->height; i++)
-  { // variável i corresponde à coordenada y da img2
-    for (int j = 0; j < img2->width; j++)
-    {                                                                                                                            // variável j corresponde à coordenada x da img2
-      uint8 blendedPixel = (uint8)(alpha * ImageGetPixel(img2, j, i) + (1.0 - alpha) * ImageGetPixel(img1, x + j, y + i) + 0.5); // blend do pixel com o alpha e arredonda
-
-      if (blendedPixel < 0)
-        ImageSetPixel(img1, x + j, y + i, 0); // valor não pode ser menor que 0
-      else if (blendedPixel > img1->maxval)
-        ImageSetPixel(img1, x + j, y + i, img1->maxval); // valor não pode ser maior que maxval
+  if (!unshare(img1)) // sem memória para a cópia: a imagem fica inalterada
+    return;
+  for (int i = 0; i < img2->height; i++) // variável i corresponde à coordenada y da img2
+    blendRow8(row(img1, y + i) + x, row(img2, i), img2->width, alpha, img1->maxval);
+}
+
+// Work shared by the threads of ImageComposite.
+// The canvas is split in tiles of TILESIZE x TILESIZE pixels (the same as
+// the tiles of sparse images), numbered in raster order.
+// The ops that touch tile t are list[first[t]] .. list[first[t+1]-1],
+// in order, and todo has the numbers of the tiles touched by some op.
+typedef struct
+{
+  Image canvas;
+  const CompositeOp *ops;
+  int tilesx;  // columns of tiles
+  int *first;
+  int *list;
+  int *todo;
+} Composite;
+
+// Apply the ops that touch tile todo[k], in order, to that tile.
+static void compositeTile(void *arg, int k)
+{
+  Composite *c = arg;
+  Image canvas = c->canvas;
+  int t = c->todo[k];
+  int x0 = (t % c->tilesx) * TILESIZE;
+  int y0 = (t / c->tilesx) * TILESIZE;
+  int x1 = x0 + TILESIZE < canvas->width ? x0 + TILESIZE : canvas->width;
+  int y1 = y0 + TILESIZE < canvas->height ? y0 + TILESIZE : canvas->height;
+  for (int e = c->first[t]; e < c->first[t + 1]; e++)
+  {
+    const CompositeOp *op = &c->ops[c->list[e]];
+    // intersecção da imagem do op com o tile
+    int ox0 = op->x > x0 ? op->x : x0;
+    int oy0 = op->y > y0 ? op->y : y0;
+    int ox1 = op->x + op->img->width < x1 ? op->x + op->img->width : x1;
+    int oy1 = op->y + op->img->height < y1 ? op->y + op->img->height : y1;
+    for (int y = oy0; y < oy1; y++)
+    {
+      const uint8 *src = row(op->img, y - op->y) + (ox0 - op->x);
+      uint8 *dst = canvas->tiles != NULL ? tileAt(canvas, ox0, y) + tileOffset(ox0, y)
+                                         : row(canvas, y) + ox0;
+      if (op->mode == COMPOSITE_PASTE)
+        memcpy(dst, src, (size_t)(ox1 - ox0));
       else
-        ImageSetPixel(img1, x + j, y + i, blendedPixel);
+        blendRow8(dst, src, ox1 - ox0, op->alpha, canvas->maxval);
+    }
+  }
+}
+
+/// Apply a list of overlays to canvas, in order.
+/// The result is the same as calling ImagePaste or ImageBlend for ops[0],
+/// ops[1], ..., ops[n-1], in this order, but the canvas is split in tiles
+/// that are processed in parallel (see parallel.h), each tile applying the
+/// ops that touch it, in order.
+/// Requires: each ops[i].img fits inside canvas at (ops[i].x, ops[i].y),
+/// and is not sparse.  The canvas may be sparse.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and
+/// canvas is unchanged.
+int ImageComposite(Image canvas, const CompositeOp ops[], int n)
+{ ///
+  assert(canvas != NULL);
+  assert(n >= 0);
+  for (int i = 0; i < n; i++)
+  {
+    assert(ops[i].img != NULL && ops[i].img->tiles == NULL);
+    assert(ImageValidRect(canvas, ops[i].x, ops[i].y, ops[i].img->width, ops[i].img->height));
+  }
+
+  Composite c = {canvas, ops, (canvas->width + TILESIZE - 1) / TILESIZE, NULL, NULL, NULL};
+  int ntiles = c.tilesx * ((canvas->height + TILESIZE - 1) / TILESIZE);
+  int success = (c.first = calloc((size_t)ntiles + 1, sizeof(int))) != NULL &&
+                (c.todo = malloc(((size_t)ntiles + 1) * sizeof(int))) != NULL;
+
+  // Contar os ops de cada tile (em first[t+1])
+  long nentries = 0;
+  for (int i = 0; success && i < n; i++)
+  {
+    const CompositeOp *op = &ops[i];
+    if (op->img->width == 0 || op->img->height == 0)
+      continue;
+    for (int ty = op->y / TILESIZE; ty <= (op->y + op->img->height - 1) / TILESIZE; ty++)
+      for (int tx = op->x / TILESIZE; tx <= (op->x + op->img->width - 1) / TILESIZE; tx++)
+      {
+        c.first[ty * c.tilesx + tx + 1]++;
+        nentries++;
+      }
+  }
+  success = success && nentries <= INT_MAX &&
+            (c.list = malloc(((size_t)nentries + 1) * sizeof(int))) != NULL;
+  if (success)
+  {
+    // Listar os ops de cada tile, por ordem (todo serve de cursor)
+    int ntodo = 0;
+    for (int t = 0; t < ntiles; t++)
+      c.first[t + 1] += c.first[t];
+    for (int t = 0; t < ntiles; t++)
+      c.todo[t] = c.first[t];
+    for (int i = 0; i < n; i++)
+    {
+      const CompositeOp *op = &ops[i];
+      if (op->img->width == 0 || op->img->height == 0)
+        continue;
+      for (int ty = op->y / TILESIZE; ty <= (op->y + op->img->height - 1) / TILESIZE; ty++)
+        for (int tx = op->x / TILESIZE; tx <= (op->x + op->img->width - 1) / TILESIZE; tx++)
+          c.list[c.todo[ty * c.tilesx + tx]++] = i;
+    }
+    for (int t = 0; t < ntiles; t++)
+      if (c.first[t + 1] > c.first[t])
+        c.todo[ntodo++] = t;
+
+    // Preparar o canvas para escrita, antes de o alterar
+    if (canvas->tiles != NULL)
+      for (int i = 0; success && i < n; i++)
+        success = writableRect(canvas, ops[i].x, ops[i].y, ops[i].img->width, ops[i].img->height);
+    else
+      success = unshare(canvas);
+
+    if (success)
+    {
+      for (int i = 0; i < n; i++)
+        PIXMEM += (ops[i].mode == COMPOSITE_PASTE ? 2 : 3) * (unsigned long)ops[i].img->width * ops[i].img->height;
+      ParallelFor("composite", ntodo, compositeTile, &c);
     }
   }
+  else
+  {
+    errCause = "Não foi possível alocar memória para compor as imagens";
+    errno = 12;
+  }
+
+  free(c.first);
+  free(c.list);
+  free(c.todo);
+  return success;
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -620,16 +2448,23 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  assert(img1->tiles == NULL && img2->tiles == NULL); // requer imagens normais
   assert(ImageValidPos(img1, x, y));
 
+  int width = img2->width;
   for (int i = 0; i < img2->height; i++)
   { // i corresponde às coordenadas y de img2
-    for (int j = 0; j < img2->width; j++)
-    { // j corresponde às coordenadas x de img2
-
-      if (ImageGetPixel(img2, j, i) != ImageGetPixel(img1, x + j, y + i)) // comparar os pixeis correspondentes de cada imagem
-        return 0;
+    const uint8 *r2 = row(img2, i);
+    const uint8 *r1 = row(img1, y + i) + x;
+    if (memcmp(r1, r2, (size_t)width) != 0)
+    { // as linhas diferem: contar os pixeis comparados até à diferença
+      int j = 0;
+      while (r1[j] == r2[j])
+        j++;
+      PIXMEM += 2 * (unsigned long)(j + 1);
+      return 0;
     }
+    PIXMEM += 2 * (unsigned long)width;
   }
 
   return 1;
@@ -643,6 +2478,7 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
+  assert(img1->tiles == NULL && img2->tiles == NULL); // requer imagens normais
 
   for (int i = 0; i <= img1->height - img2->height; i++)
   { // percorrer as colunas até altura da imagem 1 menos a altura da imagem 2
@@ -668,34 +2504,793 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
 void ImageBlur(Image img, int dx, int dy)
 { ///
   assert(img != NULL);
-  Image imgcopy = ImageCreate(img->width, img->height, img->maxval); // criar uma copia da imagem para aplicar o filtro
-  float sum;
-  int num, ImageHeight = img->height, ImageWidth = img->width;
-  for (int position = 0; position < ImageHeight * ImageWidth; position++)
-  { // copiar a posição da imagem
-    imgcopy->pixel[position] = img->pixel[position];
-  }
-  for (int i = 0; i < ImageHeight; i++)
-  { 
-    for (int j = 0; j < ImageWidth; j++)
-    { // Usamos os 2 ciclos for para percorrer todos os pexeis da imagem
-      sum = 0;
-      num = 0;
-      for (int i_height = i - dy; i_height <= i + dy; i_height++) // usamos outros 2 ciclos for para percorrer o retangulo e fazer a media dos pixeis para 
-      {                                                           // subsituir os pexeis anteriores
-        if (i_height < 0 || i_height >= ImageHeight)
-          continue;
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  // O resultado é escrito num novo array, lendo do array de img, que não
+  // precisa de ser copiado (nem se for partilhado com clones)
+  Image result = ImageCreateUninitialized(img->width, img->height, img->maxval);
+  if (result == NULL) // sem memória: a imagem fica inalterada
+    return;
+  PIXMEM += blurRows8(result->pixel, (size_t)result->stride, img->pixel, (size_t)img->stride,
+                      img->width, img->height, dx, dy);
+  // trocar os arrays: img fica com o resultado, e result com o original
+  uint8 *original = img->pixel;
+  img->pixel = result->pixel;
+  result->pixel = original;
+  ImageDestroy(&result);
+}
+
+// Rank filters, in constant time per pixel (Perreault and Hébert, "Median
+// Filtering in Constant Time", 2007).
+// Each band of rows keeps a histogram per column, of the pixels of that
+// column in the rows of the window: going down a row moves one pixel out
+// and one in.  The histogram of the window is the sum of the histograms of
+// its columns: going right a pixel moves one column out and one in.
+// Histograms have two levels, RANKCOARSE coarse bins of RANKFINE levels
+// each, and the fine bins.  The rank is first located in the coarse bins
+// of the window, and then only the fine bins of that coarse bin are
+// brought up to date (from the column where they were last used) and
+// searched.  Bin updates are loops over RANKFINE counts, which gcc
+// vectorizes.
+#define RANKCOARSE 16
+#define RANKFINE 16
+
+// Width of the strips of a rank filter: the histograms of the columns of
+// a strip (and of the dx columns on each side) should fit in the L2 cache.
+#define RANKSTRIP 256
+
+// Bins of a column histogram: fine bins, then coarse bins
+#define RANKBINS (RANKCOARSE * RANKFINE + RANKCOARSE)
+
+// Work shared by the threads of a rank filter.
+// The image is split in nbands bands of rows, and each band in nstrips
+// strips of stripw columns.  Each strip has its histograms in cols, for
+// the columns of the strip and the dx columns on each side: at most
+// stripw+2dx fine histograms, then as many coarse histograms.
+typedef struct
+{
+  Image img;    // source
+  uint8 *dst;   // destination pixels, with the stride of img
+  int dx, dy;
+  double q;     // rank, as a fraction of the pixels in the window
+  int nbands, nstrips, stripw;
+  uint16_t *cols;
+} RankFilter;
+
+// Add (sign 1) or remove (sign -1) the pixels of row y of img, in columns
+// [c0, c1), to the column histograms fine and coarse.
+static void rankColumnsRow(Image img, int y, int c0, int c1, int sign,
+                           uint16_t *fine, uint16_t *coarse)
+{
+  const uint8 *r = row(img, y);
+  for (int x = c0; x < c1; x++)
+  {
+    fine[(size_t)(x - c0) * RANKCOARSE * RANKFINE + r[x]] += (uint16_t)sign;
+    coarse[(size_t)(x - c0) * RANKCOARSE + r[x] / RANKFINE] += (uint16_t)sign;
+  }
+}
+
+// Add (sign 1) or remove (sign -1) RANKFINE column bins to window bins.
+static inline void rankAddBins(uint32_t *restrict bins, const uint16_t *restrict col, int sign)
+{
+  for (int i = 0; i < RANKFINE; i++)
+    bins[i] += (uint32_t)(sign * col[i]);
+}
+
+// Apply the rank filter to the pixels of strip s (numbered by band, and
+// then by strip in the band).
+static void rankStrip(void *arg, int s)
+{
+  RankFilter *f = arg;
+  Image img = f->img;
+  int w = img->width, h = img->height, dx = f->dx, dy = f->dy;
+  int band = s / f->nstrips;
+  int y0 = (int)((long)h * band / f->nbands);
+  int y1 = (int)((long)h * (band + 1) / f->nbands);
+  int x0 = s % f->nstrips * f->stripw;
+  int x1 = x0 + f->stripw < w ? x0 + f->stripw : w;
+  int c0 = x0 - dx > 0 ? x0 - dx : 0; // colunas com histograma: [c0, c1)
+  int c1 = x1 + dx < w ? x1 + dx : w;
+  uint16_t *fine = f->cols + (size_t)s * (f->stripw + 2 * dx) * RANKBINS;
+  uint16_t *coarse = fine + (size_t)(c1 - c0) * RANKCOARSE * RANKFINE;
+  memset(fine, 0, (size_t)(c1 - c0) * RANKBINS * sizeof(uint16_t));
+
+  // histogramas das colunas para a primeira linha da banda
+  for (int y = y0 - dy < 0 ? 0 : y0 - dy; y <= y0 + dy && y < h; y++)
+    rankColumnsRow(img, y, c0, c1, 1, fine, coarse);
+
+  for (int i = y0; i < y1; i++)
+  {
+    if (i > y0)
+    { // descer uma linha: sai a linha i-dy-1 e entra a linha i+dy
+      if (i - dy - 1 >= 0)
+        rankColumnsRow(img, i - dy - 1, c0, c1, -1, fine, coarse);
+      if (i + dy < h)
+        rankColumnsRow(img, i + dy, c0, c1, 1, fine, coarse);
+    }
+    int rows = (i + dy < h ? i + dy : h - 1) - (i - dy > 0 ? i - dy : 0) + 1;
+
+    // histograma da janela: bins grossos sempre atualizados, e os bins
+    // finos de cada bin grosso atualizados apenas quando usados
+    uint32_t kc[RANKCOARSE] = {0};
+    uint32_t kf[RANKCOARSE][RANKFINE];
+    int lo[RANKCOARSE], hi[RANKCOARSE]; // colunas somadas em kf[b]: [lo, hi]
+    for (int b = 0; b < RANKCOARSE; b++)
+    {
+      lo[b] = 0;
+      hi[b] = -1; // nenhuma
+      memset(kf[b], 0, sizeof(kf[b]));
+    }
+    for (int x = c0; x <= x0 + dx && x < w; x++)
+      rankAddBins(kc, coarse + (size_t)(x - c0) * RANKCOARSE, 1);
+
+    uint8 *out = f->dst + (size_t)img->stride * i;
+    for (int j = x0; j < x1; j++)
+    {
+      int j0 = j - dx > 0 ? j - dx : 0;
+      int j1 = j + dx < w ? j + dx : w - 1;
+      uint32_t n = (uint32_t)rows * (uint32_t)(j1 - j0 + 1);
+      uint32_t k = (uint32_t)(f->q * (n - 1)); // posição do nível na janela ordenada
+      int b = 0;
+      while (k >= kc[b])
+        k -= kc[b++];
+
+      // atualizar os bins finos de b para as colunas [j0, j1]
+      // (os da coluna x >= c0 começam em seg + (x - c0) * RANKCOARSE * RANKFINE)
+      const uint16_t *seg = fine + b * RANKFINE;
+      if (hi[b] < j0 || (j0 - lo[b]) + (j1 - hi[b]) > j1 - j0 + 1)
+      { // sem sobreposição, ou mais rápido recalcular
+        memset(kf[b], 0, sizeof(kf[b]));
+        for (int x = j0; x <= j1; x++)
+          rankAddBins(kf[b], seg + (size_t)(x - c0) * RANKCOARSE * RANKFINE, 1);
+      }
+      else
+      {
+        for (int x = lo[b]; x < j0; x++)
+          rankAddBins(kf[b], seg + (size_t)(x - c0) * RANKCOARSE * RANKFINE, -1);
+        for (int x = hi[b] + 1; x <= j1; x++)
+          rankAddBins(kf[b], seg + (size_t)(x - c0) * RANKCOARSE * RANKFINE, 1);
+      }
+      lo[b] = j0;
+      hi[b] = j1;
+
+      int v = 0;
+      while (k >= kf[b][v])
+        k -= kf[b][v++];
+      out[j] = (uint8)(b * RANKFINE + v);
 
-        for (int j_width = j - dx; j_width <= j + dx; j_width++)
+      // avançar a janela uma coluna
+      if (j + 1 < x1)
+      {
+        if (j - dx >= 0)
+          rankAddBins(kc, coarse + (size_t)(j - dx - c0) * RANKCOARSE, -1);
+        if (j + dx + 1 < w)
+          rankAddBins(kc, coarse + (size_t)(j + dx + 1 - c0) * RANKCOARSE, 1);
+      }
+    }
+  }
+}
+
+/// Apply a (2dx+1)x(2dy+1) rank filter to an image.
+/// Each pixel is substituted by the level at position q*(n-1) (rounded
+/// down) in the sorted levels of the n pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], clipped to the image, as in ImageBlur.
+/// So q=0 gives the minimum, q=0.5 the median and q=1 the maximum.
+/// The cost per pixel does not depend on dx and dy.  The image is split in
+/// bands of rows that are filtered in parallel (see parallel.h).
+/// The image is changed in-place.
+/// Requires: 0 <= q <= 1, and dy < 32768 (per column counts).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and
+/// img is unchanged.
+int ImageRankFilter(Image img, int dx, int dy, double q)
+{ ///
+  assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  assert(dx >= 0 && dy >= 0 && dy < 32768);
+  assert(0.0 <= q && q <= 1.0);
+  if (img->width == 0 || img->height == 0)
+    return 1;
+
+  // Faixas de RANKSTRIP colunas (ou mais, se dx for grande), para os
+  // histogramas caberem na cache, e bandas de linhas: uma por thread, mas
+  // com pelo menos dy+1 linhas cada, porque cada banda começa por somar as
+  // linhas da janela da sua primeira linha
+  int stripw = RANKSTRIP > 2 * dx ? RANKSTRIP : 2 * dx;
+  int nstrips = (img->width + stripw - 1) / stripw;
+  int nbands = ParallelThreads();
+  if (nbands > img->height / (dy + 1))
+    nbands = img->height / (dy + 1) > 0 ? img->height / (dy + 1) : 1;
+  RankFilter f = {img, NULL, dx, dy, q, nbands, nstrips, stripw, NULL};
+  Image result = ImageCreateUninitialized(img->width, img->height, img->maxval);
+  if (result == NULL)
+    return 0;
+  f.dst = result->pixel;
+  f.cols = malloc((size_t)nbands * nstrips * (stripw + 2 * dx) * RANKBINS * sizeof(uint16_t));
+  if (f.cols == NULL)
+  {
+    ImageDestroy(&result);
+    errCause = "Não foi possível alocar memória para os histogramas";
+    errno = 12;
+    return 0;
+  }
+  ParallelFor("rank", nbands * nstrips, rankStrip, &f);
+  // 2 leituras por pixel (entrada e saída das colunas) e 1 escrita
+  PIXMEM += 3 * (unsigned long)img->width * img->height;
+  free(f.cols);
+
+  // trocar os arrays: img fica com o resultado, e result com o original
+  uint8 *original = img->pixel;
+  img->pixel = result->pixel;
+  result->pixel = original;
+  ImageDestroy(&result);
+  return 1;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image: the same as
+/// ImageRankFilter(img, dx, dy, 0.5).
+int ImageMedian(Image img, int dx, int dy)
+{ ///
+  return ImageRankFilter(img, dx, dy, 0.5);
+}
+
+/// Morphology
+
+// Erosion and dilation by a (2dx+1)x(2dy+1) rectangle are separable: a
+// horizontal pass (min or max of 2dx+1 pixels in each row) and then a
+// vertical pass (of 2dy+1 pixels in each column).  Each pass uses the van
+// Herk/Gil-Werman algorithm, with cost independent of the radius r: the
+// line is split in blocks of k=2r+1 pixels, g gets the running min (max)
+// from the start of each block, and h from the end of each block, so that
+// each window of k pixels, which spans at most two blocks, is the min
+// (max) of just h at its start and g at its end.  Windows are clipped to
+// the image (as in ImageBlur).  The vertical pass works on whole rows, so
+// its loops are vectorized across columns (pminub/pmaxub on x86).
+
+// Columns of each item of the parallel vertical pass
+#define MORPHSTRIP 1024
+
+// min (dilate == 0) or max (dilate != 0) of a[x] and b[x], into d[x].
+static inline void morphRow(uint8 *d, const uint8 *a, const uint8 *b, int n, int dilate)
+{
+  if (dilate)
+    for (int x = 0; x < n; x++)
+      d[x] = a[x] > b[x] ? a[x] : b[x];
+  else
+    for (int x = 0; x < n; x++)
+      d[x] = a[x] < b[x] ? a[x] : b[x];
+}
+
+// Work shared by the threads of a morphology pass
+typedef struct
+{
+  int width, height;
+  size_t stride;   // of all the buffers
+  const uint8 *src;
+  uint8 *dst;
+  uint8 *g, *h;    // scratch buffers (g may be dst, in the vertical pass)
+  int r;           // radius
+  int dilate;
+} Morph;
+
+// Horizontal pass over row y.
+static void morphHorizontal(void *arg, int y)
+{
+  Morph *m = arg;
+  int w = m->width, r = m->r, k = 2 * r + 1, dilate = m->dilate;
+  const uint8 *s = m->src + m->stride * y;
+  uint8 *g = m->g + m->stride * y, *h = m->h + m->stride * y;
+  uint8 *d = m->dst + m->stride * y;
+  for (int x = 0; x < w; x++)
+    g[x] = x % k == 0 ? s[x] : dilate ? (g[x - 1] > s[x] ? g[x - 1] : s[x])
+                                      : (g[x - 1] < s[x] ? g[x - 1] : s[x]);
+  for (int x = w - 1; x >= 0; x--)
+    h[x] = x % k == k - 1 || x == w - 1 ? s[x] : dilate ? (h[x + 1] > s[x] ? h[x + 1] : s[x])
+                                                        : (h[x + 1] < s[x] ? h[x + 1] : s[x]);
+  // janelas dentro da linha: h no início e g no fim, vetorizado
+  if (w > 2 * r)
+    morphRow(d + r, h, g + 2 * r, w - 2 * r, dilate);
+  // janelas cortadas pelos extremos da linha
+  for (int x = 0; x < w; x++)
+  {
+    if (x == r && w > 2 * r)
+      x = w - r; // saltar o interior
+    if (x >= w)
+      break;
+    int lo = x - r > 0 ? x - r : 0;
+    int hi = x + r < w ? x + r : w - 1;
+    if (lo / k != hi / k) // dois blocos
+      d[x] = dilate ? (h[lo] > g[hi] ? h[lo] : g[hi]) : (h[lo] < g[hi] ? h[lo] : g[hi]);
+    else
+      d[x] = lo % k == 0 ? g[hi] : h[lo];
+  }
+}
+
+// Vertical pass over the columns of strip i.
+// g is dst: each row of g is used for the last time by row y of the
+// result, which is then written over it.
+static void morphVertical(void *arg, int i)
+{
+  Morph *m = arg;
+  int hgt = m->height, r = m->r, k = 2 * r + 1, dilate = m->dilate;
+  size_t stride = m->stride;
+  int x0 = i * MORPHSTRIP;
+  int n = m->width - x0 < MORPHSTRIP ? m->width - x0 : MORPHSTRIP;
+  const uint8 *s = m->src + x0;
+  uint8 *g = m->dst + x0, *h = m->h + x0;
+  for (int y = hgt - 1; y >= 0; y--)
+    if (y % k == k - 1 || y == hgt - 1)
+      memcpy(h + stride * y, s + stride * y, (size_t)n);
+    else
+      morphRow(h + stride * y, h + stride * (y + 1), s + stride * y, n, dilate);
+  int gy = 0; // linhas de g já calculadas: [0, gy)
+  for (int y = 0; y < hgt; y++)
+  {
+    int lo = y - r > 0 ? y - r : 0;
+    int hi = y + r < hgt ? y + r : hgt - 1;
+    for (; gy <= hi; gy++)
+      if (gy % k == 0)
+        memcpy(g + stride * gy, s + stride * gy, (size_t)n);
+      else
+        morphRow(g + stride * gy, g + stride * (gy - 1), s + stride * gy, n, dilate);
+    uint8 *d = m->dst + stride * y + x0;
+    if (lo / k != hi / k)
+      morphRow(d, h + stride * lo, g + stride * hi, n, dilate);
+    else if (lo % k == 0)
+      memmove(d, g + stride * hi, (size_t)n);
+    else
+      memcpy(d, h + stride * lo, (size_t)n);
+  }
+}
+
+// Erode (dilate == 0) or dilate img by a (2dx+1)x(2dy+1) rectangle.
+static int morph(Image img, int dx, int dy, int dilate)
+{
+  assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  assert(dx >= 0 && dy >= 0);
+  if ((dx == 0 && dy == 0) || img->width == 0 || img->height == 0)
+    return 1;
+  Image result = ImageCreateUninitialized(img->width, img->height, img->maxval);
+  Image t = ImageCreateUninitialized(img->width, img->height, img->maxval);
+  Image h = ImageCreateUninitialized(img->width, img->height, img->maxval);
+  int success = result != NULL && t != NULL && h != NULL;
+  if (success)
+  {
+    Morph m = {img->width, img->height, (size_t)img->stride, img->pixel, result->pixel,
+               NULL, h->pixel, 0, dilate};
+    if (dx > 0)
+    { // passagem horizontal, para t (ou para o resultado, se for a única)
+      m.r = dx;
+      m.dst = dy > 0 ? t->pixel : result->pixel;
+      m.g = dy > 0 ? result->pixel : t->pixel;
+      ParallelFor("morph", img->height, morphHorizontal, &m);
+      PIXMEM += 7 * (unsigned long)img->width * img->height;
+      m.src = t->pixel;
+    }
+    if (dy > 0)
+    { // passagem vertical, para o resultado
+      m.r = dy;
+      m.dst = result->pixel;
+      ParallelFor("morph", (img->width + MORPHSTRIP - 1) / MORPHSTRIP, morphVertical, &m);
+      PIXMEM += 7 * (unsigned long)img->width * img->height;
+    }
+    // trocar os arrays: img fica com o resultado, e result com o original
+    uint8 *original = img->pixel;
+    img->pixel = result->pixel;
+    result->pixel = original;
+  }
+  ImageDestroy(&result);
+  ImageDestroy(&t);
+  ImageDestroy(&h);
+  return success;
+}
+
+/// Erode an image by a (2dx+1)x(2dy+1) rectangle: each pixel is
+/// substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], clipped to the image.
+int ImageErode(Image img, int dx, int dy)
+{ ///
+  return morph(img, dx, dy, 0);
+}
+
+/// Dilate an image by a (2dx+1)x(2dy+1) rectangle: the same as
+/// ImageErode, with the maximum.
+int ImageDilate(Image img, int dx, int dy)
+{ ///
+  return morph(img, dx, dy, 1);
+}
+
+// Apply morph (with dilate0) and then morph (with dilate1) to img.
+// Works on a clone, so that img is unchanged on failure.
+static int morph2(Image img, int dx, int dy, int dilate0, int dilate1)
+{
+  Image tmp = ImageClone(img);
+  int success = tmp != NULL && morph(tmp, dx, dy, dilate0) && morph(tmp, dx, dy, dilate1);
+  if (success)
+  { // trocar os arrays: img fica com o resultado
+    uint8 *original = img->pixel;
+    img->pixel = tmp->pixel;
+    tmp->pixel = original;
+  }
+  ImageDestroy(&tmp);
+  return success;
+}
+
+/// Open an image: erode and then dilate (removes small bright spots).
+int ImageOpen(Image img, int dx, int dy)
+{ ///
+  return morph2(img, dx, dy, 0, 1);
+}
+
+/// Close an image: dilate and then erode (fills small dark holes).
+int ImageClose(Image img, int dx, int dy)
+{ ///
+  return morph2(img, dx, dy, 1, 0);
+}
+
+/// Morphological gradient: dilation minus erosion (outlines edges).
+int ImageMorphGradient(Image img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  Image eroded = ImageClone(img);
+  Image dilated = ImageClone(img);
+  int success = eroded != NULL && dilated != NULL && morph(eroded, dx, dy, 0) &&
+                morph(dilated, dx, dy, 1) && unshare(dilated);
+  if (success)
+  {
+    for (int y = 0; y < img->height; y++)
+    { // dilatação - erosão, nunca negativo
+      uint8 *d = row(dilated, y);
+      const uint8 *e = row(eroded, y);
+      for (int x = 0; x < img->width; x++)
+        d[x] = (uint8)(d[x] - e[x]);
+    }
+    PIXMEM += 3 * (unsigned long)img->width * img->height;
+    // trocar os arrays: img fica com o resultado
+    uint8 *original = img->pixel;
+    img->pixel = dilated->pixel;
+    dilated->pixel = original;
+  }
+  ImageDestroy(&eroded);
+  ImageDestroy(&dilated);
+  return success;
+}
+
+/// Connected components
+
+// Components are labelled by runs (maximal horizontal segments of
+// foreground pixels), in two passes.  The first pass splits the image in
+// strips of rows, labelled in parallel: each strip finds the runs of its
+// rows, and joins each run to the runs it touches in the row above, in a
+// union-find forest of its runs.  The forests are then concatenated, and
+// the runs on both sides of each strip boundary are joined.  Runs are
+// numbered in raster order and each union keeps the smaller root, so a
+// parent always comes before its children, and a single pass in that order
+// finds the roots and numbers the components by their first pixel.  The
+// second pass writes the labels of the pixels, again by strips.
+
+// Strips per thread, for load balance (each one adds a boundary to merge)
+#define LABELSTRIPS 4
+
+// A run of foreground pixels, [x0, x1) in its row
+typedef struct
+{
+  int x0, x1;
+  uint32_t parent; // na floresta; no fim, o número da componente
+} LabelRun;
+
+// Runs of one strip of rows, [y0, y1)
+typedef struct
+{
+  int y0, y1;
+  LabelRun *runs;
+  uint32_t n, cap;
+  uint32_t first; // índice global da primeira run da faixa
+} LabelStrip;
+
+// Work shared by the threads of ImageLabelComponents
+typedef struct
+{
+  Image img;
+  int touch;        // 1 com vizinhança 8, 0 com vizinhança 4
+  LabelStrip *strips;
+  uint32_t *rowrun; // índice da primeira run de cada linha (e o total no fim)
+  LabelRun *runs;   // todas as runs, depois da primeira passagem
+  uint32_t *labels;
+  int failed;       // sem memória nalguma faixa
+} Labelling;
+
+// Foreground mask of the 64 pixels of row r from x (or up to w, at the
+// end of the row): bit i is set if r[x+i] is nonzero.  Each group of 8
+// pixels gets the top bit of its nonzero bytes, which a multiplication
+// then gathers in the top byte.
+static inline uint64_t labelMask(const uint8 *r, int x, int w)
+{
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+  uint64_t m = 0;
+  if (x + 64 <= w)
+    for (int i = 0; i < 8; i++)
+    {
+      uint64_t v;
+      memcpy(&v, r + x + 8 * i, 8);
+      v = (((v & low7) + low7) | v) & ~low7; // bit 7 dos bytes não nulos
+      m |= ((v >> 7) * 0x0102040810204080ull >> 56) << (8 * i);
+    }
+  else
+    for (int i = 0; x + i < w; i++)
+      m |= (uint64_t)(r[x + i] != 0) << i;
+  return m;
+}
+
+// Find the root of run u in forest f (with path halving).
+static inline uint32_t labelFind(LabelRun *f, uint32_t u)
+{
+  while (f[u].parent != u)
+  {
+    f[u].parent = f[f[u].parent].parent;
+    u = f[u].parent;
+  }
+  return u;
+}
+
+// Join the trees of the na runs of a row, from index ia of forest f, and
+// the nb runs of the next row, from index ib, that touch each other.  Both
+// rows are swept together, by increasing x.
+static void labelJoin(LabelRun *f, uint32_t ia, uint32_t na, uint32_t ib, uint32_t nb,
+                      int touch)
+{
+  const LabelRun *a = f + ia, *b = f + ib;
+  uint32_t i = 0, j = 0;
+  while (i < na && j < nb)
+  {
+    if (a[i].x0 < b[j].x1 + touch && b[j].x0 < a[i].x1 + touch)
+    {
+      uint32_t u = labelFind(f, ia + i), v = labelFind(f, ib + j);
+      if (u < v)
+        f[v].parent = u;
+      else if (v < u)
+        f[u].parent = v;
+    }
+    if (a[i].x1 < b[j].x1) // avança a run que acaba primeiro
+      i++;
+    else
+      j++;
+  }
+}
+
+// First pass over strip s: find its runs and their forest.
+static void labelStrip(void *arg, int s)
+{
+  Labelling *l = arg;
+  LabelStrip *st = &l->strips[s];
+  int w = l->img->width;
+  for (int y = st->y0; y < st->y1; y++)
+  {
+    const uint8 *r = row(l->img, y);
+    uint32_t start = st->n;
+    l->rowrun[y] = start;
+    if (st->cap - st->n < (uint32_t)w / 2 + 1)
+    { // espaço para as runs da linha, no máximo (w+1)/2
+      uint32_t cap = st->cap > 0 ? 2 * st->cap : 4096;
+      if (cap < st->n + (uint32_t)w / 2 + 1)
+        cap = st->n + (uint32_t)w / 2 + 1;
+      LabelRun *runs = realloc(st->runs, sizeof(LabelRun) * cap);
+      if (runs == NULL)
+      {
+        l->failed = 1;
+        return;
+      }
+      st->runs = runs;
+      st->cap = cap;
+    }
+    // as runs começam e acabam onde o bit de m difere do bit anterior
+    uint64_t open = 0; // 1 dentro de uma run
+    for (int x = 0; x < w; x += 64)
+    {
+      uint64_t m = labelMask(r, x, w);
+      for (uint64_t edges = m ^ (m << 1 | open); edges != 0; edges &= edges - 1)
+      {
+        LabelRun *run = &st->runs[st->n];
+        if (open)
         {
-          if (j_width < 0 || j_width >= ImageWidth)
-            continue;
-          sum += ImageGetPixel(imgcopy, j_width, i_height);
-          num++;
+          run->x1 = x + __builtin_ctzll(edges);
+          run->parent = st->n++;
+        }
+        else
+          run->x0 = x + __builtin_ctzll(edges);
+        open ^= 1;
+      }
+    }
+    if (open) // uma run até ao fim da linha
+    {
+      st->runs[st->n].x1 = w;
+      st->runs[st->n].parent = st->n;
+      st->n++;
+    }
+    if (y > st->y0) // juntar às runs da linha anterior
+      labelJoin(st->runs, l->rowrun[y - 1], start - l->rowrun[y - 1], start, st->n - start,
+                l->touch);
+  }
+}
+
+// Copy the runs of strip s to their place in all the runs.
+static void labelGather(void *arg, int s)
+{
+  Labelling *l = arg;
+  LabelStrip *st = &l->strips[s];
+  LabelRun *runs = l->runs + st->first;
+  for (uint32_t i = 0; i < st->n; i++)
+  {
+    runs[i] = st->runs[i];
+    runs[i].parent += st->first;
+  }
+  for (int y = st->y0; y < st->y1; y++)
+    l->rowrun[y] += st->first;
+  free(st->runs);
+  st->runs = NULL;
+}
+
+// Four labels, to write runs 8 labels at a time
+typedef uint32_t LabelVec __attribute__((vector_size(16)));
+
+// Second pass over strip s: write the labels of its pixels.
+// Most runs are short, so each one is written as 8 labels, plus the rest,
+// and followed by 8 zeros, which the next run overwrites (if it is closer),
+// instead of loops with unpredictable lengths.
+static void labelWrite(void *arg, int s)
+{
+  Labelling *l = arg;
+  LabelStrip *st = &l->strips[s];
+  int w = l->img->width;
+  const LabelVec zero = {0, 0, 0, 0};
+  for (int y = st->y0; y < st->y1; y++)
+  {
+    uint32_t *out = l->labels + (size_t)w * y;
+    memset(out, 0, (size_t)w * sizeof(uint32_t));
+    for (uint32_t i = l->rowrun[y]; i < l->rowrun[y + 1]; i++)
+    {
+      const LabelRun *run = &l->runs[i];
+      uint32_t c = run->parent;
+      if (run->x1 + 8 <= w)
+      {
+        LabelVec v = {c, c, c, c};
+        memcpy(out + run->x0, &v, sizeof(v));
+        memcpy(out + run->x0 + 4, &v, sizeof(v));
+        for (int x = run->x0 + 8; x < run->x1; x++)
+          out[x] = c;
+        memcpy(out + run->x1, &zero, sizeof(zero));
+        memcpy(out + run->x1 + 4, &zero, sizeof(zero));
+      }
+      else // no fim da linha
+        for (int x = run->x0; x < run->x1; x++)
+          out[x] = c;
+    }
+  }
+}
+
+/// Label the connected components of the foreground (nonzero pixels) of
+/// img, with connectivity 4 or 8 (see the comments above).
+/// Sets (*labels) to a new array with the label of each pixel, (*stats) to
+/// a new array with the stats of the background and of each component,
+/// and (*n) to the number of components.
+/// On failure (out of memory), returns 0 and errno/errCause are set.
+int ImageLabelComponents(Image img, int connectivity, uint32_t **labels,
+                         ComponentStats **stats, long *n)
+{ ///
+  assert(img != NULL);
+  assert(img->tiles == NULL); // requer uma imagem normal (não esparsa)
+  assert(connectivity == 4 || connectivity == 8);
+  assert(labels != NULL && stats != NULL && n != NULL);
+  int w = img->width, h = img->height;
+  int nstrips = LABELSTRIPS * ParallelThreads();
+  if (nstrips > h)
+    nstrips = h > 0 ? h : 1;
+  Labelling l = {img, connectivity == 8, NULL, NULL, NULL, NULL, 0};
+  l.labels = malloc((size_t)w * h * sizeof(uint32_t) + 1);
+  l.rowrun = malloc(((size_t)h + 1) * sizeof(uint32_t));
+  l.strips = calloc((size_t)nstrips, sizeof(LabelStrip));
+  ComponentStats *cs = malloc(sizeof(ComponentStats) * 256);
+  long ncs = 0, cap = 256; // componentes em cs, sem contar o fundo
+  int success = l.labels != NULL && l.rowrun != NULL && l.strips != NULL && cs != NULL;
+
+  // primeira passagem: runs e florestas das faixas
+  if (success)
+  {
+    for (int s = 0; s < nstrips; s++)
+    {
+      l.strips[s].y0 = (int)((long)h * s / nstrips);
+      l.strips[s].y1 = (int)((long)h * (s + 1) / nstrips);
+    }
+    ParallelFor("label", nstrips, labelStrip, &l);
+    success = !l.failed;
+  }
+  uint32_t total = 0;
+  if (success)
+  {
+    for (int s = 0; s < nstrips; s++)
+    {
+      l.strips[s].first = total;
+      total += l.strips[s].n;
+    }
+    l.rowrun[h] = total;
+    success = (l.runs = malloc(sizeof(LabelRun) * total + 1)) != NULL;
+  }
+  if (success)
+  {
+    ParallelFor("label", nstrips, labelGather, &l);
+    // juntar as runs dos dois lados de cada fronteira entre faixas
+    for (int s = 1; s < nstrips; s++)
+    {
+      int y = l.strips[s].y0;
+      labelJoin(l.runs, l.rowrun[y - 1], l.rowrun[y] - l.rowrun[y - 1], l.rowrun[y],
+                l.rowrun[y + 1] - l.rowrun[y], l.touch);
+    }
+
+    // numerar as componentes, por ordem: o pai de uma run vem antes dela, e
+    // já tem o número da componente
+    cs[0] = (ComponentStats){(long)w * h, 0, 0, w, h};
+    for (int y = 0; y < h && success; y++)
+      for (uint32_t i = l.rowrun[y]; i < l.rowrun[y + 1]; i++)
+      {
+        LabelRun *run = &l.runs[i];
+        if (run->parent == i)
+        { // uma raiz: nova componente
+          if (ncs + 1 == cap)
+          {
+            ComponentStats *more = realloc(cs, sizeof(ComponentStats) * 2 * cap);
+            if (more == NULL)
+            {
+              success = 0;
+              break;
+            }
+            cs = more;
+            cap *= 2;
+          }
+          run->parent = (uint32_t)++ncs;
+          cs[ncs] = (ComponentStats){0, run->x0, y, run->x1, y + 1}; // w, h: x e y finais
         }
+        else
+          run->parent = l.runs[run->parent].parent;
+        ComponentStats *c = &cs[run->parent];
+        c->area += run->x1 - run->x0;
+        cs[0].area -= run->x1 - run->x0;
+        if (run->x0 < c->x)
+          c->x = run->x0;
+        if (run->x1 > c->w)
+          c->w = run->x1;
+        c->h = y + 1;
       }
-      ImageSetPixel(img, j, i, (int)(((sum) / num) + 0.5));
+  }
+
+  // segunda passagem: os números das componentes nos pixeis
+  if (success)
+  {
+    for (long c = 1; c <= ncs; c++)
+    {
+      cs[c].w -= cs[c].x;
+      cs[c].h -= cs[c].y;
     }
+    ParallelFor("label", nstrips, labelWrite, &l);
+    // 1 leitura e 1 escrita por pixel
+    PIXMEM += 2 * (unsigned long)w * h;
   }
-  ImageDestroy(&imgcopy);
+
+  if (l.strips != NULL)
+    for (int s = 0; s < nstrips; s++)
+      free(l.strips[s].runs);
+  free(l.strips);
+  free(l.rowrun);
+  free(l.runs);
+  if (!success)
+  {
+    free(l.labels);
+    free(cs);
+    errCause = "Não foi possível alocar memória para as componentes";
+    errno = 12;
+    return 0;
+  }
+  *labels = l.labels;
+  *stats = cs;
+  *n = ncs;
+  return 1;
 }
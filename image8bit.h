@@ -13,12 +13,32 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+
+/// Version of the API, for programs that use the shared library
+/// (make libimage8bit.so).  The major version changes when the API
+/// changes in an incompatible way, and is the version in the soname of
+/// the library (libimage8bit.so.1).  The minor version changes when
+/// functions are added.
+#define IMAGE8BIT_VERSION_MAJOR 1
+#define IMAGE8BIT_VERSION_MINOR 1
+#define IMAGE8BIT_VERSION (IMAGE8BIT_VERSION_MAJOR * 100 + IMAGE8BIT_VERSION_MINOR)
+
+/// Marks the functions and variables of the API.
+/// The shared library is compiled with -fvisibility=hidden, so only these
+/// are exported, and the other modules it contains (pgmReader, pixelPool,
+/// parallel, ...) stay internal.
+#if defined(__GNUC__)
+#define IMAGE8BIT_API __attribute__((visibility("default")))
+#else
+#define IMAGE8BIT_API
+#endif
 
 // Type for pixel levels
 typedef uint8_t uint8;
 
 // Maximum value you can store in a pixel (maximum maxval accepted)
-extern const uint8 PixMax;
+extern IMAGE8BIT_API const uint8 PixMax;
 
 // Type Image is a pointer to image objects
 typedef struct image *Image;
@@ -33,11 +53,19 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
-char* ImageErrMsg() ;
+IMAGE8BIT_API char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
-void ImageInit(void) ;
+/// Currently, simply set names of instrumentation counters.
+/// (Calibration is deferred until InstrPrint needs it.)
+IMAGE8BIT_API void ImageInit(void) ;
+
+/// Version of the library in use: IMAGE8BIT_VERSION when it was compiled.
+/// A program compiled with this header works with the library if the
+/// major versions are the same, and the library's minor version is not
+/// older: ImageVersion() / 100 == IMAGE8BIT_VERSION_MAJOR and
+/// ImageVersion() >= IMAGE8BIT_VERSION.
+IMAGE8BIT_API int ImageVersion(void) ;
 
 /// Image management functions
 
@@ -49,55 +77,230 @@ void ImageInit(void) ;
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) ;
+IMAGE8BIT_API Image ImageCreate(int width, int height, uint8 maxval) ;
+
+/// Create a new image with undefined pixel levels.
+/// Same as ImageCreate, but pixels are not initialized, which saves
+/// time when the caller is going to set every pixel anyway.
+IMAGE8BIT_API Image ImageCreateUninitialized(int width, int height, uint8 maxval) ;
+
+/// Create a new sparse black image.
+/// Same as ImageCreate, but pixels are stored in tiles that are only
+/// allocated when written, so huge, mostly black images (such as a canvas
+/// for a mosaic) take little memory.
+/// Sparse images may only be used by: ImageGetPixel, ImageSetPixel,
+/// ImageGetRow, ImageSetRow, ImageSave, ImageStats, ImageCrop (the
+/// source), ImagePaste and ImageBlend (img1, the destination), ImageClone,
+/// and the information queries.  Other operations require normal images.
+/// When writing to a sparse image needs a tile that cannot be allocated,
+/// the operation leaves the image unchanged, as for clones (see ImageClone).
+IMAGE8BIT_API Image ImageCreateSparse(int width, int height, uint8 maxval) ;
+
+/// Check if img is sparse (created by ImageCreateSparse, or a clone of one).
+IMAGE8BIT_API int ImageIsSparse(Image img) ;
+
+/// Clone an image.
+/// Returns a new image with the same size, maxval and pixels as img, in
+/// constant time: both images share one pixel array until either of them
+/// is modified in-place, which first gives that image a private copy
+/// (copy-on-write).  If the copy cannot be allocated, the in-place
+/// operation leaves the image unchanged, and errno/errCause are set.
+/// Clones are destroyed with ImageDestroy, as any other image.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API Image ImageClone(Image img) ;
 
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
 /// Ensures: (*imgp)==NULL.
 /// Should never fail, and should preserve global errno/errCause.
-void ImageDestroy(Image* imgp) ;
+IMAGE8BIT_API void ImageDestroy(Image* imgp) ;
 
 /// PGM file operations
 
-/// Load a raw PGM file.
+/// Load a PGM file, raw (P5) or plain (P2), or a tiled file (see ImageSaveTiled).
 /// Only 8 bit PGM files are accepted.
+/// Comments (from # to the end of the line) may appear between header fields.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char* filename) ;
+IMAGE8BIT_API Image ImageLoad(const char* filename) ;
 
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
-int ImageSave(Image img, const char* filename) ;
+IMAGE8BIT_API int ImageSave(Image img, const char* filename) ;
+
+/// Save image to plain PGM file (P2), with levels as decimal numbers.
+/// Plain files are about 3.5 times larger and slower to read than raw ones,
+/// but some tools produce or require them.
+/// Success and failure are treated as in ImageSave.
+IMAGE8BIT_API int ImageSavePlain(Image img, const char* filename) ;
+
+/// In-memory files, for programs that get or send images without files
+/// (for instance, over a network).
+
+/// Load an image from the len bytes at buf, with the contents of a PGM
+/// file, raw (P5) or plain (P2).  (Tiled files are not accepted.)
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API Image ImageLoadFromBuffer(const void* buf, size_t len) ;
+
+/// Save image in raw PGM format (P5) to a new buffer, with the contents
+/// ImageSave would write to a file: (*buf) is set to the buffer, allocated
+/// with malloc, and (*len) to its size in bytes.
+/// (The caller is responsible for freeing the buffer!)
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+IMAGE8BIT_API int ImageSaveToBuffer(Image img, void** buf, size_t* len) ;
+
+/// PGM streams
+
+/// A PGM stream is a file with several PGM images (frames), one after the
+/// other, as allowed by the PGM specification (and written by cameras,
+/// for sequences of frames).  Streams are read frame by frame, without
+/// reopening the file, with read-ahead; frames may also be read in any
+/// order, through an index of their positions in the file, which is built
+/// (by parsing only the headers of raw frames) when first needed.
+
+/// Type ImageStream is a pointer to stream objects
+typedef struct imageStream *ImageStream;
+
+/// Open a PGM stream for reading.
+/// Frames are 8 bit PGM images, raw (P5) or plain (P2), as for ImageLoad.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API ImageStream ImageStreamOpen(const char* filename) ;
+
+/// Create a PGM stream for writing (see ImageStreamWrite).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API ImageStream ImageStreamCreate(const char* filename) ;
+
+/// Check if there are no more frames to read (after whitespace).
+/// Requires: s was opened for reading.
+IMAGE8BIT_API int ImageStreamEnd(ImageStream s) ;
+
+/// Read the next frame of stream s.
+/// Requires: s was opened for reading, and !ImageStreamEnd(s).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API Image ImageStreamRead(ImageStream s) ;
+
+/// Count the frames of stream s, building its index if needed.
+/// The position of the next frame to read is not changed.
+/// Requires: s was opened for reading.
+/// On failure (including an invalid or truncated frame), returns -1 and
+/// errno/errCause are set accordingly.
+IMAGE8BIT_API int ImageStreamCount(ImageStream s) ;
+
+/// Read frame i (counting from 0) of stream s, by seeking to it.
+/// Next reads go on from frame i+1.
+/// Requires: s was opened for reading, and i >= 0.
+/// Success and failure are treated as in ImageStreamRead (a frame past
+/// the end of the stream is a failure).
+IMAGE8BIT_API Image ImageStreamFrame(ImageStream s, int i) ;
+
+/// Write img as the next frame of stream s, in raw (P5) format.
+/// Requires: s was created for writing.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+IMAGE8BIT_API int ImageStreamWrite(ImageStream s, Image img) ;
+
+/// Close the stream pointed to by (*sp).
+/// If (*sp)==NULL, no operation is performed.
+/// Ensures: (*sp)==NULL.
+/// On success, returns nonzero.
+/// On failure (writing the last frames), returns 0 and errno/errCause are set.
+IMAGE8BIT_API int ImageStreamClose(ImageStream* sp) ;
+
+/// Asynchronous saves
+
+/// Handle of a save in progress (see ImageSaveAsync)
+typedef struct imageSaveJob *ImageSaveJob;
+
+/// Flag for ImageSaveAsync: the file is not going to be read soon, so,
+/// once written, it is flushed to disk and dropped from the page cache
+/// (posix_fadvise DONTNEED), instead of pushing out more useful pages.
+#define IMAGE_SAVE_DONTNEED 1
+
+/// Save image to PGM file, in the background.
+/// Returns at once, while a thread writes the header and pixels with large
+/// writev calls into a temporary file in the same directory, and renames it
+/// to filename: the file is either unchanged or completely written, never
+/// partial.  img is cloned (see ImageClone), so it may be modified or
+/// destroyed while the save is in progress.
+///   flags : 0 or IMAGE_SAVE_DONTNEED.
+/// On success, returns a handle, which must be passed to ImageSaveWait.
+/// On failure (out of memory), returns NULL and errno/errCause are set.
+IMAGE8BIT_API ImageSaveJob ImageSaveAsync(Image img, const char* filename, int flags) ;
+
+/// Wait for the save (*jobp) to complete, and release it.
+/// Ensures: (*jobp)==NULL.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately
+/// (filename was not changed).
+IMAGE8BIT_API int ImageSaveWait(ImageSaveJob* jobp) ;
+
+/// Tiled image files
+
+/// Save image to a tiled file.
+/// The image is split in tiles of 256x256 pixels, each compressed on its
+/// own (see tileCodec.h), in parallel (see parallel.h), and a tile index
+/// is stored with them.  Tiled files are not PGM files: they are read by
+/// ImageLoad and ImageLoadRegion.
+/// Success and failure are treated as in ImageSave.
+IMAGE8BIT_API int ImageSaveTiled(Image img, const char* filename) ;
+
+/// Load a rectangular region of an image file (PGM or tiled).
+/// Same result as ImageLoad followed by ImageCrop(img, x, y, w, h), but
+/// from a tiled file only the tiles that touch the region are read and
+/// decoded (in parallel), so small regions of huge images load quickly.
+/// Requires: w >= 0 and h >= 0.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, including a region not inside the image in the file,
+/// returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
 
 /// Information queries
 
 /// These functions do not modify the image and never fail.
 
 /// Get image width
-int ImageWidth(Image img) ;
+IMAGE8BIT_API int ImageWidth(Image img) ;
 
 /// Get image height
-int ImageHeight(Image img) ;
+IMAGE8BIT_API int ImageHeight(Image img) ;
 
 /// Get image maximum gray level
-int ImageMaxval(Image img) ;
+IMAGE8BIT_API int ImageMaxval(Image img) ;
 
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) ;
+IMAGE8BIT_API void ImageStats(Image img, uint8* min, uint8* max) ;
+
+/// Content hash.
+/// A 64-bit hash of the width, height, maxval and pixels of img, which
+/// does not depend on how the pixels are stored (padded rows, sparse
+/// tiles, shared buffers).  Images with the same content have the same
+/// hash; different images almost surely have different hashes (this is
+/// not a cryptographic hash).  Rows are hashed 32 bytes at a time, in 8
+/// independent lanes, so that the main loop is vectorized.
+IMAGE8BIT_API uint64_t ImageHash(Image img) ;
 
 /// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) ;
+IMAGE8BIT_API int ImageValidPos(Image img, int x, int y) ;
 
 /// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) ;
+IMAGE8BIT_API int ImageValidRect(Image img, int x, int y, int w, int h) ;
 
 /// Pixel get & set operations
 
@@ -107,33 +310,45 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 /// implement more complex operations.
 
 /// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y) ;
+IMAGE8BIT_API uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) ;
+IMAGE8BIT_API void ImageSetPixel(Image img, int x, int y, uint8 level) ;
+
+/// Copy the n pixels of row y of img, from column x on, to buf.
+/// Requires: (x,y,n,1) is a valid rectangle of img.
+IMAGE8BIT_API void ImageGetRow(Image img, int x, int y, int n, uint8* buf) ;
+
+/// Set the n pixels of row y of img, from column x on, to the levels in buf.
+/// Requires: (x,y,n,1) is a valid rectangle of img, levels <= maxval.
+/// Returns 0 if the pixels of img had to be copied (clone) or allocated
+/// (sparse image) and there was no memory: img is then left unchanged
+/// and errno/errCause are set.  Returns nonzero on success.
+IMAGE8BIT_API int ImageSetRow(Image img, int x, int y, int n, const uint8* buf) ;
 
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
+/// All of these functions modify the image in-place: no allocation involved,
+/// unless the pixels are shared with a clone (see ImageClone).
 /// They never fail.
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) ;
+IMAGE8BIT_API void ImageNegative(Image img) ;
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+IMAGE8BIT_API void ImageThreshold(Image img, uint8 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) ;
+IMAGE8BIT_API void ImageBrighten(Image img, double factor) ;
 
 /// Geometric transformations
 
@@ -153,7 +368,18 @@ void ImageBrighten(Image img, double factor) ;
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageRotate(Image img) ;
+IMAGE8BIT_API Image ImageRotate(Image img) ;
+
+/// Rotate an image into an existing image.
+/// Same as ImageRotate, but the result is stored in dst, reusing its pixel
+/// array when it is large enough: dst takes the rotated dimensions and the
+/// maxval of img.
+/// Requires: dst != img.
+/// Ensures: The original img is not modified.
+/// On success, returns nonzero.
+/// On failure (the larger pixel array could not be allocated), returns 0,
+/// errno/errCause are set accordingly, and dst is not modified.
+IMAGE8BIT_API int ImageRotateInto(Image img, Image dst) ;
 
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
@@ -162,7 +388,12 @@ Image ImageRotate(Image img) ;
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageMirror(Image img) ;
+IMAGE8BIT_API Image ImageMirror(Image img) ;
+
+/// Mirror an image in-place = flip left-right.
+/// Same result as ImageMirror, but img is modified in-place (see ImageClone).
+/// Never fails.
+IMAGE8BIT_API void ImageMirrorInPlace(Image img) ;
 
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
@@ -176,34 +407,88 @@ Image ImageMirror(Image img) ;
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCrop(Image img, int x, int y, int w, int h) ;
+IMAGE8BIT_API Image ImageCrop(Image img, int x, int y, int w, int h) ;
+
+/// Filters for ImageResize
+typedef enum {
+  RESIZE_BOX,       // mean of blocks of pixels, for integer factors only
+  RESIZE_AREA,      // mean of the source area under each pixel (any size)
+  RESIZE_BILINEAR,  // bilinear interpolation (meant for enlarging)
+} ResizeFilter;
+
+/// Resize an image to width w and height h, with filter:
+///   RESIZE_BOX: shrink by integer factors fx=width/w and fy=height/h,
+///     each pixel being the rounded mean of a block of fx*fy pixels.
+///   RESIZE_AREA: each pixel is the mean of the pixels under its area in
+///     img, weighted by how much of each one it covers.  This is the same
+///     as RESIZE_BOX, for integer factors, and a good filter for shrinking.
+///   RESIZE_BILINEAR: each pixel is interpolated from the 4 pixels of img
+///     around its center (which aliases when shrinking by more than 2).
+/// Weights are fixed-point, precomputed per row and per column, and rows
+/// are resized in parallel (see parallel.h).
+/// Requires:
+///   img is not sparse, w >= 0 and h >= 0, and img is not empty (unless
+///   the result is).
+///   For RESIZE_BOX, w divides the width of img, and h its height.
+/// Ensures:
+///   The original img is not modified.
+///   The returned image has width w and height h, and the maxval of img.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+IMAGE8BIT_API Image ImageResize(Image img, int w, int h, ResizeFilter filter) ;
 
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) ;
+IMAGE8BIT_API void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageClone).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
-void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+IMAGE8BIT_API void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
+
+/// How ImageComposite applies an overlay
+typedef enum { COMPOSITE_PASTE, COMPOSITE_BLEND } CompositeMode;
+
+/// One overlay for ImageComposite: img is pasted or blended (with alpha)
+/// into position (x, y) of the canvas.
+typedef struct {
+  Image img;
+  int x, y;
+  CompositeMode mode;
+  double alpha;   // only used by COMPOSITE_BLEND
+} CompositeOp;
+
+/// Apply a list of overlays to canvas, in order.
+/// The result is the same as calling ImagePaste or ImageBlend for ops[0],
+/// ops[1], ..., ops[n-1], in this order, but the canvas is split in tiles
+/// that are processed in parallel (see parallel.h), each tile applying the
+/// ops that touch it, in order.
+/// Requires: each ops[i].img fits inside canvas at (ops[i].x, ops[i].y),
+/// and is not sparse.  The canvas may be sparse.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and
+/// canvas is unchanged.
+IMAGE8BIT_API int ImageComposite(Image canvas, const CompositeOp ops[], int n) ;
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
+IMAGE8BIT_API int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
+IMAGE8BIT_API int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
 /// Filtering
 
@@ -211,6 +496,79 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+IMAGE8BIT_API void ImageBlur(Image img, int dx, int dy) ;
+
+/// Apply a (2dx+1)x(2dy+1) rank filter to an image.
+/// Each pixel is substituted by the level at position q*(n-1) (rounded
+/// down) in the sorted levels of the n pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], clipped to the image, as in ImageBlur.
+/// So q=0 gives the minimum, q=0.5 the median and q=1 the maximum.
+/// The cost per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// Requires: 0 <= q <= 1, and dy < 32768.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and
+/// img is unchanged.
+IMAGE8BIT_API int ImageRankFilter(Image img, int dx, int dy, double q) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image (removes salt and
+/// pepper noise): the same as ImageRankFilter(img, dx, dy, 0.5).
+IMAGE8BIT_API int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// These functions use a (2dx+1)x(2dy+1) rectangle as structuring element,
+/// clipped to the image (as in ImageBlur), and their cost per pixel does
+/// not depend on dx and dy (van Herk/Gil-Werman algorithm).
+/// The image is changed in-place.
+/// Requires: img is not sparse, dx >= 0 and dy >= 0.
+/// On success, they return nonzero.
+/// On failure (out of memory), they return 0, errno/errCause are set, and
+/// img is unchanged.
+
+/// Erode: each pixel is substituted by the minimum of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy].
+IMAGE8BIT_API int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate: each pixel is substituted by the maximum of the pixels in the
+/// rectangle [x-dx, x+dx]x[y-dy, y+dy].
+IMAGE8BIT_API int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open: erode and then dilate (removes small bright spots).
+IMAGE8BIT_API int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close: dilate and then erode (fills small dark holes).
+IMAGE8BIT_API int ImageClose(Image img, int dx, int dy) ;
+
+/// Morphological gradient: dilation minus erosion (outlines edges).
+IMAGE8BIT_API int ImageMorphGradient(Image img, int dx, int dy) ;
+
+/// Connected components
+
+/// Statistics of one connected component (see ImageLabelComponents)
+typedef struct {
+  long area;        // number of pixels
+  int x, y, w, h;   // bounding box
+} ComponentStats;
+
+/// Label the connected components of the foreground of a binary image,
+/// such as the result of ImageThreshold: the pixels with nonzero level.
+/// connectivity is 4 (neighbours share a side) or 8 (or a corner).
+/// Components are numbered 1, 2, ..., n, in the order of their first pixel
+/// (top to bottom, left to right), and (*n) is set to n.
+/// (*labels) is set to a new array of width*height labels, row by row, with
+/// the label of each pixel, or 0 for the background.
+/// (*stats) is set to a new array of n+1 ComponentStats: (*stats)[l] for
+/// component l, and (*stats)[0] for the background (its area, and the
+/// bounding box of the whole image).
+/// (The caller is responsible for freeing both arrays!)
+/// The image is labelled by strips of rows in parallel (see parallel.h),
+/// with a union-find of the runs of foreground pixels, which is then merged
+/// across the strip boundaries.
+/// Requires: img is not sparse.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errno/errCause are set.
+IMAGE8BIT_API int ImageLabelComponents(Image img, int connectivity, uint32_t** labels,
+                                       ComponentStats** stats, long* n) ;
 
 #endif
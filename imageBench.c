@@ -0,0 +1,469 @@
+// imageBench - Throughput benchmarks for the image8bit module.
+//
+// This program times every image8bit operation on synthetic images of
+// several sizes and reports the median time per pixel, the throughput,
+// and the pixmem instrumentation count per pixel.
+// Results may be written to a CSV file and compared against a baseline
+// CSV file produced by a previous run, to detect performance regressions.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "image1bit.h"
+#include "image16bit.h"
+#include "imageGen.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Benchmark image8bit operations on synthetic images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -s N,N,...      Image sizes (square side), default 256,512,1024\n"
+    "  -r REPS         Timed repetitions per case (median is reported), default 5\n"
+    "  -w WARMUP       Untimed warmup runs per case, default 1\n"
+    "  -f OP           Only run operations whose name contains OP\n"
+    "  -o FILE         Write results in CSV format to FILE\n"
+    "  -b FILE         Compare with baseline CSV FILE (from a previous -o)\n"
+    "  -t PERCENT      Regression threshold for -b, default 10\n"
+    "\n"
+    "  Exit status is 1 if any case is slower than the baseline by more\n"
+    "  than the threshold.\n"
+    ;
+
+// Wall-clock time in seconds
+static double wallTime(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Benchmark case state.
+// src is the pristine input, which timed runs must not modify.
+// work is a copy of src, restored before each run of in-place operations.
+// sub is a second input for operations on two images.
+// out receives images created by the timed run (destroyed afterwards).
+typedef struct {
+  Image src;
+  Image work;
+  Image sub;
+  Image out;
+  int subx, suby;        // position of sub inside src, when relevant
+  const char* tmpfile;   // scratch file for load/save
+  BitImage bsrc, bsub;   // binary versions of src and sub, when relevant
+  Image16 src16, sub16;  // 12-bit versions of src and sub, when relevant
+  Image16 out16;
+  uint32_t* labels;      // outputs of ImageLabelComponents
+  ComponentStats* cstats;
+} Bench;
+
+// Untimed setup helpers
+static void restoreWork(Bench* b) { ImagePaste(b->work, 0, 0, b->src); }
+static void destroyOut(Bench* b) { if (b->out != NULL) ImageDestroy(&b->out); }
+static void makeBits(Bench* b) {
+  b->bsrc = BitImageFromImage(b->src, 128);
+  b->bsub = BitImageFromImage(b->sub, 128);
+  if (b->bsrc == NULL || b->bsub == NULL) error(2, errno, "Preparing binary images");
+}
+static void destroyBits(Bench* b) {
+  BitImageDestroy(&b->bsrc);
+  BitImageDestroy(&b->bsub);
+}
+static void thresholdWork(Bench* b) {
+  restoreWork(b);
+  ImageThreshold(b->work, 128);
+}
+static void freeLabels(Bench* b) {
+  free(b->labels);
+  free(b->cstats);
+  b->labels = NULL;
+  b->cstats = NULL;
+}
+static void make16(Bench* b) {
+  b->src16 = Image16FromImage(b->src, 4095);
+  if (b->src16 == NULL) error(2, errno, "Preparing 16-bit images");
+  if (b->sub != NULL && (b->sub16 = Image16FromImage(b->sub, 4095)) == NULL)
+    error(2, errno, "Preparing 16-bit images");
+}
+static void save16(Bench* b) {
+  make16(b);
+  if (!Image16Save(b->src16, b->tmpfile)) error(2, errno, "Saving 16-bit image");
+}
+static void destroy16(Bench* b) {
+  Image16Destroy(&b->src16);
+  Image16Destroy(&b->sub16);
+  Image16Destroy(&b->out16);
+}
+
+// Timed operations
+static void runCreate(Bench* b) {
+  b->out = ImageCreate(ImageWidth(b->src), ImageHeight(b->src), PixMax);
+}
+static void runLoad(Bench* b) { b->out = ImageLoad(b->tmpfile); }
+static void runSave(Bench* b) { ImageSave(b->src, b->tmpfile); }
+static void savePlain(Bench* b) { ImageSavePlain(b->src, b->tmpfile); }
+static void saveTiled(Bench* b) { ImageSaveTiled(b->src, b->tmpfile); }
+static void runRegion(Bench* b) {  // the central quarter
+  int w = ImageWidth(b->src), h = ImageHeight(b->src);
+  b->out = ImageLoadRegion(b->tmpfile, w / 4, h / 4, w / 2, h / 2);
+}
+static void runStats(Bench* b) { uint8 min, max; ImageStats(b->src, &min, &max); }
+static void runGetPixel(Bench* b) {
+  volatile unsigned sum = 0;
+  for (int y = 0; y < ImageHeight(b->src); y++)
+    for (int x = 0; x < ImageWidth(b->src); x++)
+      sum += ImageGetPixel(b->src, x, y);
+}
+static void runSetPixel(Bench* b) {
+  for (int y = 0; y < ImageHeight(b->work); y++)
+    for (int x = 0; x < ImageWidth(b->work); x++)
+      ImageSetPixel(b->work, x, y, (uint8)(x ^ y));
+}
+static void runNegative(Bench* b) { ImageNegative(b->work); }
+static void runThreshold(Bench* b) { ImageThreshold(b->work, 128); }
+static void runBrighten(Bench* b) { ImageBrighten(b->work, 1.3); }
+static void runRotate(Bench* b) { b->out = ImageRotate(b->src); }
+static void runMirror(Bench* b) { b->out = ImageMirror(b->src); }
+static void runCrop(Bench* b) {
+  int w = ImageWidth(b->src), h = ImageHeight(b->src);
+  b->out = ImageCrop(b->src, w / 4, h / 4, w / 2, h / 2);
+}
+static void runResizeBox(Bench* b) {  // half size
+  b->out = ImageResize(b->src, ImageWidth(b->src) / 2, ImageHeight(b->src) / 2, RESIZE_BOX);
+}
+static void runResizeArea(Bench* b) {  // 2/3 size
+  b->out = ImageResize(b->src, ImageWidth(b->src) * 2 / 3, ImageHeight(b->src) * 2 / 3,
+                       RESIZE_AREA);
+}
+static void runResizeBilinear(Bench* b) {  // 3/2 size
+  b->out = ImageResize(b->src, ImageWidth(b->src) * 3 / 2, ImageHeight(b->src) * 3 / 2,
+                       RESIZE_BILINEAR);
+}
+static void runPaste(Bench* b) { ImagePaste(b->work, b->subx, b->suby, b->sub); }
+static void runBlend(Bench* b) { ImageBlend(b->work, b->subx, b->suby, b->sub, 0.33); }
+static void runMatch(Bench* b) { ImageMatchSubImage(b->src, b->subx, b->suby, b->sub); }
+static void runLocate(Bench* b) { int x, y; ImageLocateSubImage(b->src, &x, &y, b->sub); }
+static void runBlur(Bench* b) { ImageBlur(b->work, 3, 3); }
+static void runMedian(Bench* b) { ImageMedian(b->work, 3, 3); }
+static void runErode(Bench* b) { ImageErode(b->work, 3, 3); }
+static void runLabel(Bench* b) {
+  long n;
+  ImageLabelComponents(b->work, 8, &b->labels, &b->cstats, &n);
+}
+static void runComposite(Bench* b) {
+  // Four overlays that tile the whole image
+  int w = ImageWidth(b->sub), h = ImageHeight(b->sub);
+  CompositeOp ops[4] = {
+    { b->sub, 0, 0, COMPOSITE_BLEND, 0.33 }, { b->sub, w, 0, COMPOSITE_BLEND, 0.33 },
+    { b->sub, 0, h, COMPOSITE_BLEND, 0.33 }, { b->sub, w, h, COMPOSITE_BLEND, 0.33 },
+  };
+  ImageComposite(b->work, ops, 4);
+}
+static void runBitLocate(Bench* b) {
+  int x, y;
+  BitImageLocateSubImage(b->bsrc, &x, &y, b->bsub);
+}
+static void runLoad16(Bench* b) { b->out16 = Image16Load(b->tmpfile); }
+static void runNegative16(Bench* b) { Image16Negative(b->src16); }
+static void runRotate16(Bench* b) { b->out16 = Image16Rotate(b->src16); }
+static void runBlend16(Bench* b) { Image16Blend(b->src16, b->subx, b->suby, b->sub16, 0.33); }
+static void runBlur16(Bench* b) { Image16Blur(b->src16, 3, 3); }
+
+// How the sub image is prepared
+enum { SUB_NONE, SUB_HALF, SUB_CORNER };
+
+typedef struct {
+  const char* name;
+  void (*run)(Bench*);
+  void (*before)(Bench*);  // untimed, before each run (may be NULL)
+  void (*after)(Bench*);   // untimed, after each run (may be NULL)
+  int sub;                 // SUB_*
+} BenchOp;
+
+static const BenchOp ops[] = {
+  { "create",    runCreate,    NULL,        destroyOut, SUB_NONE },
+  { "load",      runLoad,      NULL,        destroyOut, SUB_NONE },
+  { "save",      runSave,      NULL,        NULL,       SUB_NONE },
+  { "loadplain", runLoad,      savePlain,   destroyOut, SUB_NONE },
+  { "saveplain", savePlain,    NULL,        NULL,       SUB_NONE },
+  { "loadtiled", runLoad,      saveTiled,   destroyOut, SUB_NONE },
+  { "savetiled", saveTiled,    NULL,        NULL,       SUB_NONE },
+  { "regiontiled", runRegion,  saveTiled,   destroyOut, SUB_NONE },
+  { "stats",     runStats,     NULL,        NULL,       SUB_NONE },
+  { "getpixel",  runGetPixel,  NULL,        NULL,       SUB_NONE },
+  { "setpixel",  runSetPixel,  NULL,        NULL,       SUB_NONE },
+  { "negative",  runNegative,  restoreWork, NULL,       SUB_NONE },
+  { "threshold", runThreshold, restoreWork, NULL,       SUB_NONE },
+  { "brighten",  runBrighten,  restoreWork, NULL,       SUB_NONE },
+  { "rotate",    runRotate,    NULL,        destroyOut, SUB_NONE },
+  { "mirror",    runMirror,    NULL,        destroyOut, SUB_NONE },
+  { "crop",      runCrop,      NULL,        destroyOut, SUB_NONE },
+  { "resizebox", runResizeBox, NULL,        destroyOut, SUB_NONE },
+  { "resizearea", runResizeArea, NULL,      destroyOut, SUB_NONE },
+  { "resizebil", runResizeBilinear, NULL,   destroyOut, SUB_NONE },
+  { "paste",     runPaste,     restoreWork, NULL,       SUB_HALF },
+  { "blend",     runBlend,     restoreWork, NULL,       SUB_HALF },
+  { "match",     runMatch,     NULL,        NULL,       SUB_HALF },
+  { "locate",    runLocate,    NULL,        NULL,       SUB_CORNER },
+  { "blur",      runBlur,      restoreWork, NULL,       SUB_NONE },
+  { "median",    runMedian,    restoreWork, NULL,       SUB_NONE },
+  { "erode",     runErode,     restoreWork, NULL,       SUB_NONE },
+  { "label",     runLabel,     thresholdWork, freeLabels, SUB_NONE },
+  { "composite", runComposite, restoreWork, NULL,       SUB_HALF },
+  { "bitlocate", runBitLocate, makeBits,    destroyBits, SUB_CORNER },
+  { "load16",    runLoad16,    save16,      destroy16,  SUB_NONE },
+  { "negative16", runNegative16, make16,    destroy16,  SUB_NONE },
+  { "rotate16",  runRotate16,  make16,      destroy16,  SUB_NONE },
+  { "blend16",   runBlend16,   make16,      destroy16,  SUB_HALF },
+  { "blur16",    runBlur16,    make16,      destroy16,  SUB_NONE },
+};
+#define NUMOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// Input kinds.  The adversarial input only makes sense for locate.
+static const char* inputs[] = { "random", "uniform", "gradient", "adversarial" };
+#define NUMINPUTS 4
+#define ADVERSARIAL 3
+#define ADVERSARIAL_MAXSIZE 512
+#define ADVERSARIAL_SUB 8
+
+// Create src (and sub, for adversarial) for input kind k.
+static int makeInput(Bench* b, int k, int size)
+{
+  switch (k) {
+  case 0: b->src = ImageGenRandom(size, size, 12345); break;
+  case 1: b->src = ImageGenUniform(size, size, 128); break;
+  case 2: b->src = ImageGenGradient(size, size); break;
+  case ADVERSARIAL:
+    return ImageGenLocateWorst(size, size, ADVERSARIAL_SUB, ADVERSARIAL_SUB,
+                               &b->src, &b->sub);
+  }
+  return b->src != NULL;
+}
+
+// Size of file name in bytes, or -1.
+static long fileSize(const char* name)
+{
+  FILE* f = fopen(name, "rb");
+  if (f == NULL) return -1;
+  long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+  fclose(f);
+  return size;
+}
+
+// One measured result
+typedef struct {
+  char op[32];
+  char input[32];
+  int width, height;
+  double nspp;       // median nanoseconds per pixel
+  double gbps;       // image bytes processed per second (1e9)
+  double pixmempp;   // pixmem count per pixel
+} Result;
+
+static int cmpDouble(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Run one case, with warmup and reps timed repetitions.
+static Result benchCase(const BenchOp* op, Bench* b, const char* input,
+                        int warmup, int reps)
+{
+  int w = ImageWidth(b->src), h = ImageHeight(b->src);
+  double npix = (double)w * h;
+  double* times = malloc(sizeof(double) * reps);
+  if (times == NULL) error(2, errno, "Allocating results");
+  unsigned long pixmem = 0;
+  for (int r = -warmup; r < reps; r++) {
+    if (op->before != NULL) op->before(b);
+    InstrReset();
+    double t0 = wallTime();
+    op->run(b);
+    double t = wallTime() - t0;
+    pixmem = InstrCount[INSTR_PIXMEM];
+    if (op->after != NULL) op->after(b);
+    if (r >= 0) times[r] = t;
+  }
+  qsort(times, reps, sizeof(double), cmpDouble);
+  double median = (reps % 2 == 1) ? times[reps / 2]
+                                  : 0.5 * (times[reps / 2 - 1] + times[reps / 2]);
+  free(times);
+
+  Result res;
+  snprintf(res.op, sizeof(res.op), "%s", op->name);
+  snprintf(res.input, sizeof(res.input), "%s", input);
+  res.width = w;
+  res.height = h;
+  res.nspp = median * 1e9 / npix;
+  res.gbps = median > 0.0 ? npix / median * 1e-9 : 0.0;
+  res.pixmempp = (double)pixmem / npix;
+  return res;
+}
+
+// Find the baseline ns/pixel for a case in CSV file f.  Returns -1 if absent.
+static double baselineNspp(FILE* f, const Result* r)
+{
+  char line[256];
+  char op[32], input[32];
+  int w, h;
+  double nspp;
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%31[^,],%31[^,],%d,%d,%lf", op, input, &w, &h, &nspp) == 5 &&
+        strcmp(op, r->op) == 0 && strcmp(input, r->input) == 0 &&
+        w == r->width && h == r->height)
+      return nspp;
+  }
+  return -1.0;
+}
+
+int main(int argc, char* argv[])
+{
+  program_name = argv[0];
+  int sizes[16] = { 256, 512, 1024 };
+  int nsizes = 3;
+  int reps = 5;
+  int warmup = 1;
+  double threshold = 10.0;
+  const char* filter = NULL;
+  const char* csvname = NULL;
+  const char* basename = NULL;
+
+  for (int k = 1; k < argc; k++) {
+    if (k + 1 >= argc || argv[k][0] != '-' || strlen(argv[k]) != 2)
+      error(1, 0, "\n%s", USAGE);
+    const char* arg = argv[++k];
+    switch (argv[k - 1][1]) {
+    case 's': {
+      nsizes = 0;
+      const char* p = arg;
+      int n, len;
+      while (nsizes < 16 && sscanf(p, "%d%n", &n, &len) == 1 && n > 0) {
+        sizes[nsizes++] = n;
+        p += len;
+        if (*p != ',') break;
+        p++;
+      }
+      if (nsizes == 0) error(1, 0, "Invalid sizes: %s", arg);
+      break;
+    }
+    case 'r': if (sscanf(arg, "%d", &reps) != 1 || reps < 1) error(1, 0, "Invalid reps"); break;
+    case 'w': if (sscanf(arg, "%d", &warmup) != 1 || warmup < 0) error(1, 0, "Invalid warmup"); break;
+    case 't': if (sscanf(arg, "%lf", &threshold) != 1) error(1, 0, "Invalid threshold"); break;
+    case 'f': filter = arg; break;
+    case 'o': csvname = arg; break;
+    case 'b': basename = arg; break;
+    default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+
+  ImageInit();
+
+  FILE* csv = NULL;
+  if (csvname != NULL) {
+    csv = fopen(csvname, "w");
+    if (csv == NULL) error(2, errno, "Opening %s", csvname);
+    fprintf(csv, "op,input,width,height,ns_per_pixel,gb_per_s,pixmem_per_pixel\n");
+  }
+  FILE* base = NULL;
+  if (basename != NULL) {
+    base = fopen(basename, "r");
+    if (base == NULL) error(2, errno, "Opening %s", basename);
+  }
+
+  // A new file with a unique name, that only we can open
+  char tmpfile[] = "/tmp/imageBench.XXXXXX";
+  int fd = mkstemp(tmpfile);
+  if (fd < 0) error(2, errno, "Creating a temporary file");
+  close(fd);
+
+  printf("#%11s %12s %11s %12s %10s %12s %s\n", "op", "input", "size",
+         "ns/pixel", "GB/s", "pixmem/pix", basename != NULL ? "vs baseline" : "");
+  int regressions = 0;
+  for (int s = 0; s < nsizes; s++) {
+    for (int k = 0; k < NUMINPUTS; k++) {
+      if (k == ADVERSARIAL && sizes[s] > ADVERSARIAL_MAXSIZE) continue;
+      Bench b = { NULL, NULL, NULL, NULL, 0, 0, tmpfile };
+      if (!makeInput(&b, k, sizes[s]))
+        error(2, errno, "Generating %s input: %s", inputs[k], ImageErrMsg());
+      int size = sizes[s];
+      b.work = ImageCrop(b.src, 0, 0, size, size);
+      if (b.work == NULL || !ImageSave(b.src, tmpfile))
+        error(2, errno, "Preparing %s input: %s", inputs[k], ImageErrMsg());
+
+      for (int o = 0; o < NUMOPS; o++) {
+        const BenchOp* op = &ops[o];
+        if (filter != NULL && strstr(op->name, filter) == NULL) continue;
+        if (k == ADVERSARIAL && op->sub != SUB_CORNER) continue;
+        // The adversarial input comes with its own sub image
+        Image sub = NULL;
+        if (k == ADVERSARIAL) {
+          // nothing to prepare
+        } else if (op->sub == SUB_HALF) {
+          b.subx = size / 4; b.suby = size / 4;
+          sub = ImageCrop(b.src, b.subx, b.suby, size / 2, size / 2);
+        } else if (op->sub == SUB_CORNER) {
+          int subsize = size < ADVERSARIAL_SUB ? size : ADVERSARIAL_SUB;
+          b.subx = size - subsize; b.suby = size - subsize;
+          sub = ImageCrop(b.src, b.subx, b.suby, subsize, subsize);
+        }
+        if (sub != NULL)
+          b.sub = sub;
+        else if (op->sub != SUB_NONE && k != ADVERSARIAL)
+          error(2, errno, "Preparing sub image: %s", ImageErrMsg());
+
+        Result r = benchCase(op, &b, inputs[k], warmup, reps);
+        printf("%12s %12s %5dx%-5d %12.3f %10.3f %12.3f", r.op, r.input,
+               r.width, r.height, r.nspp, r.gbps, r.pixmempp);
+        if (base != NULL) {
+          double old = baselineNspp(base, &r);
+          if (old > 0.0) {
+            double change = (r.nspp / old - 1.0) * 100.0;
+            int slower = change > threshold;
+            regressions += slower;
+            printf(" %+7.1f%%%s", change, slower ? "  REGRESSION" : "");
+          } else {
+            printf("     new");
+          }
+        }
+        putchar('\n');
+        fflush(stdout);
+        if (csv != NULL)
+          fprintf(csv, "%s,%s,%d,%d,%.4f,%.4f,%.4f\n", r.op, r.input,
+                  r.width, r.height, r.nspp, r.gbps, r.pixmempp);
+        if (sub != NULL) ImageDestroy(&sub);
+        if (k != ADVERSARIAL) b.sub = NULL;
+      }
+      // Compression ratio of tiled files, along with their timings
+      if (k != ADVERSARIAL && (filter == NULL || strstr("tiled", filter) != NULL)) {
+        long raw = ImageSave(b.src, tmpfile) ? fileSize(tmpfile) : -1;
+        long tiled = ImageSaveTiled(b.src, tmpfile) ? fileSize(tmpfile) : -1;
+        if (raw > 0 && tiled > 0)
+          printf("#%11s %12s %5dx%-5d %12.3f x smaller than raw PGM (%ld / %ld bytes)\n",
+                 "tiled", inputs[k], size, size, (double)raw / tiled, raw, tiled);
+      }
+      ImageDestroy(&b.work);
+      ImageDestroy(&b.src);
+      if (b.sub != NULL) ImageDestroy(&b.sub);
+    }
+  }
+  remove(tmpfile);
+  if (csv != NULL) fclose(csv);
+  if (base != NULL) {
+    fclose(base);
+    if (regressions > 0)
+      printf("# %d case(s) regressed by more than %.1f%%\n", regressions, threshold);
+  }
+  return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,538 @@
+// imageCheck - Self-checking tests for the image8bit module.
+//
+// Each test runs some image8bit operations on synthetic images and
+// compares the results with naive reference implementations, written for
+// clarity and not for speed.  They need no input files, so they run
+// without the test/ dir (make setup).
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "imageGen.h"
+#include "tileCodec.h"
+
+static const char* USAGE =
+    "USAGE: imageCheck [TEST...]\n"
+    "  Check image8bit operations against naive implementations.\n"
+    "  Runs all tests by default.\n"
+    "\n"
+    "TESTS:\n"
+    "  tiles     tile codec, tiled files and ImageLoadRegion\n"
+    "  rank      ImageRankFilter and ImageMedian\n"
+    "  morph     erode, dilate, open, close and morphological gradient\n"
+    "  label     ImageLabelComponents\n"
+    "  resize    ImageResize with all filters\n"
+    "  buffer    ImageSaveToBuffer and ImageLoadFromBuffer\n"
+    "\n"
+    "  Exit status is 1 if any check fails.\n"
+    ;
+
+// Number of failed checks
+static int failures = 0;
+
+// Report a failed check, unless cond holds.  Returns cond.
+static int expect(int cond, const char* what)
+{
+  if (!cond) {
+    failures++;
+    printf("  FAIL: %s\n", what);
+  }
+  return cond;
+}
+
+// Test inputs: synthetic images of several sizes and kinds, with sizes
+// that are not multiples of tiles, strides or vector widths.
+static const int sizes[][2] = {
+  { 1, 1 }, { 7, 3 }, { 64, 1 }, { 1, 50 }, { 45, 37 }, { 300, 21 }, { 257, 260 },
+};
+#define NSIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+// Kinds of input: 0 random, 1 gradient, 2 uniform, 3 random binary (0/255)
+#define NKINDS 4
+
+// A new image of size s and kind k (see above).
+static Image input(int s, int k)
+{
+  int w = sizes[s][0], h = sizes[s][1];
+  Image img;
+  switch (k) {
+  case 0: img = ImageGenRandom(w, h, 1000 + s); break;
+  case 1: img = ImageGenGradient(w, h); break;
+  case 2: img = ImageGenUniform(w, h, 77); break;
+  default:
+    img = ImageGenRandom(w, h, 2000 + s);
+    if (img != NULL) ImageThreshold(img, 200);  // sparse foreground
+  }
+  if (img == NULL) error(2, errno, "Creating a test image");
+  return img;
+}
+
+// Whether images a and b have the same size and pixels.
+static int sameImage(Image a, Image b)
+{
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b))
+    return 0;
+  for (int y = 0; y < ImageHeight(a); y++)
+    for (int x = 0; x < ImageWidth(a); x++)
+      if (ImageGetPixel(a, x, y) != ImageGetPixel(b, x, y))
+        return 0;
+  return 1;
+}
+
+// Tile codec
+
+static void checkTiles(void)
+{
+  char name[] = "/tmp/imageCheck.XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0) error(2, errno, "Creating a temporary file");
+  close(fd);
+
+  for (int s = 0; s < NSIZES; s++)
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      int w = ImageWidth(img), h = ImageHeight(img);
+
+      // The codec alone, with rows of the image as the source
+      uint8_t* pix = malloc((size_t)w * h);
+      uint8_t* out = malloc((size_t)w * h);
+      uint8_t* code = malloc(TileBound(w, h));
+      if (pix == NULL || out == NULL || code == NULL) error(2, ENOMEM, "tiles");
+      for (int y = 0; y < h; y++)
+        ImageGetRow(img, 0, y, w, pix + (size_t)y * w);
+      size_t n = TileEncode(pix, w, w, h, code);
+      expect(n >= 1 && n <= TileBound(w, h), "TileEncode size within TileBound");
+      expect(TileDecode(code, n, out, w, w, h) && memcmp(pix, out, (size_t)w * h) == 0,
+             "TileDecode restores the pixels");
+      expect(n < 2 || !TileDecode(code, n - 1, out, w, w, h), "TileDecode rejects a truncated tile");
+      free(pix);
+      free(out);
+      free(code);
+
+      // Tiled files, whole and by regions
+      if (!expect(ImageSaveTiled(img, name), "ImageSaveTiled")) {
+        ImageDestroy(&img);
+        continue;
+      }
+      Image back = ImageLoad(name);
+      expect(back != NULL && sameImage(back, img), "ImageLoad of a tiled file");
+      ImageDestroy(&back);
+      int regions[][4] = {
+        { 0, 0, w, h }, { w / 3, h / 4, w / 2, h / 2 }, { w - 1, h - 1, 1, 1 }, { w / 2, 0, 0, h },
+      };
+      for (int r = 0; r < 4; r++) {
+        int* g = regions[r];
+        Image part = ImageLoadRegion(name, g[0], g[1], g[2], g[3]);
+        Image ref = ImageCrop(img, g[0], g[1], g[2], g[3]);
+        expect(part != NULL && ref != NULL && sameImage(part, ref), "ImageLoadRegion of a tiled file");
+        ImageDestroy(&part);
+        ImageDestroy(&ref);
+      }
+      expect(ImageLoadRegion(name, 0, 0, w + 1, h) == NULL, "ImageLoadRegion rejects a region outside");
+      ImageDestroy(&img);
+    }
+  remove(name);
+}
+
+// Rank and median filters
+
+static int cmpLevel(const void* a, const void* b)
+{
+  return *(const uint8*)a - *(const uint8*)b;
+}
+
+// Naive rank filter: sort the levels of each window.
+static Image naiveRank(Image img, int dx, int dy, double q)
+{
+  int w = ImageWidth(img), h = ImageHeight(img);
+  Image res = ImageCreate(w, h, (uint8)ImageMaxval(img));
+  uint8* win = malloc((size_t)(2 * dx + 1) * (2 * dy + 1));
+  if (res == NULL || win == NULL) error(2, ENOMEM, "rank");
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      int n = 0;
+      for (int j = y - dy; j <= y + dy; j++)
+        for (int i = x - dx; i <= x + dx; i++)
+          if (ImageValidPos(img, i, j)) win[n++] = ImageGetPixel(img, i, j);
+      qsort(win, n, 1, cmpLevel);
+      ImageSetPixel(res, x, y, win[(int)(q * (n - 1))]);
+    }
+  free(win);
+  return res;
+}
+
+static void checkRank(void)
+{
+  static const int ds[][2] = { { 0, 0 }, { 1, 1 }, { 2, 0 }, { 0, 3 }, { 5, 2 }, { 40, 1 } };
+  static const double qs[] = { 0.0, 0.25, 0.5, 1.0 };
+  for (int s = 0; s < NSIZES; s++) {
+    if (sizes[s][0] * sizes[s][1] > 20000) continue;  // the naive filter is slow
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      for (int d = 0; d < 6; d++)
+        for (int qi = 0; qi < 4; qi++) {
+          Image ref = naiveRank(img, ds[d][0], ds[d][1], qs[qi]);
+          Image res = ImageClone(img);
+          if (res == NULL) error(2, errno, "rank");
+          int ok = qs[qi] == 0.5 ? ImageMedian(res, ds[d][0], ds[d][1])
+                                 : ImageRankFilter(res, ds[d][0], ds[d][1], qs[qi]);
+          expect(ok && sameImage(res, ref), qs[qi] == 0.5 ? "ImageMedian" : "ImageRankFilter");
+          ImageDestroy(&ref);
+          ImageDestroy(&res);
+        }
+      ImageDestroy(&img);
+    }
+  }
+}
+
+// Morphology
+
+// Naive erosion (max = 0) or dilation (max = 1) of img, in place.
+static void naiveMorph(Image img, int dx, int dy, int max)
+{
+  Image src = ImageClone(img);
+  if (src == NULL) error(2, errno, "morph");
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++) {
+      int v = max ? 0 : 255;
+      for (int j = y - dy; j <= y + dy; j++)
+        for (int i = x - dx; i <= x + dx; i++)
+          if (ImageValidPos(src, i, j)) {
+            int p = ImageGetPixel(src, i, j);
+            if (max ? p > v : p < v) v = p;
+          }
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  ImageDestroy(&src);
+}
+
+static void checkMorph(void)
+{
+  static const int ds[][2] = { { 0, 0 }, { 1, 1 }, { 3, 0 }, { 0, 2 }, { 4, 6 }, { 70, 1 } };
+  static const char* names[] = { "ImageErode", "ImageDilate", "ImageOpen", "ImageClose",
+                                 "ImageMorphGradient" };
+  for (int s = 0; s < NSIZES; s++) {
+    if (sizes[s][0] * sizes[s][1] > 20000) continue;  // the naive filters are slow
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      for (int d = 0; d < 6; d++) {
+        int dx = ds[d][0], dy = ds[d][1];
+        for (int op = 0; op < 5; op++) {
+          Image ref = ImageClone(img);
+          Image res = ImageClone(img);
+          if (ref == NULL || res == NULL) error(2, errno, "morph");
+          int ok = 0;
+          switch (op) {
+          case 0: naiveMorph(ref, dx, dy, 0); ok = ImageErode(res, dx, dy); break;
+          case 1: naiveMorph(ref, dx, dy, 1); ok = ImageDilate(res, dx, dy); break;
+          case 2:
+            naiveMorph(ref, dx, dy, 0);
+            naiveMorph(ref, dx, dy, 1);
+            ok = ImageOpen(res, dx, dy);
+            break;
+          case 3:
+            naiveMorph(ref, dx, dy, 1);
+            naiveMorph(ref, dx, dy, 0);
+            ok = ImageClose(res, dx, dy);
+            break;
+          default: {
+            Image lo = ImageClone(img);
+            if (lo == NULL) error(2, errno, "morph");
+            naiveMorph(lo, dx, dy, 0);
+            naiveMorph(ref, dx, dy, 1);
+            for (int y = 0; y < ImageHeight(ref); y++)
+              for (int x = 0; x < ImageWidth(ref); x++)
+                ImageSetPixel(ref, x, y, ImageGetPixel(ref, x, y) - ImageGetPixel(lo, x, y));
+            ImageDestroy(&lo);
+            ok = ImageMorphGradient(res, dx, dy);
+          }
+          }
+          expect(ok && sameImage(res, ref), names[op]);
+          ImageDestroy(&ref);
+          ImageDestroy(&res);
+        }
+      }
+      ImageDestroy(&img);
+    }
+  }
+}
+
+// Connected components
+
+// Naive labeling: a flood fill from each unlabelled foreground pixel, in
+// scan order, so components are numbered in the order of their first
+// pixel.  Fills labels and stats (with room for w*h+1 components) and
+// returns the number of components.
+static long naiveLabel(Image img, int connectivity, uint32_t* labels, ComponentStats* stats)
+{
+  int w = ImageWidth(img), h = ImageHeight(img);
+  size_t npix = (size_t)w * h;
+  int* stack = malloc(sizeof(int) * (npix + 1));
+  if (stack == NULL) error(2, ENOMEM, "label");
+  memset(labels, 0, sizeof(uint32_t) * npix);
+  stats[0] = (ComponentStats){ 0, 0, 0, w, h };
+  long n = 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      if (ImageGetPixel(img, x, y) == 0) {
+        stats[0].area++;
+        continue;
+      }
+      if (labels[(size_t)y * w + x] != 0) continue;
+      n++;
+      int x0 = x, x1 = x, y0 = y, y1 = y;
+      long area = 0;
+      int top = 0;
+      labels[(size_t)y * w + x] = (uint32_t)n;
+      stack[top++] = y * w + x;
+      while (top > 0) {
+        int p = stack[--top], px = p % w, py = p / w;
+        area++;
+        if (px < x0) x0 = px;
+        if (px > x1) x1 = px;
+        if (py < y0) y0 = py;
+        if (py > y1) y1 = py;
+        for (int j = py - 1; j <= py + 1; j++)
+          for (int i = px - 1; i <= px + 1; i++) {
+            if (connectivity == 4 && i != px && j != py) continue;
+            if (!ImageValidPos(img, i, j) || ImageGetPixel(img, i, j) == 0) continue;
+            if (labels[(size_t)j * w + i] != 0) continue;
+            labels[(size_t)j * w + i] = (uint32_t)n;
+            stack[top++] = j * w + i;
+          }
+      }
+      stats[n] = (ComponentStats){ area, x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+    }
+  free(stack);
+  return n;
+}
+
+static int sameStats(const ComponentStats* a, const ComponentStats* b)
+{
+  return a->area == b->area && a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+static void checkLabel(void)
+{
+  for (int s = 0; s < NSIZES; s++)
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      ImageThreshold(img, k == 3 ? 128 : 140);  // a binary image
+      size_t npix = (size_t)ImageWidth(img) * ImageHeight(img);
+      uint32_t* ref = malloc(sizeof(uint32_t) * npix);
+      ComponentStats* refStats = malloc(sizeof(ComponentStats) * (npix + 1));
+      if (ref == NULL || refStats == NULL) error(2, ENOMEM, "label");
+      for (int c = 4; c <= 8; c += 4) {
+        long nref = naiveLabel(img, c, ref, refStats);
+        uint32_t* labels;
+        ComponentStats* stats;
+        long n;
+        if (!expect(ImageLabelComponents(img, c, &labels, &stats, &n), "ImageLabelComponents"))
+          continue;
+        int ok = n == nref && memcmp(labels, ref, sizeof(uint32_t) * npix) == 0;
+        for (long l = 0; ok && l <= n; l++)
+          ok = sameStats(&stats[l], &refStats[l]);
+        expect(ok, c == 4 ? "ImageLabelComponents, 4-connected" : "ImageLabelComponents, 8-connected");
+        free(labels);
+        free(stats);
+      }
+      free(ref);
+      free(refStats);
+      ImageDestroy(&img);
+    }
+}
+
+// Resizing
+
+// Naive area resize: the mean of the source area under each pixel.
+static double naiveArea(Image img, int w, int h, int x, int y)
+{
+  double sx = (double)ImageWidth(img) / w, sy = (double)ImageHeight(img) / h;
+  double x0 = x * sx, x1 = (x + 1) * sx, y0 = y * sy, y1 = (y + 1) * sy;
+  double sum = 0.0;
+  for (int j = (int)y0; j < ImageHeight(img) && j < y1; j++)
+    for (int i = (int)x0; i < ImageWidth(img) && i < x1; i++) {
+      double cx = fmin(i + 1, x1) - fmax(i, x0), cy = fmin(j + 1, y1) - fmax(j, y0);
+      if (cx > 0.0 && cy > 0.0) sum += cx * cy * ImageGetPixel(img, i, j);
+    }
+  return sum / (sx * sy);
+}
+
+// Naive bilinear resize, with the centers of pixels aligned.
+static double naiveBilinear(Image img, int w, int h, int x, int y)
+{
+  int sw = ImageWidth(img), sh = ImageHeight(img);
+  double cx = (x + 0.5) * sw / w - 0.5, cy = (y + 0.5) * sh / h - 0.5;
+  cx = fmax(0.0, fmin(sw - 1, cx));
+  cy = fmax(0.0, fmin(sh - 1, cy));
+  int i = (int)cx, j = (int)cy;
+  int i1 = i + 1 < sw ? i + 1 : i, j1 = j + 1 < sh ? j + 1 : j;
+  double fx = cx - i, fy = cy - j;
+  return (1 - fy) * ((1 - fx) * ImageGetPixel(img, i, j) + fx * ImageGetPixel(img, i1, j))
+         + fy * ((1 - fx) * ImageGetPixel(img, i, j1) + fx * ImageGetPixel(img, i1, j1));
+}
+
+// Naive box resize (integer factors): the mean of each block, rounded.
+static int naiveBox(Image img, int w, int h, int x, int y)
+{
+  int fx = ImageWidth(img) / w, fy = ImageHeight(img) / h, n = fx * fy;
+  int sum = 0;
+  for (int j = y * fy; j < (y + 1) * fy; j++)
+    for (int i = x * fx; i < (x + 1) * fx; i++)
+      sum += ImageGetPixel(img, i, j);
+  return (2 * sum + n) / (2 * n);
+}
+
+// Check ImageResize of img to w x h with filter.
+// Weights have 14 fractional bits, so results may be 1 level away from
+// the exact means, except on the fast path of integer factors.
+static void checkResizeTo(Image img, int w, int h, ResizeFilter filter)
+{
+  Image res = ImageResize(img, w, h, filter);
+  if (!expect(res != NULL && ImageWidth(res) == w && ImageHeight(res) == h, "ImageResize"))
+    return;
+  int box = ImageWidth(img) % w == 0 && ImageHeight(img) % h == 0 && filter != RESIZE_BILINEAR;
+  int ok = 1;
+  for (int y = 0; ok && y < h; y++)
+    for (int x = 0; ok && x < w; x++) {
+      int v = ImageGetPixel(res, x, y);
+      if (box)
+        ok = v == naiveBox(img, w, h, x, y);
+      else
+        ok = fabs(v - (filter == RESIZE_BILINEAR ? naiveBilinear(img, w, h, x, y)
+                                                 : naiveArea(img, w, h, x, y))) < 1.0;
+    }
+  static const char* names[] = { "ImageResize, box", "ImageResize, area", "ImageResize, bilinear" };
+  expect(ok, names[filter]);
+  ImageDestroy(&res);
+}
+
+static void checkResize(void)
+{
+  for (int s = 0; s < NSIZES; s++)
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      int w = ImageWidth(img), h = ImageHeight(img);
+      // shrink by integer factors, by other factors, and enlarge
+      for (int f = 1; f <= 3; f++)
+        if (w % f == 0 && h % f == 0)
+          for (ResizeFilter filter = RESIZE_BOX; filter <= RESIZE_AREA; filter++)
+            checkResizeTo(img, w / f, h / f, filter);
+      checkResizeTo(img, (w + 2) / 3, (2 * h + 4) / 5, RESIZE_AREA);
+      checkResizeTo(img, 2 * w + 1, 3 * h, RESIZE_AREA);
+      checkResizeTo(img, 2 * w + 1, 3 * h, RESIZE_BILINEAR);
+      checkResizeTo(img, (w + 1) / 2, h + 3, RESIZE_BILINEAR);
+      ImageDestroy(&img);
+    }
+
+  // Many source pixels per output pixel, each with a tiny weight: their
+  // rounded weights must still add up exactly.
+  Image img = ImageCreate(40000, 2, PixMax);
+  if (img == NULL) error(2, errno, "resize");
+  for (int y = 0; y < 2; y++)
+    for (int x = 0; x < 40000; x++)
+      ImageSetPixel(img, x, y, (uint8)(x * 256L / 40000));
+  checkResizeTo(img, 97, 1, RESIZE_AREA);
+  ImageDestroy(&img);
+}
+
+// In-memory files
+
+static void checkBuffer(void)
+{
+  char name[] = "/tmp/imageCheck.XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0) error(2, errno, "Creating a temporary file");
+  close(fd);
+
+  for (int s = 0; s < NSIZES; s++)
+    for (int k = 0; k < NKINDS; k++) {
+      Image img = input(s, k);
+      void* buf;
+      size_t len;
+      if (!expect(ImageSaveToBuffer(img, &buf, &len), "ImageSaveToBuffer")) {
+        ImageDestroy(&img);
+        continue;
+      }
+
+      // The same bytes as ImageSave
+      expect(ImageSave(img, name), "ImageSave");
+      FILE* f = fopen(name, "rb");
+      if (f == NULL) error(2, errno, "Opening %s", name);
+      char* file = malloc(len + 1);
+      if (file == NULL) error(2, ENOMEM, "buffer");
+      expect(fread(file, 1, len + 1, f) == len && memcmp(file, buf, len) == 0,
+             "ImageSaveToBuffer writes the bytes of ImageSave");
+      fclose(f);
+      free(file);
+
+      Image back = ImageLoadFromBuffer(buf, len);
+      expect(back != NULL && sameImage(back, img), "ImageLoadFromBuffer of a raw PGM");
+      ImageDestroy(&back);
+      expect(ImageLoadFromBuffer(buf, len - 1) == NULL, "ImageLoadFromBuffer rejects a truncated PGM");
+      free(buf);
+
+      // Plain PGM, read back from the bytes of ImageSavePlain
+      expect(ImageSavePlain(img, name), "ImageSavePlain");
+      f = fopen(name, "rb");
+      if (f == NULL) error(2, errno, "Opening %s", name);
+      fseek(f, 0, SEEK_END);
+      long size = ftell(f);
+      rewind(f);
+      char* plain = malloc(size);
+      if (plain == NULL) error(2, ENOMEM, "buffer");
+      if (fread(plain, 1, size, f) != (size_t)size) error(2, errno, "Reading %s", name);
+      fclose(f);
+      back = ImageLoadFromBuffer(plain, size);
+      expect(back != NULL && sameImage(back, img), "ImageLoadFromBuffer of a plain PGM");
+      ImageDestroy(&back);
+      free(plain);
+      ImageDestroy(&img);
+    }
+  remove(name);
+}
+
+// Tests, by name
+static const struct {
+  const char* name;
+  void (*run)(void);
+} tests[] = {
+  { "tiles", checkTiles },
+  { "rank", checkRank },
+  { "morph", checkMorph },
+  { "label", checkLabel },
+  { "resize", checkResize },
+  { "buffer", checkBuffer },
+};
+#define NTESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+int main(int argc, char* argv[])
+{
+  program_name = argv[0];
+  for (int k = 1; k < argc; k++) {
+    int t = 0;
+    while (t < NTESTS && strcmp(argv[k], tests[t].name) != 0) t++;
+    if (t == NTESTS) error(1, 0, "Unknown test: %s\n%s", argv[k], USAGE);
+  }
+
+  ImageInit();
+
+  for (int t = 0; t < NTESTS; t++) {
+    int k = 1;
+    while (k < argc && strcmp(argv[k], tests[t].name) != 0) k++;
+    if (argc > 1 && k == argc) continue;
+    int before = failures;
+    printf("# %s\n", tests[t].name);
+    tests[t].run();
+    printf("%s %s\n", failures == before ? "ok" : "FAILED", tests[t].name);
+  }
+  return failures > 0;
+}
@@ -0,0 +1,89 @@
+/// imageGen - Synthetic image generators.
+///
+/// Deterministic test inputs for benchmarks and profiling tools
+/// that use the image8bit module.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "imageGen.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+// Small, fast and portable PRNG (xorshift32), so that generated images
+// do not depend on the C library rand() implementation.
+static unsigned xorshift32(unsigned* state)
+{
+  unsigned x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+Image ImageGenRandom(int width, int height, unsigned seed)
+{ ///
+  Image img = ImageCreate(width, height, PixMax);
+  if (img == NULL)
+    return NULL;
+  unsigned state = seed != 0 ? seed : 1; // xorshift state must be nonzero
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      ImageSetPixel(img, x, y, (uint8)(xorshift32(&state) % (PixMax + 1u)));
+  return img;
+}
+
+Image ImageGenUniform(int width, int height, uint8 level)
+{ ///
+  assert(level <= PixMax);
+  Image img = ImageCreate(width, height, PixMax);
+  if (img == NULL)
+    return NULL;
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      ImageSetPixel(img, x, y, level);
+  return img;
+}
+
+Image ImageGenGradient(int width, int height)
+{ ///
+  Image img = ImageCreate(width, height, PixMax);
+  if (img == NULL)
+    return NULL;
+  long span = (long)width + height - 2;
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      ImageSetPixel(img, x, y, span > 0 ? (uint8)((x + y) * (long)PixMax / span) : 0);
+  return img;
+}
+
+int ImageGenLocateWorst(int width, int height, int subw, int subh,
+                        Image* pimg, Image* psub)
+{ ///
+  assert(0 < subw && subw <= width);
+  assert(0 < subh && subh <= height);
+  *pimg = ImageGenUniform(width, height, 0);
+  *psub = ImageGenUniform(subw, subh, 0);
+  if (*pimg == NULL || *psub == NULL) {
+    if (*pimg != NULL) ImageDestroy(pimg);
+    if (*psub != NULL) ImageDestroy(psub);
+    return 0;
+  }
+  ImageSetPixel(*psub, subw - 1, subh - 1, 1);
+  return 1;
+}
+
+int ImageGenLocateBest(int width, int height, int subw, int subh,
+                       Image* pimg, Image* psub)
+{ ///
+  assert(0 < subw && subw <= width);
+  assert(0 < subh && subh <= height);
+  *pimg = ImageGenRandom(width, height, 4321);
+  *psub = NULL;
+  if (*pimg == NULL || (*psub = ImageCrop(*pimg, 0, 0, subw, subh)) == NULL) {
+    if (*pimg != NULL) ImageDestroy(pimg);
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,46 @@
+/// imageGen - Synthetic image generators.
+///
+/// Deterministic test inputs for benchmarks and profiling tools
+/// that use the image8bit module.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef IMAGEGEN_H
+#define IMAGEGEN_H
+
+#include "image8bit.h"
+
+/// All generators create a new image with maxval PixMax.
+/// Success and failure are treated as in ImageCreate:
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+/// Pseudo-random pixels, uniformly distributed in [0, PixMax].
+/// The same seed always produces the same image.
+Image ImageGenRandom(int width, int height, unsigned seed) ;
+
+/// All pixels set to level.
+Image ImageGenUniform(int width, int height, uint8 level) ;
+
+/// Diagonal gradient: level grows with x+y, from 0 to PixMax.
+Image ImageGenGradient(int width, int height) ;
+
+/// Worst case input for ImageLocateSubImage.
+/// Creates a uniform (*pimg) with the given size and a (*psub) with size
+/// subw x subh that is also uniform, except for its last pixel.
+/// Every candidate position matches all but the last pixel of (*psub),
+/// so a search must compare the whole subimage everywhere and fails.
+/// Returns 1 on success, 0 on failure (and nothing is left allocated).
+int ImageGenLocateWorst(int width, int height, int subw, int subh,
+                        Image* pimg, Image* psub) ;
+
+/// Best case input for ImageLocateSubImage.
+/// Creates a pseudo-random (*pimg) with the given size and a (*psub) with
+/// size subw x subh that is a copy of its top left corner, so a search
+/// finds it at the first candidate position.
+/// Returns 1 on success, 0 on failure (and nothing is left allocated).
+int ImageGenLocateBest(int width, int height, int subw, int subh,
+                       Image* pimg, Image* psub) ;
+
+#endif
@@ -0,0 +1,342 @@
+// imageProfile - Empirical complexity profiler for image8bit operations.
+//
+// This program runs one image8bit operation over a sweep of input sizes or
+// parameters, collects the instrumentation counters (pixmem) and the time
+// of each run, and fits the measurements to candidate complexity classes.
+// Operations whose measured growth exceeds the expected class are flagged.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "image8bit.h"
+#include "imageGen.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageProfile OPERATION [OPTION...]\n"
+    "  Sweep an input size or parameter of an image8bit OPERATION,\n"
+    "  and fit pixmem counts and times to complexity classes.\n"
+    "\n"
+    "OPERATIONS:\n"
+    "  stats neg thr bri rotate mirror crop paste blend match locate blur\n"
+    "  median erode\n"
+    "\n"
+    "OPTIONS:\n"
+    "  -x VAR          Swept variable (default size):\n"
+    "                    size    image side (n = image pixels, or candidate\n"
+    "                            positions for operations with a subimage)\n"
+    "                    sub     subimage side, for paste/blend/match/locate\n"
+    "                            (n = subimage pixels)\n"
+    "                    radius  blur/median/erode dx=dy (n = (2dx+1)*(2dy+1))\n"
+    "  -v N,N,...      Values of the swept variable\n"
+    "  -S SIDE         Fixed image side when not sweeping size (default 256)\n"
+    "  -k SIDE         Fixed subimage side / blur radius otherwise (default 8 / 3)\n"
+    "  -i INPUT        random, uniform, gradient, or for locate: best, worst\n"
+    "                  (default random; locate defaults to worst)\n"
+    "  -r REPS         Repetitions per point (median time), default 3\n"
+    "  -e CLASS        Expected class (overrides the built-in expectation):\n"
+    "                  1 logn n nlogn n^1.5 n^2 n^3\n"
+    "\n"
+    "  Exit status is 1 if the measured growth exceeds the expected class.\n"
+    ;
+
+// Wall-clock time in seconds
+static double wallTime(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Candidate complexity classes, in increasing order of growth
+typedef struct {
+  const char* name;
+  double (*f)(double n);
+} Class;
+
+static double fConst(double n) { return 1.0; }
+static double fLog(double n) { return log2(n + 1.0); }  // nonzero at n=1
+static double fLin(double n) { return n; }
+static double fNLogN(double n) { return n * log2(n + 1.0); }
+static double fN15(double n) { return n * sqrt(n); }
+static double fN2(double n) { return n * n; }
+static double fN3(double n) { return n * n * n; }
+
+static const Class classes[] = {
+  { "1", fConst }, { "logn", fLog }, { "n", fLin }, { "nlogn", fNLogN },
+  { "n^1.5", fN15 }, { "n^2", fN2 }, { "n^3", fN3 },
+};
+#define NUMCLASSES (int)(sizeof(classes) / sizeof(classes[0]))
+
+static int findClass(const char* name)
+{
+  for (int c = 0; c < NUMCLASSES; c++)
+    if (strcmp(classes[c].name, name) == 0) return c;
+  return -1;
+}
+
+// Swept variables
+enum { VAR_SIZE, VAR_SUB, VAR_RADIUS };
+static const char* varNames[] = { "size", "sub", "radius" };
+
+// Profiled operations.
+// Inputs are regenerated for each run, so operations may modify them.
+typedef struct {
+  const char* name;
+  int vars;             // bit set of (1 << VAR_*) allowed
+  const char* expected[3];  // expected class per VAR_*
+} ProfOp;
+
+static const ProfOp ops[] = {
+  { "stats",  1 << VAR_SIZE, { "n" } },
+  { "neg",    1 << VAR_SIZE, { "n" } },
+  { "thr",    1 << VAR_SIZE, { "n" } },
+  { "bri",    1 << VAR_SIZE, { "n" } },
+  { "rotate", 1 << VAR_SIZE, { "n" } },
+  { "mirror", 1 << VAR_SIZE, { "n" } },
+  { "crop",   1 << VAR_SIZE, { "n" } },
+  { "paste",  1 << VAR_SIZE | 1 << VAR_SUB, { "1", "n" } },
+  { "blend",  1 << VAR_SIZE | 1 << VAR_SUB, { "1", "n" } },
+  { "match",  1 << VAR_SIZE | 1 << VAR_SUB, { "1", "n" } },
+  { "locate", 1 << VAR_SIZE | 1 << VAR_SUB, { "n", "n" } },
+  { "blur",   1 << VAR_SIZE | 1 << VAR_RADIUS, { "n", NULL, "1" } },
+  { "median", 1 << VAR_SIZE | 1 << VAR_RADIUS, { "n", NULL, "1" } },
+  { "erode",  1 << VAR_SIZE | 1 << VAR_RADIUS, { "n", NULL, "1" } },
+};
+#define NUMOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// Run operation name on img (and sub, and parameter k).
+// Returns an image to destroy, or NULL.
+static Image runOp(const char* name, Image img, Image sub, int k)
+{
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int x, y;
+  if (strcmp(name, "stats") == 0) { uint8 min, max; ImageStats(img, &min, &max); }
+  else if (strcmp(name, "neg") == 0) ImageNegative(img);
+  else if (strcmp(name, "thr") == 0) ImageThreshold(img, 128);
+  else if (strcmp(name, "bri") == 0) ImageBrighten(img, 1.3);
+  else if (strcmp(name, "rotate") == 0) return ImageRotate(img);
+  else if (strcmp(name, "mirror") == 0) return ImageMirror(img);
+  else if (strcmp(name, "crop") == 0) return ImageCrop(img, w / 4, h / 4, w / 2, h / 2);
+  else if (strcmp(name, "paste") == 0) ImagePaste(img, 0, 0, sub);
+  else if (strcmp(name, "blend") == 0) ImageBlend(img, 0, 0, sub, 0.33);
+  else if (strcmp(name, "match") == 0) ImageMatchSubImage(img, 0, 0, sub);
+  else if (strcmp(name, "locate") == 0) ImageLocateSubImage(img, &x, &y, sub);
+  else if (strcmp(name, "blur") == 0) ImageBlur(img, k, k);
+  else if (strcmp(name, "median") == 0) ImageMedian(img, k, k);
+  else if (strcmp(name, "erode") == 0) ImageErode(img, k, k);
+  return NULL;
+}
+
+// Generate the inputs for one point.  sub is only created if subside > 0.
+static int makeInputs(const char* input, int side, int subside, Image* pimg, Image* psub)
+{
+  *psub = NULL;
+  if (strcmp(input, "best") == 0)
+    return ImageGenLocateBest(side, side, subside, subside, pimg, psub);
+  if (strcmp(input, "worst") == 0)
+    return ImageGenLocateWorst(side, side, subside, subside, pimg, psub);
+  if (strcmp(input, "uniform") == 0) *pimg = ImageGenUniform(side, side, 128);
+  else if (strcmp(input, "gradient") == 0) *pimg = ImageGenGradient(side, side);
+  else *pimg = ImageGenRandom(side, side, 12345);
+  if (*pimg == NULL) return 0;
+  if (subside > 0) {
+    // A copy of the bottom right corner: located only at the last position
+    *psub = ImageCrop(*pimg, side - subside, side - subside, subside, subside);
+    if (*psub == NULL) { ImageDestroy(pimg); return 0; }
+  }
+  return 1;
+}
+
+static int cmpDouble(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Fit y ~ c*f(n) in log space, for each class.
+// Returns the index of the best class and sets (*slope) to the log-log slope.
+// The residual of each class is stored in res[].
+static int fit(int m, const double* n, const double* y, double* res, double* slope)
+{
+  int best = 0;
+  for (int c = 0; c < NUMCLASSES; c++) {
+    // log y = log c + log f(n) + e: the best log c is the mean of the
+    // differences, and the residual is their variance.
+    double mean = 0.0, var = 0.0;
+    for (int i = 0; i < m; i++)
+      mean += log(y[i]) - log(classes[c].f(n[i]));
+    mean /= m;
+    for (int i = 0; i < m; i++) {
+      double d = log(y[i]) - log(classes[c].f(n[i])) - mean;
+      var += d * d;
+    }
+    res[c] = var / m;
+    if (res[c] < res[best]) best = c;
+  }
+  // Least-squares slope of log y over log n
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < m; i++) {
+    double lx = log(n[i]), ly = log(y[i]);
+    sx += lx; sy += ly; sxx += lx * lx; sxy += lx * ly;
+  }
+  double den = m * sxx - sx * sx;
+  *slope = den != 0.0 ? (m * sxy - sx * sy) / den : 0.0;
+  return best;
+}
+
+// Report the fit of one metric.
+// Returns 1 if it exceeds the expected class, 0 if not, -1 if not measured.
+static int report(const char* metric, int m, const double* n, const double* y, int expected)
+{
+  for (int i = 0; i < m; i++) {
+    if (!(y[i] > 0.0)) {
+      printf("# %s: not measured (zero values)\n", metric);
+      return -1;
+    }
+  }
+  double res[NUMCLASSES];
+  double slope;
+  int best = fit(m, n, y, res, &slope);
+  printf("# %s: best fit O(%s), log-log slope %.2f, residuals:", metric,
+         classes[best].name, slope);
+  for (int c = 0; c < NUMCLASSES; c++)
+    printf(" %s=%.3g", classes[c].name, res[c]);
+  putchar('\n');
+  if (best > expected) {
+    printf("# %s: EXCEEDS expected O(%s)\n", metric, classes[expected].name);
+    return 1;
+  }
+  return 0;
+}
+
+// Parse a comma-separated list of positive ints.  Returns the count.
+static int parseList(const char* s, int* v, int max)
+{
+  int cnt = 0, len;
+  while (cnt < max && sscanf(s, "%d%n", &v[cnt], &len) == 1 && v[cnt] > 0) {
+    cnt++;
+    s += len;
+    if (*s != ',') break;
+    s++;
+  }
+  return cnt;
+}
+
+#define MAXPOINTS 32
+
+int main(int argc, char* argv[])
+{
+  program_name = argv[0];
+  if (argc < 2) error(1, 0, "\n%s", USAGE);
+
+  const ProfOp* op = NULL;
+  for (int o = 0; o < NUMOPS; o++)
+    if (strcmp(argv[1], ops[o].name) == 0) op = &ops[o];
+  if (op == NULL) error(1, 0, "Unknown operation %s\n%s", argv[1], USAGE);
+
+  int var = VAR_SIZE;
+  int values[MAXPOINTS];
+  int m = 0;
+  int side = 256;
+  int fixed = -1;
+  int reps = 3;
+  const char* input = strcmp(op->name, "locate") == 0 ? "worst" : "random";
+  const char* expectedName = NULL;
+
+  for (int k = 2; k < argc; k++) {
+    if (k + 1 >= argc || argv[k][0] != '-' || strlen(argv[k]) != 2)
+      error(1, 0, "\n%s", USAGE);
+    const char* arg = argv[++k];
+    switch (argv[k - 1][1]) {
+    case 'x':
+      for (var = 0; var < 3 && strcmp(arg, varNames[var]) != 0; var++) {}
+      if (var == 3) error(1, 0, "Unknown variable %s", arg);
+      break;
+    case 'v': if ((m = parseList(arg, values, MAXPOINTS)) < 2) error(1, 0, "Need 2 or more values"); break;
+    case 'S': if (sscanf(arg, "%d", &side) != 1 || side < 1) error(1, 0, "Invalid side"); break;
+    case 'k': if (sscanf(arg, "%d", &fixed) != 1 || fixed < 0) error(1, 0, "Invalid value"); break;
+    case 'i': input = arg; break;
+    case 'r': if (sscanf(arg, "%d", &reps) != 1 || reps < 1) error(1, 0, "Invalid reps"); break;
+    case 'e': expectedName = arg; break;
+    default: error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (!(op->vars & (1 << var)))
+    error(1, 0, "Cannot sweep %s for %s", varNames[var], op->name);
+  if (m == 0) {
+    static const int defaults[3][5] = {
+      { 64, 128, 256, 512, 1024 }, { 2, 4, 8, 16, 32 }, { 1, 2, 4, 8, 16 },
+    };
+    m = 5;
+    memcpy(values, defaults[var], sizeof(defaults[var]));
+  }
+  int usesSub = op->vars & (1 << VAR_SUB);
+  int locateInput = strcmp(input, "best") == 0 || strcmp(input, "worst") == 0;
+  if (!locateInput && strcmp(input, "random") != 0 && strcmp(input, "uniform") != 0 &&
+      strcmp(input, "gradient") != 0)
+    error(1, 0, "Unknown input %s\n%s", input, USAGE);
+  if (locateInput && strcmp(op->name, "locate") != 0)
+    error(1, 0, "Input %s is only for locate\n%s", input, USAGE);
+  if (fixed < 0) fixed = var == VAR_SIZE && !usesSub ? 3 : 8;
+  if (var == VAR_SIZE && usesSub)
+    for (int i = 0; i < m; i++)
+      if (values[i] < fixed) error(1, 0, "Image side %d smaller than subimage", values[i]);
+
+  if (expectedName == NULL) expectedName = op->expected[var];
+  int expected = findClass(expectedName);
+  if (expected < 0) error(1, 0, "Unknown class %s", expectedName);
+
+  ImageInit();
+
+  printf("# %s: sweeping %s, input %s, expected O(%s)\n", op->name,
+         varNames[var], input, expectedName);
+  printf("#%11s %12s %15s %12s\n", varNames[var], "n", "pixmem", "time");
+  double n[MAXPOINTS], pixmem[MAXPOINTS], times[MAXPOINTS];
+  double* t = malloc(sizeof(double) * reps);
+  if (t == NULL) error(2, errno, "Allocating times");
+  for (int i = 0; i < m; i++) {
+    int v = values[i];
+    int imgside = var == VAR_SIZE ? v : side;
+    int subside = !usesSub ? 0 : var == VAR_SUB ? v : fixed;
+    int radius = var == VAR_RADIUS ? v : fixed;
+    if (subside > imgside) error(1, 0, "Subimage side %d larger than image", subside);
+    n[i] = var == VAR_SUB ? (double)v * v
+         : var == VAR_RADIUS ? (double)(2 * v + 1) * (2 * v + 1)
+         : usesSub ? (double)(v - subside + 1) * (v - subside + 1)
+         : (double)v * v;
+    for (int r = 0; r < reps; r++) {
+      Image img, sub;
+      if (!makeInputs(input, imgside, subside, &img, &sub))
+        error(2, errno, "Generating input: %s", ImageErrMsg());
+      InstrReset();
+      double t0 = wallTime();
+      Image out = runOp(op->name, img, sub, radius);
+      t[r] = wallTime() - t0;
+      pixmem[i] = (double)InstrCount[INSTR_PIXMEM];
+      if (out != NULL) ImageDestroy(&out);
+      if (sub != NULL) ImageDestroy(&sub);
+      ImageDestroy(&img);
+    }
+    qsort(t, reps, sizeof(double), cmpDouble);
+    times[i] = t[reps / 2];
+    printf("%12d %12.0f %15.0f %12.6f\n", v, n[i], pixmem[i], times[i]);
+    fflush(stdout);
+  }
+  free(t);
+
+  // Counts are exact, so they decide; times are noisy, and only used for
+  // operations that do not count pixel accesses.
+  int exceeds = report("pixmem", m, n, pixmem, expected);
+  int texceeds = report("time", m, n, times, expected);
+  if (exceeds < 0) exceeds = texceeds;
+  return exceeds > 0;
+}
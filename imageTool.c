@@ -11,16 +11,33 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "image8bit.h"
+#include "image1bit.h"
+#include "image16bit.h"
 #include "instrumentation.h"
+#include "pixelPool.h"
+#include "resultCache.h"
+#include "trace.h"
 
 static const char* USAGE =
-    "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "USAGE: imageTool [--trace TRACEFILE] [--async] [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool [--trace TRACEFILE] --server [SERVEROPTION...]\n"
+    "       imageTool [--trace TRACEFILE] --batch BATCHOPTION... [--] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,34 +46,145 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The whole pipeline is planned before running: images are released as\n"
+    "  soon as no later operation uses them, and their memory is recycled.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files may be 8-bit PGM files (raw or plain) or tiled files\n"
+    "  (see savetiled).\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
-    "  FILE            Load PGM image file, creating new image\n"
+    "  FILE            Load PGM image file (raw or plain), creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "  saveplain FILE  Save CURR to plain (ASCII) PGM file\n"
+    "  load16 FILE     Load PGM image file with up to 16 bits per pixel\n"
+    "                  (maxval up to 65535), with levels scaled to 0..255\n"
+    "  savetiled FILE  Save CURR to tiled file: compressed tiles, loaded in\n"
+    "                  parallel, as any other FILE, or partially by region\n"
+    "  region X,Y,W,H FILE\n"
+    "                  Load a rectangle from image FILE, creating new image.\n"
+    "                  From a tiled file, only the tiles in the rectangle\n"
+    "                  are read\n"
+    "  frame N FILE    Load frame N (from 0) of PGM stream FILE (several PGM\n"
+    "                  images one after the other), creating new image\n"
+    "  savepbm FILE    Save CURR to bit-packed PBM file: levels from maxval/2\n"
+    "                  up are white, lower levels are black (use after thr)\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "                  On Linux, hardware counters (cycles, cache misses...)\n"
+    "                  are also shown, if the kernel allows it (INSTR_PERF=0\n"
+    "                  disables them).\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  sparse W,H      Create new sparse black image with WxH pixels: memory\n"
+    "                  is only used by the parts written to.  Sparse images\n"
+    "                  may only be used by info, crop, save, store, and as\n"
+    "                  CURR of paste and blend\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,FILTER]\n"
+    "                  Resize CURR to WxH, creating new image.  FILTER is area\n"
+    "                  (mean of the pixels under each pixel, the default), box\n"
+    "                  (mean of blocks, for sizes that divide CURR's: faster)\n"
+    "                  or bilinear (interpolation, for enlarging)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  composite X,Y[,alpha]/X,Y[,alpha]/...\n"
+    "                  Paste (or blend, if alpha is given) the K images before\n"
+    "                  CURR into CURR, at the K given positions, in order.\n"
+    "                  Same result as K pastes/blends, but done in parallel\n"
+    "                  over tiles of CURR\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  bitlocate       Same as locate, on binary versions of PRED and CURR\n"
+    "                  (split at maxval/2, as savepbm): much faster\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    Apply (2DX+1)x(2DY+1) median filter to CURR (removes\n"
+    "                  salt and pepper noise), in constant time per pixel\n"
+    "  rank DX,DY,P    Same, with the P-th percentile (0 is the minimum, 50\n"
+    "                  the median, 100 the maximum) instead of the median\n"
+    "  erode DX,DY     Erode CURR: minimum over a (2DX+1)x(2DY+1) rectangle\n"
+    "  dilate DX,DY    Dilate CURR: maximum over the rectangle\n"
+    "  open DX,DY      Erode and then dilate CURR (removes bright specks)\n"
+    "  close DX,DY     Dilate and then erode CURR (fills dark holes)\n"
+    "  gradient DX,DY  Replace CURR with its dilation minus its erosion\n"
+    "                  (morphology takes the same time for any DX,DY)\n"
+    "  label CONN      Label the connected components of the nonzero pixels\n"
+    "                  of CURR (after thr), with connectivity CONN (4 or 8),\n"
+    "                  print their count and the 10 largest (area, box)\n"
     "\n"              
+    "OPTIONS:\n"
+    "  --trace TRACEFILE  Record one span per operation, with times, image\n"
+    "                  sizes, bytes touched and counter deltas, and write them\n"
+    "                  to TRACEFILE in Chrome trace-event JSON format\n"
+    "                  (view with https://ui.perfetto.dev).\n"
+    "  --async         Save in the background: each save overlaps with the\n"
+    "                  next operations, and replaces its file only when\n"
+    "                  complete (never leaving a partial file).  Later\n"
+    "                  operations on the same file wait for the save.\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  Run as a long-lived process that reads jobs, one per line, from stdin\n"
+    "  or from clients of a Unix socket.  Each job is a pipeline with the same\n"
+    "  syntax as the command line.  Jobs run concurrently, so they should not\n"
+    "  depend on each other (use --workers 1 otherwise).\n"
+    "  Each job is answered with its output, followed by a line with\n"
+    "  \"OK JOB\" or \"ERROR JOB MESSAGE\", where JOB is its line number.\n"
+    "  Loaded files are cached, and reloaded only if they change.\n"
+    "  Additional operations:\n"
+    "  store NAME      Store a copy of CURR in the named slot NAME\n"
+    "  @NAME           Copy the image in slot NAME, creating new image\n"
+    "  drop NAME       Remove slot NAME\n"
+    "  Named slots persist across jobs, until dropped.\n"
+    "\n"
+    "SERVER OPTIONS:\n"
+    "  --socket PATH   Listen on Unix socket PATH instead of reading stdin\n"
+    "  --workers N     Number of worker threads (default: number of CPUs)\n"
+    "  --cache N       Cache up to N loaded files (default 64, 0 disables)\n"
+    "\n"
+    "BATCH MODE:\n"
+    "  Apply the pipeline to every file of a list or directory, with each\n"
+    "  file loaded as I0, and save the resulting CURR with the same name in\n"
+    "  the output directory.  Files go through three stages, connected by\n"
+    "  bounded queues: reader threads load the next files while workers run\n"
+    "  the pipeline and writer threads save the results.  Output of each\n"
+    "  file (from info, locate...) follows a \"# File: FILE\" line, errors\n"
+    "  are reported on stderr, and files/s and the utilisation of each stage\n"
+    "  (time working, not waiting, per thread) are reported at the end.\n"
+    "  With --frames, the frames of a PGM stream are processed instead, and\n"
+    "  their output (after \"# Frame: N\" lines) and results are in order.\n"
+    "\n"
+    "BATCH OPTIONS:\n"
+    "  --list FILE     Input files, one per line (- for stdin)\n"
+    "  --dir DIR       Input files: all regular files in DIR\n"
+    "  --frames FILE   Input frames: the images of PGM stream FILE (with one\n"
+    "                  reader and one writer)\n"
+    "  --out DIR       Save results to DIR (default: do not save).  With\n"
+    "                  --frames, write them to PGM stream DIR instead\n"
+    "  --readers N     Number of reader threads (default 2)\n"
+    "  --workers N     Number of worker threads (default: number of CPUs)\n"
+    "  --writers N     Number of writer threads (default 2)\n"
+    "  --queue N       Capacity of each queue (default: twice the workers)\n"
+    "  --result-cache DIR\n"
+    "                  Keep the results (CURR and output) of each input in\n"
+    "                  DIR, by content hash of the input and pipeline, and\n"
+    "                  reuse them for identical inputs, in this run or later\n"
+    "                  ones.  Pipelines with files, tic or toc are not cached.\n"
+    "                  Only batch mode uses the cache: a single run, whose\n"
+    "                  pipeline names its input file, is always computed\n"
+    "  --result-cache-size MB\n"
+    "                  Size bound of DIR: least recently used results are\n"
+    "                  removed beyond it (default 1024)\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
@@ -69,13 +197,398 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer is full",  // (out of memory to grow it)
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Cannot write trace file",
+  "No such image slot",
+  "Cannot set up server",
+  "Cannot write PBM file",
+  "Operation needs a normal (not sparse) image",
+  "Cannot load 16-bit PGM file: %s",
+  "Some files failed in batch mode",
+  "Cannot read list of files",
+  "Cannot start batch threads",
+  "Cannot open result cache",
 };
 
+// Cause of error err, to format errors[err] with.
+static char* errCause(int err) {
+  return err == 13 ? Image16ErrMsg() : ImageErrMsg();
+}
+
+// Number of pixels in img (0 if img is NULL)
+static long npix(Image img) {
+  return img == NULL ? 0 : (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// Level from which pixels of img are white in its binary version.
+static uint8 binaryLevel(Image img) {
+  return (uint8)((ImageMaxval(img) + 1) / 2);
+}
+
+// Counter values at the start of the current operation
+static _Thread_local unsigned long cnt0[NUMCOUNTERS];
+static _Thread_local long long hw0[NUMHWCOUNTERS];
+
+// Snapshot counters at the start of an operation.
+static void traceStart(void) {
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    cnt0[i] = InstrCount[i];
+  InstrHWRead();
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    hw0[i] = InstrHWCount[i];
+}
+
+// Record the span of an operation, with input and output image sizes,
+// bytes touched and the counter deltas since traceStart.
+static void traceOp(const char* name, double t0, Image in, Image out, long bytes) {
+  double t1 = TraceNow();
+  char args[1024];
+  int len = 0;
+  if (in != NULL)
+    len += snprintf(args + len, sizeof(args) - len, "\"in\": \"%dx%d\", ",
+                    ImageWidth(in), ImageHeight(in));
+  if (out != NULL)
+    len += snprintf(args + len, sizeof(args) - len, "\"out\": \"%dx%d\", ",
+                    ImageWidth(out), ImageHeight(out));
+  len += snprintf(args + len, sizeof(args) - len, "\"bytes\": %ld", bytes);
+  // Counters may go backwards if the operation was a reset (tic)
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL && InstrCount[i] >= cnt0[i])
+      len += snprintf(args + len, sizeof(args) - len, ", \"%s\": %lu",
+                      InstrName[i], InstrCount[i] - cnt0[i]);
+  InstrHWRead();
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (hw0[i] >= 0 && InstrHWCount[i] >= hw0[i])
+      len += snprintf(args + len, sizeof(args) - len, ", \"%s\": %lld",
+                      InstrHWName[i], InstrHWCount[i] - hw0[i]);
+  TraceSpan(name, t0, t1, args);
+}
+
+
+// Maximum number of released images kept for recycling
+#define MAXSPARE 4
+
+// State of a pipeline run: the image buffer, and where its output goes.
+typedef struct {
+  Image* img;     // the image buffer: I0, I1, ..., PRED, CURR
+  int n;          // number of images in the buffer
+  int cap;        // capacity of the buffer
+  FILE* out;      // output of info, locate and toc
+  int verbose;    // describe operations on stderr
+  int server;     // enable server mode operations and caches
+  int keepcurr;   // keep CURR at the end, even if unused (batch mode)
+  int async;      // save in the background
+  // Background saves in progress, and their files
+  struct { ImageSaveJob job; const char* name; }* saves;
+  int nsaves, capsaves;
+  // Plan: lastuse[i] is the position (in av) of the last operation using Ii
+  int* lastuse;
+  int caplastuse;
+  // Released images, kept to be recycled (and reused across jobs)
+  Image spare[MAXSPARE];
+  int nspare;
+  // Allocation statistics, with the plan and without it (naive)
+  int allocs, naiveAllocs;
+  long live, peak, naiveLive, naivePeak;   // pixel bytes
+} Pipeline;
+
+// Describe an operation on stderr, if p is verbose.
+static void note(Pipeline* p, const char* fmt, ...) {
+  if (!p->verbose) return;
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+}
+
+// Grow the image buffer of p.  Returns 0 on failure.
+static int growImages(Pipeline* p) {
+  int cap = p->cap > 0 ? 2*p->cap : 16;
+  Image* img = realloc(p->img, sizeof(Image) * cap);
+  if (img == NULL) return 0;
+  p->img = img;
+  p->cap = cap;
+  return 1;
+}
+
+// Pipeline planning.
+//
+// Operations only use the last images in the buffer (CURR and PRED), so
+// once an image is no longer used by any later operation, it can be
+// released immediately, instead of at the end of the pipeline.
+// The planner scans the pipeline before running it, to find the last use of
+// each image.  Then, released images are recycled (rotate into a spare image
+// of the same size), and mirror is done in-place when its input dies.
+
+// Operations: number of operands, number of images used (CURR, PRED),
+// whether they create a new image, and how many of the images used
+// (counting from CURR) may be sparse.
+// Anything else is a file (or, in server mode, a @NAME), which creates one.
+static const struct {
+  const char* name;
+  int operands;
+  int uses;
+  int creates;
+  int sparse;
+} opTable[] = {
+  { "info", 0, 1, 0, 1 },    { "tic", 0, 0, 0, 0 },       { "toc", 0, 0, 0, 0 },
+  { "neg", 0, 1, 0, 0 },     { "thr", 1, 1, 0, 0 },       { "bri", 1, 1, 0, 0 },
+  { "create", 1, 0, 1, 0 },  { "rotate", 0, 1, 1, 0 },    { "mirror", 0, 1, 1, 0 },
+  { "crop", 1, 1, 1, 1 },    { "paste", 1, 2, 0, 1 },     { "blend", 1, 2, 0, 1 },
+  { "locate", 0, 2, 0, 0 },  { "blur", 1, 1, 0, 0 },      { "save", 1, 1, 0, 1 },
+  { "store", 1, 1, 0, 1 },   { "drop", 1, 0, 0, 0 },
+  { "savepbm", 1, 1, 0, 0 }, { "bitlocate", 0, 2, 0, 0 }, { "sparse", 1, 0, 1, 0 },
+  { "saveplain", 1, 1, 0, 1 }, { "load16", 1, 0, 1, 0 },
+  { "savetiled", 1, 1, 0, 1 }, { "region", 2, 0, 1, 0 },
+  { "frame", 2, 0, 1, 0 },
+  { "median", 1, 1, 0, 0 }, { "rank", 1, 1, 0, 0 },
+  { "erode", 1, 1, 0, 0 },  { "dilate", 1, 1, 0, 0 },    { "open", 1, 1, 0, 0 },
+  { "close", 1, 1, 0, 0 },  { "gradient", 1, 1, 0, 0 },    { "label", 1, 1, 0, 0 },
+  { "resize", 1, 1, 1, 0 },
+  { "composite", 1, 1, 0, 1 },  // also uses one image per overlay
+};
+#define NUMOPS (int)(sizeof(opTable) / sizeof(opTable[0]))
+
+// Index of operation name in opTable, or -1.
+static int findOp(const char* name) {
+  for (int o = 0; o < NUMOPS; o++)
+    if (strcmp(name, opTable[o].name) == 0)
+      return o;
+  return -1;
+}
+
+// Number of overlays in the operand of composite.
+static int compositeCount(const char* spec) {
+  int count = 1;
+  for (; *spec != '\0'; spec++)
+    count += *spec == '/';
+  return count;
+}
+
+// Parse the operand of composite, X,Y[,alpha]/X,Y[,alpha]/..., into the
+// positions, modes and alphas of ops[0..nops-1].  Returns 0 if invalid.
+static int parseComposite(const char* spec, CompositeOp* ops, int nops) {
+  for (int j = 0; j < nops; j++) {
+    int len;
+    ops[j].mode = COMPOSITE_PASTE;
+    ops[j].alpha = 1.0;
+    if (sscanf(spec, "%d,%d%n", &ops[j].x, &ops[j].y, &len) != 2) return 0;
+    spec += len;
+    if (*spec == ',') {
+      if (sscanf(spec, ",%lf%n", &ops[j].alpha, &len) != 1) return 0;
+      ops[j].mode = COMPOSITE_BLEND;
+      spec += len;
+    }
+    if (*spec != (j + 1 < nops ? '/' : '\0')) return 0;
+    spec++;
+  }
+  return 1;
+}
+
+// Start a background save of img to file name.  Returns 0 on failure.
+static int startSave(Pipeline* p, Image img, const char* name) {
+  if (p->nsaves >= p->capsaves) {
+    int cap = p->capsaves > 0 ? 2*p->capsaves : 8;
+    void* saves = realloc(p->saves, sizeof(p->saves[0]) * cap);
+    if (saves == NULL) return 0;
+    p->saves = saves;
+    p->capsaves = cap;
+  }
+  ImageSaveJob job = ImageSaveAsync(img, name, 0);
+  if (job == NULL) return 0;
+  p->saves[p->nsaves].job = job;
+  p->saves[p->nsaves++].name = name;
+  return 1;
+}
+
+// Wait for the background saves to file name (all of them, if name is
+// NULL), so that the file may be read or written again.
+// Returns 0 if some save failed.
+static int waitSaves(Pipeline* p, const char* name) {
+  int ok = 1;
+  int j = 0;
+  for (int i = 0; i < p->nsaves; i++) {
+    if (name == NULL || strcmp(p->saves[i].name, name) == 0)
+      ok = ImageSaveWait(&p->saves[i].job) && ok;
+    else
+      p->saves[j++] = p->saves[i];
+  }
+  p->nsaves = j;
+  return ok;
+}
+
+// Find the last use of each image of pipeline av[0..ac-1].
+// Returns 0 if out of memory (and then nothing is released early).
+static int planPipeline(Pipeline* p, int ac, char* av[]) {
+  int n = p->n;
+  if (n + ac > p->caplastuse) {
+    int* lastuse = realloc(p->lastuse, sizeof(int) * (n + ac));
+    if (lastuse == NULL) return 0;
+    p->lastuse = lastuse;
+    p->caplastuse = n + ac;
+  }
+  for (int i = 0; i < n + ac; i++)
+    p->lastuse[i] = ac;   // past the end: never released early
+  for (int k = 0; k < ac; k++) {
+    int opk = k;
+    int o = findOp(av[k]);
+    int uses = o >= 0 ? opTable[o].uses : 0;
+    int creates = o >= 0 ? opTable[o].creates : 1;
+    k += o >= 0 ? opTable[o].operands : 0;
+    if (k >= ac) break;   // missing operand: the pipeline stops there
+    if (strcmp(av[opk], "composite") == 0) uses += compositeCount(av[k]);
+    for (int u = 1; u <= uses && n - u >= 0; u++)
+      p->lastuse[n - u] = opk;
+    if (creates) p->lastuse[n++] = opk;
+  }
+  if (p->keepcurr && n > 0) p->lastuse[n-1] = ac;
+  return 1;
+}
+
+// Account for a new image.  allocated is 0 if it reused a buffer.
+static void countImage(Pipeline* p, Image img, int allocated) {
+  long size = (long)ImageWidth(img) * ImageHeight(img);
+  p->naiveAllocs++;
+  p->naiveLive += size;
+  if (p->naiveLive > p->naivePeak) p->naivePeak = p->naiveLive;
+  if (!allocated) return;
+  p->allocs++;
+  p->live += size;
+  if (p->live > p->peak) p->peak = p->live;
+}
+
+// Release image (*pimg): keep it as a spare, or destroy it.
+static void releaseImage(Pipeline* p, Image* pimg) {
+  if (p->nspare < MAXSPARE && !ImageIsSparse(*pimg)) {
+    p->spare[p->nspare++] = *pimg;
+    *pimg = NULL;
+  } else {
+    p->live -= (long)ImageWidth(*pimg) * ImageHeight(*pimg);
+    ImageDestroy(pimg);
+  }
+}
+
+// Take a spare image with npixels pixels, or return NULL if there is none.
+static Image takeSpare(Pipeline* p, long npixels) {
+  for (int i = 0; i < p->nspare; i++) {
+    if ((long)ImageWidth(p->spare[i]) * ImageHeight(p->spare[i]) == npixels) {
+      Image img = p->spare[i];
+      p->spare[i] = p->spare[--p->nspare];
+      return img;
+    }
+  }
+  return NULL;
+}
+
+// Destroy all images of p (but keep the buffers for reuse).
+static void clearPipeline(Pipeline* p) {
+  while (p->n > 0) ImageDestroy(&p->img[--p->n]);
+  while (p->nspare > 0) ImageDestroy(&p->spare[--p->nspare]);
+  p->live = p->naiveLive = 0;
+}
+
+// Images kept across jobs in server mode: named slots, and cached file loads.
+// Jobs never modify these: they get clones, which copy the pixels only
+// when modified (see ImageClone).
+typedef struct {
+  char* name;             // slot name or file name
+  int isfile;             // 1 for cached file loads
+  Image img;
+  time_t mtime;           // file modification time, for cached loads
+  off_t size;             // file size, for cached loads
+  unsigned long lastuse;  // for LRU eviction of cached loads
+} Slot;
+
+static Slot* slots = NULL;
+static int nslots = 0;
+static int capslots = 0;
+static int nfileslots = 0;
+static int maxfileslots = 64;   // --cache N
+static unsigned long slotclock = 0;
+static pthread_rwlock_t slotlock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Index of slot (name, isfile), or -1.  Call with slotlock held.
+static int slotFind(const char* name, int isfile) {
+  for (int i = 0; i < nslots; i++)
+    if (slots[i].isfile == isfile && strcmp(slots[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+// Remove slot i.  Call with slotlock held for writing.
+static void slotRemove(int i) {
+  nfileslots -= slots[i].isfile;
+  free(slots[i].name);
+  ImageDestroy(&slots[i].img);
+  slots[i] = slots[--nslots];
+}
+
+// Set slot (name, isfile) to img, which the slot takes ownership of,
+// replacing any previous image.  If img is NULL, the slot is removed.
+static void slotPut(const char* name, int isfile, Image img, time_t mtime, off_t size) {
+  pthread_rwlock_wrlock(&slotlock);
+  int i = slotFind(name, isfile);
+  if (i >= 0) slotRemove(i);
+  if (img != NULL && isfile && nfileslots >= maxfileslots) {
+    // Evict the least recently used file
+    int lru = -1;
+    for (int j = 0; j < nslots; j++)
+      if (slots[j].isfile && (lru < 0 || slots[j].lastuse < slots[lru].lastuse))
+        lru = j;
+    if (lru >= 0) slotRemove(lru);
+  }
+  char* dup = img != NULL ? strdup(name) : NULL;
+  if (dup != NULL && nslots >= capslots) {
+    int cap = capslots > 0 ? 2*capslots : 16;
+    Slot* s = realloc(slots, sizeof(Slot) * cap);
+    if (s != NULL) { slots = s; capslots = cap; }
+  }
+  if (dup != NULL && nslots < capslots) {
+    Slot s = { dup, isfile, img, mtime, size, ++slotclock };
+    slots[nslots++] = s;
+    nfileslots += isfile;
+  } else if (img != NULL) {  // out of memory: just do not keep it
+    free(dup);
+    ImageDestroy(&img);
+  }
+  pthread_rwlock_unlock(&slotlock);
+}
+
+// A copy of the image in named slot name, or NULL.
+static Image slotCopy(const char* name) {
+  pthread_rwlock_rdlock(&slotlock);
+  int i = slotFind(name, 0);
+  Image img = i >= 0 ? ImageClone(slots[i].img) : NULL;
+  pthread_rwlock_unlock(&slotlock);
+  return img;
+}
+
+// Load image file, using the cache of previous loads if the file did not
+// change since.  Returns a new image, as ImageLoad.
+static Image loadCached(const char* filename) {
+  struct stat st;
+  if (maxfileslots <= 0 || stat(filename, &st) != 0)
+    return ImageLoad(filename);
+  pthread_rwlock_rdlock(&slotlock);
+  int i = slotFind(filename, 1);
+  Image img = NULL;
+  if (i >= 0 && slots[i].mtime == st.st_mtime && slots[i].size == st.st_size) {
+    img = ImageClone(slots[i].img);
+    __atomic_store_n(&slots[i].lastuse, __atomic_add_fetch(&slotclock, 1, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&slotlock);
+  if (img != NULL) return img;
+  img = ImageLoad(filename);
+  if (img == NULL) return NULL;
+  Image copy = ImageClone(img);
+  if (copy != NULL) slotPut(filename, 1, copy, st.st_mtime, st.st_size);
+  return img;
+}
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,88 +598,166 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
-  }
-
-  ImageInit();
-
+// Run the pipeline of operations in av[0..ac-1] on the image buffer of p.
+// Returns 0 on success, or the index of the error message in errors[].
+static int runPipeline(Pipeline* p, int ac, char* av[]) {
   int err = 0;
   int x, y, w, h;
+  int n = p->n;
+  int planned = planPipeline(p, ac, av);
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
+  int k = 0;
   while (k < ac) {
+    // At most one image is created per operation
+    if (n >= p->cap && !growImages(p)) { err = 3; break; }
+    Image* img = p->img;
+    // For tracing:
+    int opk = k;          // position of the operation name
+    int n0 = n;           // number of images before the operation
+    long bytes = 0;       // bytes of pixel data touched by the operation
+    double t0 = 0.0;
+    if (TraceOn) { traceStart(); t0 = TraceNow(); }
+    // So that errno, on failure, comes from this operation
+    errno = 0;
+
+    // Only some operations accept sparse images
+    int o = findOp(av[k]);
+    int u = o >= 0 ? opTable[o].sparse + 1 : 1;
+    while (o >= 0 && u <= opTable[o].uses && u <= n && !ImageIsSparse(img[n-u])) u++;
+    if (o >= 0 && u <= opTable[o].uses && u <= n) { err = 12; break; }
+
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      note(p, "Info on I%d\n", n-1);
       uint8 min, max;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
       ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      bytes = npix(img[n-1]);
+      fprintf(p->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(p->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      InstrFPrint(p->out);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
+      note(p, "Negating I%d\n", n-1);
       ImageNegative(img[n-1]);
+      bytes = 2*npix(img[n-1]);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
+      note(p, "Thresholding I%d at %d\n", n-1, thr);
       ImageThreshold(img[n-1], (uint8)thr);
+      bytes = 2*npix(img[n-1]);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
+      note(p, "Brightening I%d by %lf\n", n-1, factor);
       ImageBrighten(img[n-1], factor);
+      bytes = 2*npix(img[n-1]);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+      note(p, "Creating black image (%d,%d) -> I%d\n", w, h, n);
       img[n] = ImageCreate(w, h, PixMax);
       if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n]);
+      n++;
+    } else if (strcmp(av[k], "load16") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Loading %s -> I%d (16-bit)\n", av[k], n);
+      Image16 img16 = Image16Load(av[k]);
+      if (img16 == NULL) { err = 13; break; }
+      img[n] = Image16ToImage(img16, PixMax);
+      Image16Destroy(&img16);
+      if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n]);
+      n++;
+    } else if (strcmp(av[k], "sparse") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
+      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+      note(p, "Creating sparse black image (%d,%d) -> I%d\n", w, h, n);
+      img[n] = ImageCreateSparse(w, h, PixMax);
+      if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      img[n] = planned ? takeSpare(p, npix(img[n-1])) : NULL;
+      if (img[n] != NULL) {
+        note(p, "Rotating I%d -> I%d (recycled)\n", n-1, n);
+        if (!ImageRotateInto(img[n-1], img[n])) {
+          ImageDestroy(&img[n]);
+          err = 4; break;
+        }
+        countImage(p, img[n], 0);
+      } else {
+        note(p, "Rotating I%d -> I%d\n", n-1, n);
+        img[n] = ImageRotate(img[n-1]);
+        if (img[n] == NULL) { err = 4; break; }
+        countImage(p, img[n], 1);
+      }
+      bytes = 2*npix(img[n]);
       n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
+      if (planned && p->lastuse[n-1] == k) {  // I(n-1) is not needed after
+        note(p, "Mirroring I%d -> I%d (in place)\n", n-1, n);
+        img[n] = img[n-1];
+        img[n-1] = NULL;
+        ImageMirrorInPlace(img[n]);
+        countImage(p, img[n], 0);
+      } else {
+        note(p, "Mirroring I%d -> I%d\n", n-1, n);
+        img[n] = ImageMirror(img[n-1]);
+        if (img[n] == NULL) { err = 4; break; }
+        countImage(p, img[n], 1);
+      }
+      bytes = 2*npix(img[n]);
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      note(p, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = 2*npix(img[n]);
+      n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      char name[16] = "area";
+      if (sscanf(av[k], "%d,%d,%15s", &w, &h, name) < 2) { err = 5; break; }
+      ResizeFilter filter;
+      if (strcmp(name, "box") == 0) filter = RESIZE_BOX;
+      else if (strcmp(name, "area") == 0) filter = RESIZE_AREA;
+      else if (strcmp(name, "bilinear") == 0) filter = RESIZE_BILINEAR;
+      else { err = 5; break; }
+      int iw = ImageWidth(img[n-1]), ih = ImageHeight(img[n-1]);
+      if (w < 0 || h < 0 || (w > 0 && h > 0 && (iw == 0 || ih == 0)) ||
+          (filter == RESIZE_BOX && ((w > 0 && iw % w != 0) || (h > 0 && ih % h != 0)))) {
+        err = 5; break;   // precondition check!
+      }
+      note(p, "Resizing I%d to %dx%d (%s) -> I%d\n", n-1, w, h, name, n);
+      img[n] = ImageResize(img[n-1], w, h, filter);
+      if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n-1]) + npix(img[n]);
       n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -175,8 +766,9 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      note(p, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
+      bytes = 2*npix(img[n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -185,44 +777,1086 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      note(p, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      bytes = 3*npix(img[n-2]);
+    } else if (strcmp(av[k], "composite") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int nops = compositeCount(av[k]);
+      if (n < nops + 1) { err = 2; break; }
+      CompositeOp* ops = malloc(sizeof(CompositeOp) * nops);
+      if (ops == NULL) { err = 3; break; }
+      if (!parseComposite(av[k], ops, nops)) err = 5;
+      for (int j = 0; err == 0 && j < nops; j++) {
+        ops[j].img = img[n-1-nops+j];   // overlays are the images before CURR
+        if (ImageIsSparse(ops[j].img)) err = 12;
+        else if (!ImageValidRect(img[n-1], ops[j].x, ops[j].y,
+                                 ImageWidth(ops[j].img), ImageHeight(ops[j].img))) err = 6;
+        bytes += (ops[j].mode == COMPOSITE_PASTE ? 2 : 3) * npix(ops[j].img);
+      }
+      if (err == 0) {
+        note(p, "Compositing I%d..I%d into I%d\n", n-1-nops, n-2, n-1);
+        if (!ImageComposite(img[n-1], ops, nops)) err = 4;
+      }
+      free(ops);
+      if (err != 0) break;
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+      note(p, "Locating I%d in I%d\n", n-2, n-1);
+      unsigned long pixmem0 = InstrCount[INSTR_PIXMEM];
+      int found = ImageLocateSubImage(img[n-1], &x, &y, img[n-2]);
+      bytes = (long)(InstrCount[INSTR_PIXMEM] - pixmem0);  // data dependent
+      if (found) {
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(p->out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "bitlocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      note(p, "Locating I%d in I%d (binary)\n", n-2, n-1);
+      BitImage b1 = BitImageFromImage(img[n-1], binaryLevel(img[n-1]));
+      BitImage b2 = BitImageFromImage(img[n-2], binaryLevel(img[n-2]));
+      if (b1 == NULL || b2 == NULL) {
+        BitImageDestroy(&b1);
+        BitImageDestroy(&b2);
+        err = 4; break;
+      }
+      int found = BitImageLocateSubImage(b1, &x, &y, b2);
+      BitImageDestroy(&b1);
+      BitImageDestroy(&b2);
+      bytes = npix(img[n-1]) + npix(img[n-2]);
+      if (found) {
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(p->out, "# NOTFOUND\n");
       }
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      note(p, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+      bytes = 2*npix(img[n-1]);
+    } else if (strcmp(av[k], "median") == 0 || strcmp(av[k], "rank") == 0) {
+      int median = strcmp(av[k], "median") == 0;
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy; double pct = 50.0;
+      if (sscanf(av[k], median ? "%d,%d" : "%d,%d,%lf", &dx, &dy, &pct) != 2 + !median) { err = 5; break; }
+      if (dx < 0 || dy < 0 || dy >= 32768 || !(0.0 <= pct && pct <= 100.0)) { err = 5; break; }   // precondition check!
+      note(p, "Filter I%d with %dx%d rank filter (%g%%)\n", n-1, 2*dx+1, 2*dy+1, pct);
+      if (!ImageRankFilter(img[n-1], dx, dy, pct / 100.0)) { err = 4; break; }
+      bytes = 2*npix(img[n-1]);
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0 ||
+               strcmp(av[k], "gradient") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      note(p, "Morphology %s on I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int (*fn)(Image, int, int) = op[0] == 'e' ? ImageErode : op[0] == 'd' ? ImageDilate :
+                                   op[0] == 'o' ? ImageOpen : op[0] == 'c' ? ImageClose :
+                                   ImageMorphGradient;
+      if (!fn(img[n-1], dx, dy)) { err = 4; break; }
+      bytes = 2*npix(img[n-1]);
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1) { err = 5; break; }
+      if (conn != 4 && conn != 8) { err = 5; break; }   // precondition check!
+      note(p, "Labelling components of I%d (%d-connected)\n", n-1, conn);
+      uint32_t* labels; ComponentStats* cs; long ncs;
+      if (!ImageLabelComponents(img[n-1], conn, &labels, &cs, &ncs)) { err = 4; break; }
+      bytes = 5*npix(img[n-1]);   // 1 byte read, 4 bytes of label written
+      fprintf(p->out, "# Components: %ld\n", ncs);
+      long top[10]; int ntop = 0;   // the largest, by decreasing area
+      for (long c = 1; c <= ncs; c++) {
+        int i = ntop < 10 ? ntop++ : 10;
+        for (; i > 0 && cs[top[i-1]].area < cs[c].area; i--)
+          if (i < 10) top[i] = top[i-1];
+        if (i < 10) top[i] = c;
+      }
+      for (int i = 0; i < ntop; i++) {
+        ComponentStats* c = &cs[top[i]];
+        fprintf(p->out, "# Component %ld: area %ld, box %dx%d at (%d,%d)\n",
+                top[i], c->area, c->w, c->h, c->x, c->y);
+      }
+      free(labels);
+      free(cs);
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (!waitSaves(p, av[k])) { err = 4; break; }   // saves to a file stay in order
+      if (p->async) {
+        note(p, "Saving %s <- I%d (in the background)\n", av[k], n-1);
+        if (!startSave(p, img[n-1], av[k])) { err = 4; break; }
+      } else {
+        note(p, "Saving %s <- I%d\n", av[k], n-1);
+        if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      }
+      bytes = npix(img[n-1]);
+    } else if (strcmp(av[k], "saveplain") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Saving %s <- I%d (plain)\n", av[k], n-1);
+      if (ImageSavePlain(img[n-1], av[k]) == 0) { err = 4; break; }
+      bytes = npix(img[n-1]);
+    } else if (strcmp(av[k], "savetiled") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Saving %s <- I%d (tiled)\n", av[k], n-1);
+      if (ImageSaveTiled(img[n-1], av[k]) == 0) { err = 4; break; }
+      bytes = npix(img[n-1]);
+    } else if (strcmp(av[k], "region") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (sscanf(av[++k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+      k++;
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Loading %s (%d,%d,%d,%d) -> I%d\n", av[k], x, y, w, h, n);
+      img[n] = ImageLoadRegion(av[k], x, y, w, h);
+      if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n]);
+      n++;
+    } else if (strcmp(av[k], "frame") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      int frame;
+      if (sscanf(av[++k], "%d", &frame) != 1 || frame < 0) { err = 5; break; }
+      k++;
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Loading %s (frame %d) -> I%d\n", av[k], frame, n);
+      ImageStream s = ImageStreamOpen(av[k]);
+      if (s == NULL) { err = 4; break; }
+      img[n] = ImageStreamFrame(s, frame);
+      ImageStreamClose(&s);
+      if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n]);
+      n++;
+    } else if (strcmp(av[k], "savepbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Saving %s <- I%d (PBM)\n", av[k], n-1);
+      BitImage bimg = BitImageFromImage(img[n-1], binaryLevel(img[n-1]));
+      if (bimg == NULL) { err = 4; break; }
+      int saved = BitImageSavePBM(bimg, av[k]);
+      BitImageDestroy(&bimg);
+      if (!saved) { err = 11; break; }
+      bytes = npix(img[n-1]);
+    } else if (p->server && strcmp(av[k], "store") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      Image copy = ImageClone(img[n-1]);
+      if (copy == NULL) { err = 4; break; }
+      note(p, "Storing I%d -> @%s\n", n-1, av[k]);
+      slotPut(av[k], 0, copy, 0, 0);
+    } else if (p->server && strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      note(p, "Dropping @%s\n", av[k]);
+      slotPut(av[k], 0, NULL, 0, 0);
+    } else if (p->server && av[k][0] == '@') {  // named slot
+      note(p, "Copying %s -> I%d\n", av[k], n);
+      img[n] = slotCopy(av[k] + 1);
+      if (img[n] == NULL) { err = 9; break; }
+      countImage(p, img[n], 1);
+      n++;
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      if (!waitSaves(p, av[k])) { err = 4; break; }
+      note(p, "Loading %s -> I%d\n", av[k], n);
+      img[n] = p->server ? loadCached(av[k]) : ImageLoad(av[k]);
       if (img[n] == NULL) { err = 4; break; }
+      countImage(p, img[n], 1);
+      bytes = npix(img[n]);
       n++;
     }
+
+    if (TraceOn) {
+      char name[256];
+      if (opk == k)   // no operands
+        snprintf(name, sizeof(name), "%s", av[opk]);
+      else
+        snprintf(name, sizeof(name), "%s %s", av[opk], av[k]);
+      traceOp(name, t0, n0 > 0 ? img[n0-1] : NULL, n > 0 ? img[n-1] : NULL, bytes);
+    }
+    // Release images that later operations do not use
+    for (int i = 0; planned && i < n; i++)
+      if (img[i] != NULL && p->lastuse[i] <= k)
+        releaseImage(p, &img[i]);
     k++;
   }
+  if (!waitSaves(p, NULL) && err == 0) err = 4;
   
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  p->n = n;
+  return err;
+}
+
+// Server mode.
+//
+// Jobs are lines of text, each holding a pipeline with the same syntax as
+// the command line.  They are read from stdin or from the clients of a Unix
+// socket, and run concurrently by a pool of worker threads.
+// The response to each job is its output (from info, locate, toc), followed
+// by a status line:  "OK JOB" or "ERROR JOB MESSAGE", where JOB is the job
+// number (its line number in the stream).  The response of each job is
+// written as a whole, but responses may come out of order.
+
+// A stream of jobs (stdin/stdout, or a socket connection)
+typedef struct {
+  FILE* in;
+  FILE* out;
+  pthread_mutex_t lock;   // serializes responses, protects pending/eof
+  long pending;           // jobs queued or running
+  int eof;                // no more jobs will be read
+  int closeAtEnd;         // close and free when eof and pending == 0
+} Source;
+
+// A queued job
+typedef struct {
+  Source* src;
+  long no;
+  char* line;
+} Job;
+
+// Bounded job queue (ring buffer).  A job with src == NULL stops a worker.
+#define QUEUESIZE 256
+static Job queue[QUEUESIZE];
+static int qhead = 0, qcount = 0;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qnotempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qnotfull = PTHREAD_COND_INITIALIZER;
+
+static void queuePush(Job job) {
+  pthread_mutex_lock(&qlock);
+  while (qcount == QUEUESIZE) pthread_cond_wait(&qnotfull, &qlock);
+  queue[(qhead + qcount++) % QUEUESIZE] = job;
+  pthread_cond_signal(&qnotempty);
+  pthread_mutex_unlock(&qlock);
+}
+
+static Job queuePop(void) {
+  pthread_mutex_lock(&qlock);
+  while (qcount == 0) pthread_cond_wait(&qnotempty, &qlock);
+  Job job = queue[qhead];
+  qhead = (qhead + 1) % QUEUESIZE;
+  qcount--;
+  pthread_cond_signal(&qnotfull);
+  pthread_mutex_unlock(&qlock);
+  return job;
+}
+
+// Mark one job of src done (or, if job is 0, the end of its input),
+// and close src if it is finished.
+static void sourceDone(Source* src, int job) {
+  pthread_mutex_lock(&src->lock);
+  if (job) src->pending--; else src->eof = 1;
+  int finished = src->eof && src->pending == 0 && src->closeAtEnd;
+  pthread_mutex_unlock(&src->lock);
+  if (finished) {
+    fclose(src->in);
+    fclose(src->out);
+    pthread_mutex_destroy(&src->lock);
+    free(src);
   }
+}
 
-  error(err, errno, errors[err], ImageErrMsg());
-  return 0;
+// Split line into whitespace separated words, in place.
+// Returns the number of words, or -1 if out of memory.
+static int splitWords(char* line, char*** pwords, int* pcap) {
+  int nw = 0;
+  for (char* w = strtok(line, " \t\r\n"); w != NULL; w = strtok(NULL, " \t\r\n")) {
+    if (nw >= *pcap) {
+      int cap = *pcap > 0 ? 2 * *pcap : 16;
+      char** words = realloc(*pwords, sizeof(char*) * cap);
+      if (words == NULL) return -1;
+      *pwords = words;
+      *pcap = cap;
+    }
+    (*pwords)[nw++] = w;
+  }
+  return nw;
+}
+
+static void* worker(void* arg) {
+  char name[32];
+  snprintf(name, sizeof(name), "worker %ld", (long)(intptr_t)arg);
+  TraceThreadName(name);
+  // Reused across jobs
+  Pipeline p = { .out = NULL, .verbose = 0, .server = 1 };
+  char** words = NULL;
+  int capwords = 0;
+  char* outbuf = NULL;
+  size_t outlen = 0;
+  for (;;) {
+    Job job = queuePop();
+    if (job.src == NULL) break;
+    double t0 = TraceNow();
+    p.out = open_memstream(&outbuf, &outlen);
+    int err = p.out == NULL ? 3 : 0;
+    int nw = err ? 0 : splitWords(job.line, &words, &capwords);
+    if (nw < 0) err = 3;
+    else if (nw > 0) err = runPipeline(&p, nw, words);
+    char msg[512] = "";
+    if (err) {
+      snprintf(msg, sizeof(msg), errors[err], errCause(err));
+      if (errno != 0 && err == 4)
+        snprintf(msg + strlen(msg), sizeof(msg) - strlen(msg), ": %s", strerror(errno));
+    }
+    // Keep the spare images for the next jobs
+    while (p.n > 0) ImageDestroy(&p.img[--p.n]);
+    if (p.out != NULL) fclose(p.out);
+    if (TraceOn) TraceSpan("job", t0, TraceNow(), NULL);
+
+    pthread_mutex_lock(&job.src->lock);
+    if (outbuf != NULL) fwrite(outbuf, 1, outlen, job.src->out);
+    if (err) fprintf(job.src->out, "ERROR %ld %s\n", job.no, msg);
+    else fprintf(job.src->out, "OK %ld\n", job.no);
+    fflush(job.src->out);
+    pthread_mutex_unlock(&job.src->lock);
+    free(outbuf);
+    outbuf = NULL;
+    free(job.line);
+    sourceDone(job.src, 1);
+  }
+  clearPipeline(&p);
+  free(p.img);
+  free(p.lastuse);
+  free(words);
+  return NULL;
+}
+
+// Read jobs from src and queue them, until end of input.
+static void* reader(void* arg) {
+  Source* src = arg;
+  char* line = NULL;
+  size_t cap = 0;
+  long no = 0;
+  while (getline(&line, &cap, src->in) > 0) {
+    no++;
+    if (strspn(line, " \t\r\n") == strlen(line)) continue;  // blank line
+    char* dup = strdup(line);
+    if (dup == NULL) break;
+    pthread_mutex_lock(&src->lock);
+    src->pending++;
+    pthread_mutex_unlock(&src->lock);
+    Job job = { src, no, dup };
+    queuePush(job);
+  }
+  free(line);
+  sourceDone(src, 0);
+  return NULL;
+}
+
+// Accept clients on a Unix socket, with one reader thread each.
+// Never returns, unless the socket cannot be set up.
+static int serveSocket(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return 10; }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return 10;
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    close(fd);
+    return 10;
+  }
+  signal(SIGPIPE, SIG_IGN);   // clients may go away without reading
+  for (;;) {
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) { if (errno == EINTR) continue; break; }
+    Source* src = calloc(1, sizeof(Source));
+    int ofd = dup(cfd);
+    if (src == NULL || ofd < 0 || (src->in = fdopen(cfd, "r")) == NULL ||
+        (src->out = fdopen(ofd, "w")) == NULL) {
+      if (src != NULL && src->in != NULL) fclose(src->in); else close(cfd);
+      if (ofd >= 0) close(ofd);
+      free(src);
+      continue;
+    }
+    pthread_mutex_init(&src->lock, NULL);
+    src->closeAtEnd = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, reader, src) == 0)
+      pthread_detach(t);
+    else
+      sourceDone(src, 0);
+  }
+  close(fd);
+  return 10;
+}
+
+// Run server mode with options av[0..ac-1].
+// Returns 0 on success, or the index of the error message in errors[].
+static int serverMain(int ac, char* av[]) {
+  const char* socketPath = NULL;
+  long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int k = 0; k < ac; k++) {
+    if (k + 1 >= ac) return 1;
+    if (strcmp(av[k], "--socket") == 0) socketPath = av[++k];
+    else if (strcmp(av[k], "--workers") == 0) {
+      if (sscanf(av[++k], "%ld", &nworkers) != 1 || nworkers < 1) return 5;
+    } else if (strcmp(av[k], "--cache") == 0) {
+      if (sscanf(av[++k], "%d", &maxfileslots) != 1 || maxfileslots < 0) return 5;
+    } else return 5;
+  }
+  if (nworkers < 1) nworkers = 1;
+
+  pthread_t* workers = malloc(sizeof(pthread_t) * nworkers);
+  if (workers == NULL) return 3;
+  long started = 0;
+  while (started < nworkers &&
+         pthread_create(&workers[started], NULL, worker, (void*)(intptr_t)started) == 0)
+    started++;
+  if (started == 0) { free(workers); return 10; }
+
+  int err = 0;
+  Source stdio = { stdin, stdout, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+  if (socketPath != NULL)
+    err = serveSocket(socketPath);
+  else
+    reader(&stdio);
+  // Stop the workers, after they finish the queued jobs
+  for (long i = 0; i < started; i++) {
+    Job stop = { NULL, 0, NULL };
+    queuePush(stop);
+  }
+  for (long i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  // Release the images kept across jobs
+  while (nslots > 0) slotRemove(nslots - 1);
+  free(slots);
+  return err;
 }
 
+// Batch mode.
+//
+// One pipeline is applied to every file of a list (or directory), in three
+// stages connected by bounded queues:
+//   readers load the next files (so the disk is read ahead of the workers),
+//   workers run the pipeline on each loaded image, with it as I0, and
+//   writers save the resulting CURR images and report each file's output.
+// When a queue is full, the stage before it waits (backpressure), so at
+// most a few images per thread are in memory at any time.
+//
+// With --frames, the input is a PGM stream instead: one reader loads its
+// frames in order, and one writer reports (and writes, to the output
+// stream) the results in the same order, holding back those that come
+// early.  The reader stays at most a window of frames ahead of the writer,
+// which bounds the results held back.
+
+// A file going through the stages of batch mode
+typedef struct {
+  const char* name;   // input file
+  long no;            // frame number (with --frames)
+  Image img;          // the loaded image, and then the result (CURR)
+  char* out;          // output of the pipeline (info, locate, toc)
+  size_t outlen;
+  int err;            // index of the error message in errors[], or 0
+  char msg[512];
+} BatchItem;
+
+// Bounded queue of items between two stages.
+// Pop returns NULL when the queue is empty and all producers are done.
+typedef struct {
+  BatchItem** items;
+  int cap, head, count;
+  int producers;      // producer threads still running
+  pthread_mutex_t lock;
+  pthread_cond_t notempty, notfull;
+} BatchQueue;
+
+static int batchQueueInit(BatchQueue* q, int cap, int producers) {
+  q->items = malloc(sizeof(BatchItem*) * cap);
+  q->cap = cap;
+  q->head = q->count = 0;
+  q->producers = producers;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->notempty, NULL);
+  pthread_cond_init(&q->notfull, NULL);
+  return q->items != NULL;
+}
+
+static void batchQueueDestroy(BatchQueue* q) {
+  free(q->items);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->notempty);
+  pthread_cond_destroy(&q->notfull);
+}
+
+static void batchPush(BatchQueue* q, BatchItem* item) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->cap) pthread_cond_wait(&q->notfull, &q->lock);
+  q->items[(q->head + q->count++) % q->cap] = item;
+  pthread_cond_signal(&q->notempty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static BatchItem* batchPop(BatchQueue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && q->producers > 0) pthread_cond_wait(&q->notempty, &q->lock);
+  BatchItem* item = NULL;
+  if (q->count > 0) {
+    item = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->notfull);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return item;
+}
+
+// Called by each producer of q when it is done.
+static void batchProducerDone(BatchQueue* q) {
+  pthread_mutex_lock(&q->lock);
+  if (--q->producers == 0) pthread_cond_broadcast(&q->notempty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// A stage: its threads, and the time they spent working (not waiting).
+typedef struct {
+  const char* name;
+  int threads;
+  double busy;        // microseconds, summed over threads
+  long items;
+} BatchStage;
+
+enum { READ, WORK, WRITE, NUMSTAGES };
+
+// State of a batch run
+typedef struct {
+  char** names;       // input files
+  long nnames;
+  long next;          // next name to read (atomic)
+  const char* outdir; // where to save results, or NULL
+  ImageStream in;     // with --frames: the input stream,
+  ImageStream out;    // and the output stream, or NULL
+  long window;        // frames the reader may be ahead of the writer
+  long written;       // frames reported by the writer (protected by lock)
+  BatchItem** early;  // frames that reached the writer before their turn
+  pthread_cond_t progress;  // signaled when written changes
+  ResultCache cache;  // results of earlier runs, or NULL
+  char* ops;          // the pipeline, normalized for the cache
+  int ac;             // the pipeline
+  char** av;
+  BatchQueue loaded, done;
+  BatchStage stage[NUMSTAGES];
+  pthread_mutex_t lock;   // protects stage counts and the report of files
+  long failed;
+  unsigned long hits, misses;  // cache lookups (protected by lock)
+} Batch;
+
+// Add the busy time and items of one thread to stage s.
+static void batchAccount(Batch* b, int s, double busy, long items) {
+  pthread_mutex_lock(&b->lock);
+  b->stage[s].busy += busy;
+  b->stage[s].items += items;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Set the error of item to err, with its message.
+static void batchFail(BatchItem* item, int err) {
+  item->err = err;
+  snprintf(item->msg, sizeof(item->msg), errors[err], errCause(err));
+  if (errno != 0 && err == 4)
+    snprintf(item->msg + strlen(item->msg), sizeof(item->msg) - strlen(item->msg),
+             ": %s", strerror(errno));
+}
+
+// Read the next frame of the input stream of b into item.
+// Returns 0 at the end of the stream.
+static int batchReadFrame(Batch* b, BatchItem* item) {
+  pthread_mutex_lock(&b->lock);
+  while (b->next - b->written >= b->window) pthread_cond_wait(&b->progress, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+  if (b->next < 0 || ImageStreamEnd(b->in)) return 0;
+  item->no = b->next++;
+  errno = 0;
+  item->img = ImageStreamRead(b->in);
+  if (item->img == NULL) {
+    batchFail(item, 4);
+    b->next = -1;     // the position of the next frame is unknown: stop
+  }
+  return 1;
+}
+
+static void* batchReader(void* arg) {
+  Batch* b = arg;
+  TraceThreadName("reader");
+  double busy = 0.0;
+  long items = 0;
+  long i;
+  for (;;) {
+    double t0 = TraceNow();
+    BatchItem* item = calloc(1, sizeof(BatchItem));
+    if (item == NULL) break;
+    if (b->in != NULL) {
+      item->name = "frame";
+      if (!batchReadFrame(b, item)) { free(item); break; }
+    } else {
+      if ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) >= b->nnames) {
+        free(item);
+        break;
+      }
+      item->name = b->names[i];
+      errno = 0;
+      item->img = ImageLoad(item->name);
+      if (item->img == NULL) batchFail(item, 4);
+    }
+    double t1 = TraceNow();
+    if (TraceOn) TraceSpan("load", t0, t1, NULL);
+    busy += t1 - t0;
+    items++;
+    batchPush(&b->loaded, item);
+  }
+  batchAccount(b, READ, busy, items);
+  batchProducerDone(&b->loaded);
+  return NULL;
+}
+
+static void* batchWorker(void* arg) {
+  Batch* b = arg;
+  TraceThreadName("worker");
+  Pipeline p = { .out = NULL, .verbose = 0, .server = 0, .keepcurr = 1 };  // reused across files
+  double busy = 0.0;
+  long items = 0;
+  // Cache counters of this thread, added to the batch's at the end
+  unsigned long hits0 = InstrCount[INSTR_CACHEHIT], misses0 = InstrCount[INSTR_CACHEMISS];
+  BatchItem* item;
+  while ((item = batchPop(&b->loaded)) != NULL) {
+    double t0 = TraceNow();
+    uint64_t hash = 0;
+    Image cached = NULL;
+    if (item->err == 0 && b->cache != NULL) {
+      hash = ImageHash(item->img);
+      cached = ResultCacheGet(b->cache, hash, b->ops, &item->out, &item->outlen);
+    }
+    if (cached != NULL) {
+      ImageDestroy(&item->img);
+      item->img = cached;
+    } else if (item->err == 0 && (p.img != NULL || growImages(&p))) {
+      p.img[p.n++] = item->img;
+      item->img = NULL;
+      p.out = open_memstream(&item->out, &item->outlen);
+      errno = 0;
+      int err = p.out == NULL ? 3 : runPipeline(&p, b->ac, b->av);
+      if (p.out != NULL) fclose(p.out);
+      if (err) batchFail(item, err);
+      else if (p.n < 1 || p.img[p.n-1] == NULL) batchFail(item, 2);
+      else item->img = p.img[--p.n];
+      // A result that cannot be cached is still a result
+      if (item->err == 0 && b->cache != NULL)
+        ResultCachePut(b->cache, hash, b->ops, item->img, item->out, item->outlen);
+      // Keep the spare images for the next files
+      while (p.n > 0) ImageDestroy(&p.img[--p.n]);
+    } else if (item->err == 0) {
+      batchFail(item, 3);
+    }
+    double t1 = TraceNow();
+    if (TraceOn) TraceSpan("pipeline", t0, t1, NULL);
+    busy += t1 - t0;
+    items++;
+    batchPush(&b->done, item);
+  }
+  clearPipeline(&p);
+  free(p.img);
+  free(p.lastuse);
+  batchAccount(b, WORK, busy, items);
+  pthread_mutex_lock(&b->lock);
+  b->hits += InstrCount[INSTR_CACHEHIT] - hits0;
+  b->misses += InstrCount[INSTR_CACHEMISS] - misses0;
+  pthread_mutex_unlock(&b->lock);
+  batchProducerDone(&b->done);
+  return NULL;
+}
+
+// Save the result of item, report its output and errors, and free it.
+static void batchEmit(Batch* b, BatchItem* item) {
+  if (item->err == 0 && b->out != NULL) {
+    errno = 0;
+    if (!ImageStreamWrite(b->out, item->img)) batchFail(item, 4);
+  } else if (item->err == 0 && b->outdir != NULL) {
+    const char* base = strrchr(item->name, '/');
+    base = base != NULL ? base + 1 : item->name;
+    size_t len = strlen(b->outdir) + strlen(base) + 2;
+    char* path = malloc(len);
+    errno = 0;
+    if (path == NULL) batchFail(item, 3);
+    else {
+      snprintf(path, len, "%s/%s", b->outdir, base);
+      if (!ImageSave(item->img, path)) batchFail(item, 4);
+    }
+    free(path);
+  }
+  pthread_mutex_lock(&b->lock);
+  if (item->outlen > 0) {
+    if (b->in != NULL) printf("# Frame: %ld\n", item->no);
+    else printf("# File: %s\n", item->name);
+    fwrite(item->out, 1, item->outlen, stdout);
+  }
+  if (item->err) {
+    if (b->in != NULL)
+      fprintf(stderr, "%s: frame %ld: %s\n", program_name, item->no, item->msg);
+    else fprintf(stderr, "%s: %s: %s\n", program_name, item->name, item->msg);
+    b->failed++;
+  }
+  b->written++;
+  pthread_cond_signal(&b->progress);
+  pthread_mutex_unlock(&b->lock);
+  ImageDestroy(&item->img);
+  free(item->out);
+  free(item);
+}
+
+static void* batchWriter(void* arg) {
+  Batch* b = arg;
+  TraceThreadName("writer");
+  double busy = 0.0;
+  long items = 0;
+  BatchItem** early = b->early;  // at most window frames
+  long nearly = 0;
+  BatchItem* item;
+  while ((item = batchPop(&b->done)) != NULL) {
+    double t0 = TraceNow();
+    if (b->in == NULL) {
+      batchEmit(b, item);
+      items++;
+    } else {
+      early[nearly++] = item;
+      // Only this thread changes written, so it can be read without the lock
+      for (long j = 0; j < nearly; ) {
+        if (early[j]->no != b->written) { j++; continue; }
+        batchEmit(b, early[j]);
+        early[j] = early[--nearly];
+        items++;
+        j = 0;
+      }
+    }
+    double t1 = TraceNow();
+    if (TraceOn) TraceSpan("save", t0, t1, NULL);
+    busy += t1 - t0;
+  }
+  // Every frame read reaches the writer, so none should be left here
+  while (nearly > 0) {
+    batchEmit(b, early[--nearly]);
+    items++;
+  }
+  batchAccount(b, WRITE, busy, items);
+  return NULL;
+}
+
+// Append name to the input files of b.  Returns 0 if out of memory.
+static int batchAddName(Batch* b, long* cap, const char* name) {
+  if (b->nnames >= *cap) {
+    long newcap = *cap > 0 ? 2 * *cap : 1024;
+    char** names = realloc(b->names, sizeof(char*) * newcap);
+    if (names == NULL) return 0;
+    b->names = names;
+    *cap = newcap;
+  }
+  if ((b->names[b->nnames] = strdup(name)) == NULL) return 0;
+  b->nnames++;
+  return 1;
+}
+
+static int cmpNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Read the input files of b from the list file (one name per line, "-"
+// for stdin), or from directory dir (regular files, except hidden ones,
+// in alphabetical order).  Returns 0 on failure.
+static int batchNames(Batch* b, const char* list, const char* dir) {
+  long cap = 0;
+  if (list != NULL) {
+    FILE* f = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (f == NULL) return 0;
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int ok = 1;
+    while (ok && (len = getline(&line, &linecap, f)) > 0) {
+      while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+      if (len > 0) ok = batchAddName(b, &cap, line);
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    return ok;
+  }
+  DIR* d = opendir(dir);
+  if (d == NULL) return 0;
+  struct dirent* e;
+  int ok = 1;
+  while (ok && (e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.') continue;
+    size_t len = strlen(dir) + strlen(e->d_name) + 2;
+    char* path = malloc(len);
+    if (path == NULL) { ok = 0; break; }
+    snprintf(path, len, "%s/%s", dir, e->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) ok = batchAddName(b, &cap, path);
+    free(path);
+  }
+  closedir(d);
+  if (ok) qsort(b->names, b->nnames, sizeof(char*), cmpNames);
+  return ok;
+}
+
+// Append operand field [p,end) to f, in canonical form if it is an integer
+// (so that "080", "+80" and "80" are the same).  Only integers are
+// rewritten, and only in text, as every conversion (%d, %hhu, %lf...)
+// parses them the same: pipelines with the same key are valid or invalid
+// together, whatever the conversion of the field ("2.0,3" is not "2,3",
+// as it fails for %d,%d).
+static void normalizeField(FILE* f, const char* p, const char* end) {
+  const char* q = p + (*p == '+' || *p == '-');
+  const char* digits = q;
+  while (q < end && '0' <= *q && *q <= '9') q++;
+  if (q == digits || q != end) {   // not an integer: as is
+    fwrite(p, 1, end - p, f);
+    return;
+  }
+  while (digits + 1 < end && *digits == '0') digits++;
+  if (*p == '-') fputc('-', f);
+  fwrite(digits, 1, end - digits, f);
+}
+
+// Normalized text of pipeline av[0..ac-1], the key of its results in the
+// result cache: one line per operation, with integers in canonical form.
+// Returns a new string, or NULL if out of memory, or if the results may
+// depend on more than the input image (other files, timing, slots).
+static char* pipelineKey(int ac, char* av[]) {
+  static const char* uncacheable[] = {
+    "tic", "toc", "save", "saveplain", "savetiled", "savepbm",
+    "load16", "region", "frame", "store", "drop",
+  };
+  char* key = NULL;
+  size_t len = 0;
+  FILE* f = open_memstream(&key, &len);
+  if (f == NULL) return NULL;
+  int ok = 1;
+  for (int k = 0; ok && k < ac; k++) {
+    int o = findOp(av[k]);
+    if (o < 0) { ok = 0; break; }   // a FILE (or @NAME)
+    for (size_t i = 0; i < sizeof(uncacheable) / sizeof(uncacheable[0]); i++)
+      if (strcmp(av[k], uncacheable[i]) == 0) ok = 0;
+    fputs(av[k], f);
+    for (int j = 0; j < opTable[o].operands && k + 1 < ac; j++) {
+      const char* p = av[++k];
+      fputc(' ', f);
+      for (const char* end; ; p = end + 1) {   // fields split at , and /
+        end = p + strcspn(p, ",/");
+        normalizeField(f, p, end);
+        if (*end == '\0') break;
+        fputc(*end, f);
+      }
+    }
+    fputc('\n', f);
+  }
+  if (fclose(f) != 0) ok = 0;
+  if (!ok) {
+    free(key);
+    return NULL;
+  }
+  return key;
+}
+
+// Start n threads running fn(b), into t.  Returns how many started.
+static int batchStart(pthread_t* t, int n, void* (*fn)(void*), Batch* b) {
+  int started = 0;
+  while (started < n && pthread_create(&t[started], NULL, fn, b) == 0)
+    started++;
+  return started;
+}
+
+// Run batch mode with options and pipeline av[0..ac-1].
+// Returns 0 on success, or the index of the error message in errors[].
+static int batchMain(int ac, char* av[]) {
+  const char* list = NULL;
+  const char* dir = NULL;
+  const char* frames = NULL;
+  Batch b = { .outdir = NULL };
+  int nthreads[NUMSTAGES] = { 2, (int)sysconf(_SC_NPROCESSORS_ONLN), 2 };
+  int queueSize = 0;
+  const char* cachedir = NULL;
+  int cacheMB = 1024;
+  int k = 0;
+  for (; k < ac && strncmp(av[k], "--", 2) == 0; k++) {
+    if (strcmp(av[k], "--") == 0) { k++; break; }
+    if (k + 1 >= ac) return 1;
+    const char* opt = av[k++];
+    int* count = strcmp(opt, "--readers") == 0 ? &nthreads[READ] :
+                 strcmp(opt, "--workers") == 0 ? &nthreads[WORK] :
+                 strcmp(opt, "--writers") == 0 ? &nthreads[WRITE] :
+                 strcmp(opt, "--queue") == 0 ? &queueSize :
+                 strcmp(opt, "--result-cache-size") == 0 ? &cacheMB : NULL;
+    if (strcmp(opt, "--list") == 0) list = av[k];
+    else if (strcmp(opt, "--dir") == 0) dir = av[k];
+    else if (strcmp(opt, "--frames") == 0) frames = av[k];
+    else if (strcmp(opt, "--result-cache") == 0) cachedir = av[k];
+    else if (strcmp(opt, "--out") == 0) b.outdir = av[k];
+    else if (count == NULL || sscanf(av[k], "%d", count) != 1 || *count < 1) return 5;
+  }
+  if ((list != NULL) + (dir != NULL) + (frames != NULL) != 1) return 1;
+  if (nthreads[WORK] < 1) nthreads[WORK] = 1;
+  if (queueSize == 0) queueSize = 2 * nthreads[WORK];
+  b.ac = ac - k;
+  b.av = av + k;
+  if (frames != NULL) {
+    // Frames are read and written in order, by one thread each
+    nthreads[READ] = nthreads[WRITE] = 1;
+    b.window = 2 * queueSize + nthreads[WORK] + 2;
+    b.early = malloc(sizeof(BatchItem*) * b.window);
+    if (b.early == NULL) return 3;
+    errno = 0;
+    if ((b.in = ImageStreamOpen(frames)) == NULL ||
+        (b.outdir != NULL && (b.out = ImageStreamCreate(b.outdir)) == NULL)) {
+      ImageStreamClose(&b.in);
+      free(b.early);
+      return 4;
+    }
+  } else if (!batchNames(&b, list, dir)) {
+    for (long i = 0; i < b.nnames; i++) free(b.names[i]);
+    free(b.names);
+    return 15;
+  }
+
+  static const char* stageNames[NUMSTAGES] = { "read", "work", "write" };
+  pthread_t* threads = malloc(sizeof(pthread_t) * (nthreads[READ] + nthreads[WORK] + nthreads[WRITE]));
+  int err = threads == NULL ? 3 : 0;
+  if (!err && cachedir != NULL) {
+    if ((b.ops = pipelineKey(b.ac, b.av)) == NULL)
+      fprintf(stderr, "%s: Result cache not used: pipeline uses files or timing\n",
+              program_name);
+    else if ((b.cache = ResultCacheOpen(cachedir, cacheMB * (1LL << 20))) == NULL)
+      err = 17;
+  }
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.progress, NULL);
+  int queues = 0;
+  if (!err && batchQueueInit(&b.loaded, queueSize, nthreads[READ])) queues++;
+  if (queues == 1 && batchQueueInit(&b.done, queueSize, nthreads[WORK])) queues++;
+  if (queues < 2) err = 3;
+
+  // Start the stages from the last one, so that each stage has consumers
+  // (and the queues' producer counts match the threads that started)
+  double t0 = TraceNow();
+  pthread_t* t = threads;
+  for (int s = NUMSTAGES - 1; !err && s >= 0; s--) {
+    void* (*fn)(void*) = s == READ ? batchReader : s == WORK ? batchWorker : batchWriter;
+    b.stage[s].name = stageNames[s];
+    b.stage[s].threads = batchStart(t, nthreads[s], fn, &b);
+    t += b.stage[s].threads;
+    for (int i = b.stage[s].threads; i < nthreads[s] && s != WRITE; i++)
+      batchProducerDone(s == READ ? &b.loaded : &b.done);
+    if (b.stage[s].threads == 0) err = 16;
+  }
+  for (pthread_t* j = threads; j < t; j++)
+    pthread_join(*j, NULL);
+  double wall = (TraceNow() - t0) * 1e-6;
+  // The workers counted the cache lookups in their own counters
+  InstrCount[INSTR_CACHEHIT] += b.hits;
+  InstrCount[INSTR_CACHEMISS] += b.misses;
+
+  // Close the streams (the output one may fail on its last write)
+  ImageStreamClose(&b.in);
+  errno = 0;
+  if (!ImageStreamClose(&b.out) && !err) err = 4;
+
+  if (!err) {
+    long files = b.stage[WRITE].items;
+    printf("# Batch: %ld files (%ld failed) in %.3f s: %.1f files/s\n",
+           files, b.failed, wall, wall > 0.0 ? files / wall : 0.0);
+    printf("# %-6s %8s %8s %12s\n", "stage", "threads", "files", "utilisation");
+    for (int s = 0; s < NUMSTAGES; s++)
+      printf("# %-6s %8d %8ld %11.1f%%\n", b.stage[s].name, b.stage[s].threads,
+             b.stage[s].items,
+             wall > 0.0 ? 100.0 * b.stage[s].busy * 1e-6 / (wall * b.stage[s].threads) : 0.0);
+    if (b.cache != NULL) {
+      unsigned long hits = InstrCount[INSTR_CACHEHIT], misses = InstrCount[INSTR_CACHEMISS];
+      long entries;
+      long long bytes;
+      ResultCacheUsage(b.cache, &entries, &bytes);
+      printf("# Result cache: %lu hits, %lu misses (%.1f%% hit rate), %ld entries, %.1f MB\n",
+             hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+             entries, bytes / 1048576.0);
+    }
+    if (b.failed > 0) { err = 14; errno = 0; }
+  }
+
+  if (queues > 0) batchQueueDestroy(&b.loaded);
+  if (queues > 1) batchQueueDestroy(&b.done);
+  pthread_mutex_destroy(&b.lock);
+  pthread_cond_destroy(&b.progress);
+  ResultCacheClose(&b.cache);
+  free(b.ops);
+  free(b.early);
+  free(threads);
+  for (long i = 0; i < b.nnames; i++) free(b.names[i]);
+  free(b.names);
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  int k = 1;
+  if (k + 1 < ac && strcmp(av[k], "--trace") == 0) {
+    if (!TraceOpen(av[k+1])) error(8, errno, errors[8]);
+    TraceThreadName("imageTool");
+    k += 2;
+  }
+  if (k < ac && strcmp(av[k], "--batch") == 0) {
+    int err = batchMain(ac - k - 1, av + k + 1);
+    PoolTrim();
+    if (!TraceClose() && err == 0) err = 8;
+    error(err, errno, errors[err], errCause(err));
+    return 0;
+  }
+  if (k < ac && strcmp(av[k], "--server") == 0) {
+    int err = serverMain(ac - k - 1, av + k + 1);
+    PoolTrim();
+    if (!TraceClose() && err == 0) err = 8;
+    error(err, errno, errors[err], errCause(err));
+    return 0;
+  }
+
+  int async = 0;
+  if (k < ac && strcmp(av[k], "--async") == 0) {
+    async = 1;
+    k++;
+  }
+  Pipeline p = { .out = stdout, .verbose = 1, .server = 0, .async = async };
+  int err = runPipeline(&p, ac - k, av + k);
+  note(&p, "Plan: %d allocations, peak %ld pixel bytes "
+           "(without plan: %d allocations, peak %ld pixel bytes)\n",
+       p.allocs, p.peak, p.naiveAllocs, p.naivePeak);
+
+  // Destroy remaining images
+  clearPipeline(&p);
+  free(p.img);
+  free(p.lastuse);
+  free(p.saves);
+  PoolTrim();
+
+  if (!TraceClose() && err == 0) err = 8;
+
+  error(err, errno, errors[err], errCause(err));
+  return 0;
+}
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates on first use
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -20,8 +20,12 @@
 /// InstrPrint();  // to show time and counters
 
 #include "instrumentation.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -68,24 +72,28 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+_Static_assert(INSTR_USED <= NUMCOUNTERS, "too many counters");
+
+/// Array of operation counters (one per thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset of this thread (~seconds)
+_Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+/// Nonzero once InstrCTU has been determined
+int InstrCalibrated = 0;  ///extern
+
+// Run and time a loop of basic memory and arithmetic operations.
+// Returns the cpu time it took (~seconds).
+static double calibrationLoop(void) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
@@ -98,32 +106,308 @@ void InstrCalibrate(void) { ///
     array[k] ^= array[i] + array[j] + i*j;
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  return cpu_time() - time;
+}
+
+// Read the first line of file fname that starts with prefix (or the first
+// line, if prefix is NULL) into buf, without the prefix and the newline.
+// Returns 1 on success, 0 otherwise.
+static int readLine(const char* fname, const char* prefix, char* buf, size_t size) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) return 0;
+  size_t plen = prefix == NULL ? 0 : strlen(prefix);
+  char line[512];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    if (plen > 0 && strncmp(line, prefix, plen) != 0) continue;
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(buf, size, "%s", line + plen);
+    found = 1;
+  }
+  fclose(f);
+  return found;
+}
+
+// Build the key that identifies this machine configuration in the cache:
+// the CPU model and the frequency governor, which both affect the CTU.
+static void calibrationKey(char* key, size_t size) {
+  char model[256] = "unknown";
+  char governor[64] = "none";
+  if (!readLine("/proc/cpuinfo", "model name\t: ", model, sizeof(model)))
+    readLine("/proc/cpuinfo", "cpu model\t\t: ", model, sizeof(model));
+  readLine("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", NULL,
+           governor, sizeof(governor));
+  snprintf(key, size, "%s|%s", model, governor);
+  // Keep the key in a single field of the cache file
+  for (char* p = key; *p != '\0'; p++)
+    if (*p == '\t' || *p == '\n') *p = ' ';
+}
+
+// Name of the calibration cache file:
+// $INSTR_CTU_CACHE, or $XDG_CACHE_HOME/instr-ctu, or $HOME/.cache/instr-ctu.
+// Returns 0 if no suitable name exists.
+static int calibrationCacheName(char* fname, size_t size) {
+  const char* env;
+  if ((env = getenv("INSTR_CTU_CACHE")) != NULL)
+    return snprintf(fname, size, "%s", env) < (int)size && env[0] != '\0';
+  if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+    return snprintf(fname, size, "%s/instr-ctu", env) < (int)size;
+  if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    return snprintf(fname, size, "%s/.cache/instr-ctu", env) < (int)size;
+  return 0;
+}
+
+// Look up key in the cache file.  Each line holds "KEY<TAB>CTU".
+// Returns the cached CTU, or 0.0 if not found.
+static double calibrationCacheGet(const char* fname, const char* key) {
+  char prefix[512 + 2];
+  char value[64];
+  snprintf(prefix, sizeof(prefix), "%s\t", key);
+  double ctu;
+  if (readLine(fname, prefix, value, sizeof(value)) &&
+      sscanf(value, "%lf", &ctu) == 1 && ctu > 0.0)
+    return ctu;
+  return 0.0;
+}
+
+// Create the directories in the path of file fname, as mkdir -p.
+// Failures are left for the caller to find, when it opens the file.
+static void makeParents(const char* fname) {
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", fname);
+  for (char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(dir, 0777);   // EEXIST for the directories already there
+    *p = '/';
+  }
+}
+
+// Store (key, ctu) in the cache file, keeping entries for other keys.
+// The file is replaced atomically, so concurrent runs never see a partial
+// cache.  Failures are ignored: the cache is only an optimization.
+static void calibrationCachePut(const char* fname, const char* key, double ctu) {
+  char tmpname[4096 + 32];
+  snprintf(tmpname, sizeof(tmpname), "%s.%ld", fname, (long)getpid());
+  makeParents(fname);   // ~/.cache may not exist yet on a fresh machine
+  FILE* out = fopen(tmpname, "w");
+  if (out == NULL) return;
+  FILE* in = fopen(fname, "r");
+  if (in != NULL) {
+    size_t klen = strlen(key);
+    char line[512];
+    while (fgets(line, sizeof(line), in) != NULL)
+      if (!(strncmp(line, key, klen) == 0 && line[klen] == '\t'))
+        fputs(line, out);
+    fclose(in);
+  }
+  fprintf(out, "%s\t%.9g\n", key, ctu);
+  if (fclose(out) != 0 || rename(tmpname, fname) != 0)
+    remove(tmpname);
+}
+
+/// Find the Calibrated Time Unit (CTU).
+/// The CTU is taken from the environment variable INSTR_CTU (seconds),
+/// if set, or from the calibration cache file, if it has an entry for this
+/// CPU model and frequency governor.
+/// Otherwise, run and time a loop of basic memory and arithmetic operations
+/// to set a reasonably cpu-independent time unit, and store it in the cache.
+void InstrCalibrate(void) { ///
+  const char* env = getenv("INSTR_CTU");
+  double ctu;
+  if (env != NULL && sscanf(env, "%lf", &ctu) == 1 && ctu > 0.0) {
+    InstrCTU = ctu;
+    __atomic_store_n(&InstrCalibrated, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  char key[512];
+  char fname[4096];
+  calibrationKey(key, sizeof(key));
+  int cached = calibrationCacheName(fname, sizeof(fname));
+  if (cached && (ctu = calibrationCacheGet(fname, key)) > 0.0) {
+    InstrCTU = ctu;
+  } else {
+    InstrCTU = calibrationLoop();
+    if (cached)
+      calibrationCachePut(fname, key, InstrCTU);
+  }
+  __atomic_store_n(&InstrCalibrated, 1, __ATOMIC_RELEASE);
+}
+
+// Calibrate once, even if several threads print at the same time.
+static pthread_once_t calibrateOnce = PTHREAD_ONCE_INIT;
+
+static void calibrateIfNeeded(void) {
+  if (!__atomic_load_n(&InstrCalibrated, __ATOMIC_ACQUIRE))
+    InstrCalibrate();
+}
+
+/// Names of the hardware counters:
+const char* InstrHWName[NUMHWCOUNTERS] = {  ///extern
+  "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses",
+  "dTLB-misses",
+};
+
+/// Hardware counter values since last reset, updated by InstrHWRead.
+_Thread_local long long InstrHWCount[NUMHWCOUNTERS];  ///extern
+
+#if defined(__linux__) && !defined(INSTR_NO_PERF)
+
+//
+// GNU/Linux hardware counters, using perf_event_open(2)
+//
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// File descriptors of the opened counters (-1 if unavailable), shared by
+// all threads and opened once
+static int hwfd[NUMHWCOUNTERS];
+static pthread_once_t hwonce = PTHREAD_ONCE_INIT;
+// Nonzero once this thread has reset the counters
+static _Thread_local int hwstarted = 0;
+// Counter values at the last reset of this thread
+static _Thread_local long long hwbase[NUMHWCOUNTERS];
+
+// Build the perf config for a cache event.
+#define HWCACHE(cache, op, result) \
+  ((cache) | ((op) << 8) | ((result) << 16))
+
+static void hwOpen(void) {
+  static const struct { unsigned type; unsigned long long config; } ev[NUMHWCOUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_L1D,
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_LL,
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, HWCACHE(PERF_COUNT_HW_CACHE_DTLB,
+        PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  };
+  const char* env = getenv("INSTR_PERF");
+  int enabled = !(env != NULL && strcmp(env, "0") == 0);
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    hwfd[i] = -1;
+    if (!enabled) continue;
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = ev[i].type;
+    attr.config = ev[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;         // also count threads created afterwards
+    attr.exclude_kernel = 1;  // allowed with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    hwfd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (hwfd[i] >= 0)
+      ioctl(hwfd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+// Read the running total of counter i (-1 if unavailable).
+static long long hwValue(int i) {
+  unsigned long long v[3];  // value, time enabled, time running
+  if (hwfd[i] < 0 || read(hwfd[i], v, sizeof(v)) != sizeof(v))
+    return -1;
+  // Scale up if the kernel had to multiplex the counters.
+  if (v[2] > 0 && v[2] < v[1])
+    v[0] = (unsigned long long)((double)v[0] * v[1] / v[2]);
+  return (long long)v[0];
+}
+
+// The counters are never reset, as other threads may be using them:
+// each thread keeps the values at its own last reset instead.
+static void hwReset(void) {
+  pthread_once(&hwonce, hwOpen);
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    hwbase[i] = hwValue(i);
+  hwstarted = 1;
+}
+
+// Stop (enable == 0) or restart the hardware counters, keeping their values.
+static void hwEnable(int enable) {
+  for (int i = 0; hwstarted && i < NUMHWCOUNTERS; i++)
+    if (hwfd[i] >= 0)
+      ioctl(hwfd[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+int InstrHWRead(void) { ///
+  int n = 0;
+  for (int i = 0; i < NUMHWCOUNTERS; i++) {
+    InstrHWCount[i] = -1;
+    if (!hwstarted || hwbase[i] < 0) continue;
+    long long v = hwValue(i);
+    if (v < 0) continue;
+    InstrHWCount[i] = v - hwbase[i];
+    n++;
+  }
+  return n;
+}
+
+#else
+
+static void hwReset(void) {
+}
+
+static void hwEnable(int enable) {
+  (void)enable;
+}
+
+int InstrHWRead(void) { ///
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    InstrHWCount[i] = -1;
+  return 0;
 }
 
+#endif
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  hwReset();
   InstrTime = cpu_time();
 }
 
-// Print times and all named counter values
-void InstrPrint(void) { ///
+// Print times and all named counter values to stream f
+void InstrFPrint(FILE* f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
+  InstrHWRead();
+  // calibrate on first use, after reading the counters it would disturb,
+  // and leave it out of the interval, for the next InstrPrint:
+  if (!__atomic_load_n(&InstrCalibrated, __ATOMIC_ACQUIRE)) {
+    hwEnable(0);
+    double t0 = cpu_time();
+    pthread_once(&calibrateOnce, calibrateIfNeeded);
+    InstrTime += cpu_time() - t0;
+    hwEnable(1);
+  }
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  fprintf(f, "#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+      fprintf(f, "\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (InstrHWCount[i] >= 0)
+      fprintf(f, "\t%15.15s", InstrHWName[i]);
+  fputc('\n', f);
+  fprintf(f, "%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+      fprintf(f, "\t%15lu", InstrCount[i]);  
+  for (int i = 0; i < NUMHWCOUNTERS; i++)
+    if (InstrHWCount[i] >= 0)
+      fprintf(f, "\t%15lld", InstrHWCount[i]);
+  fputc('\n', f);
 }
 
+// Print times and all named counter values
+void InstrPrint(void) { ///
+  InstrFPrint(stdout);
+}
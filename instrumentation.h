@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional: InstrPrint calibrates on first use
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,37 +18,90 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Each thread has its own counters and reset time, so threads may count
+/// and print independently.  Work done for a thread by helper threads
+/// must be counted by the thread itself.
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counters used by the modules of this program (indices in InstrCount).
+/// They are all defined here, so that no two modules use the same one.
+enum {
+  INSTR_PIXMEM,     // pixel array accesses (image8bit)
+  INSTR_POOLHIT,    // pixel buffers reused from the pool (image8bit)
+  INSTR_POOLMISS,   // pixel buffers newly allocated (image8bit)
+  INSTR_COWCOPY,    // copies of shared pixel buffers (image8bit)
+  INSTR_CACHEHIT,   // results found in the result cache (resultCache)
+  INSTR_CACHEMISS,  // results not found in the result cache (resultCache)
+  INSTR_USED        // number of counters used
+};
+
+/// Array of operation counters (one per thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset of this thread (~seconds)
+extern _Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
+/// Nonzero once InstrCTU has been determined
+extern int InstrCalibrated;  ///extern
+
 /// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
+/// The CTU is taken from the environment variable INSTR_CTU (seconds),
+/// if set, or from the calibration cache file, if it has an entry for this
+/// CPU model and frequency governor.
+/// Otherwise, run and time a loop of basic memory and arithmetic operations
+/// to set a reasonably cpu-independent time unit, and store it in the cache.
+/// The cache file is $INSTR_CTU_CACHE, or $XDG_CACHE_HOME/instr-ctu,
+/// or $HOME/.cache/instr-ctu (its directory is created if needed).
+/// InstrPrint calls this automatically, if it was not called before, and
+/// leaves the time it takes out of the interval since InstrReset.
 void InstrCalibrate(void) ;
 
+/// Hardware performance counters.
+/// On Linux, InstrReset also (re)starts a set of hardware counters using
+/// perf_event_open(2), and InstrPrint shows their values as extra columns.
+/// Counters the kernel refuses to open (no PMU, perf_event_paranoid,
+/// containers...) are silently left out.
+/// These count the whole process, not just the calling thread.
+/// Define INSTR_NO_PERF at compile time, or set the environment variable
+/// INSTR_PERF=0, to disable this backend.
+#define NUMHWCOUNTERS 6
+
+/// Names of the hardware counters:
+extern const char* InstrHWName[NUMHWCOUNTERS];  ///extern
+
+/// Hardware counter values since the last reset of this thread, updated
+/// by InstrHWRead.  Unavailable counters are set to -1.
+extern _Thread_local long long InstrHWCount[NUMHWCOUNTERS];  ///extern
+
+/// Read hardware counters into InstrHWCount.
+/// Returns the number of counters available (0 if none).
+int InstrHWRead(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times, named counters and available hardware counters.
 void InstrPrint(void) ;
 
+/// Same as InstrPrint, but print to stream f.
+void InstrFPrint(FILE* f) ;
+
 #endif
 
@@ -0,0 +1,144 @@
+/// parallel - A minimal parallel loop.
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+// Maximum number of threads (including the calling thread)
+#define MAXTHREADS 256
+
+int ParallelThreads(void)
+{ ///
+  static int nthreads = 0;
+  int n = __atomic_load_n(&nthreads, __ATOMIC_RELAXED);
+  if (n > 0)
+    return n;
+  const char* env = getenv("PARALLEL_THREADS");
+  if (env == NULL || sscanf(env, "%d", &n) != 1 || n < 1)
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > MAXTHREADS) n = MAXTHREADS;
+  __atomic_store_n(&nthreads, n, __ATOMIC_RELAXED);
+  return n;
+}
+
+// A loop shared by all threads: items are taken from next, one at a time.
+typedef struct loop {
+  const char* name;
+  int n;
+  int next;
+  void (*fn)(void* arg, int i);
+  void* arg;
+  int want;            // helpers that may still join (protected by lock)
+  int busy;            // helpers running items of the loop (protected by lock)
+  struct loop* link;   // next loop waiting for helpers (protected by lock)
+} Loop;
+
+// The pool of helper threads, started on the first ParallelFor and kept
+// for the whole program.  Loops waiting for helpers are in a list, so
+// that several threads may run parallel loops at the same time.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;  // a loop was added
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;  // a helper left a loop
+static pthread_once_t started = PTHREAD_ONCE_INIT;
+static int nhelpers = 0;      // helper threads running
+static Loop* loops = NULL;    // loops waiting for helpers
+
+// Run items of loop until there are none left.
+static void runLoop(Loop* loop)
+{
+  double t0 = TraceOn ? TraceNow() : 0.0;
+  int count = 0;
+  int i;
+  while ((i = __atomic_fetch_add(&loop->next, 1, __ATOMIC_RELAXED)) < loop->n) {
+    loop->fn(loop->arg, i);
+    count++;
+  }
+  if (TraceOn && count > 0) {
+    char args[32];
+    snprintf(args, sizeof(args), "\"items\": %d", count);
+    TraceSpan(loop->name, t0, TraceNow(), args);
+  }
+}
+
+// Remove loop from the list of loops waiting for helpers (with lock held).
+static void unlinkLoop(Loop* loop)
+{
+  for (Loop** p = &loops; *p != NULL; p = &(*p)->link)
+    if (*p == loop) {
+      *p = loop->link;
+      break;
+    }
+}
+
+// Helper thread: join the loops in the list, one at a time.
+static void* helper(void* unused)
+{
+  (void)unused;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (loops == NULL)
+      pthread_cond_wait(&work, &lock);
+    Loop* loop = loops;
+    if (--loop->want == 0)
+      unlinkLoop(loop);  // enough helpers
+    loop->busy++;
+    pthread_mutex_unlock(&lock);
+    runLoop(loop);
+    pthread_mutex_lock(&lock);
+    if (--loop->busy == 0)
+      pthread_cond_broadcast(&done);
+  }
+  return NULL;
+}
+
+// Start the helper threads, as many as can be created.
+static void startHelpers(void)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t t;
+  int n = 0;
+  while (n < ParallelThreads() - 1 && pthread_create(&t, &attr, helper, NULL) == 0)
+    n++;
+  pthread_attr_destroy(&attr);
+  pthread_mutex_lock(&lock);
+  nhelpers = n;
+  pthread_mutex_unlock(&lock);
+}
+
+void ParallelFor(const char* name, int n, void (*fn)(void* arg, int i), void* arg)
+{ ///
+  Loop loop = { name, n, 0, fn, arg, 0, 0, NULL };
+  int nthreads = ParallelThreads();
+  if (nthreads > n) nthreads = n;
+  if (nthreads > 1) {
+    pthread_once(&started, startHelpers);
+    pthread_mutex_lock(&lock);
+    loop.want = nthreads - 1 < nhelpers ? nthreads - 1 : nhelpers;
+    if (loop.want > 0) {
+      loop.link = loops;
+      loops = &loop;
+      if (loop.want == 1)
+        pthread_cond_signal(&work);
+      else
+        pthread_cond_broadcast(&work);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  runLoop(&loop);
+  if (nthreads > 1) {
+    // Let no more helpers join, and wait for those still running items
+    pthread_mutex_lock(&lock);
+    if (loop.want > 0)
+      unlinkLoop(&loop);
+    while (loop.busy > 0)
+      pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+  }
+}
@@ -0,0 +1,28 @@
+/// parallel - A minimal parallel loop.
+///
+/// ParallelFor runs fn(arg, i) for i in 0..n-1, spread over several
+/// threads, and returns when all calls are done.  Calls for different i
+/// may run concurrently and in any order, so they must not depend on each
+/// other (typically, each i is a disjoint part of an image).
+///
+/// The number of threads is the number of online CPUs, unless the
+/// environment variable PARALLEL_THREADS sets it.
+/// Helper threads are started on the first call and kept waiting for the
+/// next loops, so a call costs a wake-up, not a thread creation.  Several
+/// threads may run loops at the same time: they share the helpers.
+/// While a trace is open (see trace.h), each thread records one span with
+/// the number of items it ran.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/// Number of threads ParallelFor uses (at least 1).
+int ParallelThreads(void) ;
+
+/// Run fn(arg, i) for every i in 0..n-1, in parallel.
+///   name : span name for tracing.
+/// The calling thread takes part in the work.  If helper threads cannot be
+/// created, the remaining work runs in the calling thread: never fails.
+void ParallelFor(const char* name, int n, void (*fn)(void* arg, int i), void* arg) ;
+
+#endif
@@ -0,0 +1,248 @@
+/// pgmReader - Buffered reading of PGM files.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "pgmReader.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Size of the buffer
+#define READBUF 65536
+
+// The buffer always has a 0 after the valid data, so that parsing loops
+// stop there.
+struct pgmReader {
+  FILE* f;
+  size_t pos;       // next unread byte in buf
+  size_t len;       // end of the valid data in buf
+  int eof;          // end of file (or read error) reached
+  long long fpos;   // file position after the end of the valid data
+  uint8_t buf[READBUF + 1];
+};
+
+PgmReader PgmReaderCreate(FILE* f)
+{ ///
+  PgmReader r = malloc(sizeof(struct pgmReader));
+  if (r == NULL)
+    return NULL;
+  r->f = f;
+  r->pos = r->len = 0;
+  r->eof = 0;
+  r->fpos = ftello(f);
+  r->buf[0] = 0;
+  return r;
+}
+
+void PgmReaderDestroy(PgmReader* rp)
+{ ///
+  assert(rp != NULL);
+  free(*rp);
+  *rp = NULL;
+}
+
+// Move the unread bytes to the start of buf and read more bytes after them.
+static void fill(PgmReader r)
+{
+  size_t rest = r->len - r->pos;
+  memmove(r->buf, r->buf + r->pos, rest);
+  size_t n = fread(r->buf + rest, 1, READBUF - rest, r->f);
+  r->pos = 0;
+  r->len = rest + n;
+  r->eof = n < READBUF - rest;
+  r->fpos += (long long)n;
+  r->buf[r->len] = 0;
+}
+
+// Make sure that at least n bytes are buffered after pos, unless the file
+// ends before that.
+static inline void need(PgmReader r, size_t n)
+{
+  if (r->len - r->pos < n && !r->eof)
+    fill(r);
+}
+
+// Whitespace, as in the PGM specification (the same as isspace).
+static inline int isWhite(uint8_t c)
+{
+  return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+int PgmReadMagic(PgmReader r, int* plain)
+{ ///
+  need(r, 2);
+  if (r->len - r->pos < 2 || r->buf[r->pos] != 'P' ||
+      (r->buf[r->pos + 1] != '5' && r->buf[r->pos + 1] != '2'))
+    return 0;
+  *plain = r->buf[r->pos + 1] == '2';
+  r->pos += 2;
+  return 1;
+}
+
+int PgmSkipComments(PgmReader r)
+{ ///
+  int i = 0;
+  for (;;) {
+    need(r, 1);
+    if (r->pos == r->len)
+      return i;
+    uint8_t c = r->buf[r->pos];
+    if (c == '#') {
+      // Skip to the end of the line
+      i++;
+      do {
+        r->pos++;
+        need(r, 1);
+      } while (r->pos < r->len && r->buf[r->pos] != '\n');
+    } else if (isWhite(c)) {
+      r->pos++;
+    } else {
+      return i;
+    }
+  }
+}
+
+int PgmSkipOneWhite(PgmReader r)
+{ ///
+  need(r, 1);
+  if (r->pos == r->len || !isWhite(r->buf[r->pos]))
+    return 0;
+  r->pos++;
+  return 1;
+}
+
+// Parse a decimal number with at most 9 digits at the current position.
+// On success, returns nonzero and sets *v.
+// The common case is done in a 64-bit word, 8 characters at once (SWAR):
+// find the first character that is not a digit, and add up the digits
+// before it with 3 multiplications.
+static inline int readNumber(PgmReader r, int* v)
+{
+  need(r, 16);
+  const uint8_t* p = r->buf + r->pos;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (r->len - r->pos >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    uint64_t t = word ^ 0x3030303030303030ULL;  // '0'..'9' -> 0..9
+    // Bit 7 of each byte that is not a digit (t >= 10)
+    uint64_t nondigit = (t | (t + 0x7676767676767676ULL)) & 0x8080808080808080ULL;
+    if (nondigit != 0) {
+      int len = __builtin_ctzll(nondigit) / 8;  // number of digits
+      if (len == 0)
+        return 0;
+      t <<= 8 * (8 - len);  // right-align the digits (leading zeros)
+      t = (t * 10 + (t >> 8)) & 0x00FF00FF00FF00FFULL;
+      t = (t * (1 + (100ULL << 16))) >> 16 & 0x0000FFFF0000FFFFULL;
+      t = (t * (1 + (10000ULL << 32))) >> 32;
+      *v = (int)t;
+      r->pos += len;
+      return 1;
+    }
+  }
+#endif
+  const uint8_t* start = p;
+  if ((unsigned)(*p - '0') > 9)
+    return 0;
+  int n = 0;
+  while ((unsigned)(*p - '0') <= 9 && p - start < 9)
+    n = 10 * n + (*p++ - '0');
+  if ((unsigned)(*p - '0') <= 9)
+    return 0;  // too many digits
+  *v = n;
+  r->pos += (size_t)(p - start);
+  return 1;
+}
+
+int PgmReadNumber(PgmReader r, int* v)
+{ ///
+  return readNumber(r, v);
+}
+
+int PgmReadBytes(PgmReader r, void* dst, size_t n)
+{ ///
+  // The buffered bytes first, and then the rest directly from the file
+  size_t k = r->len - r->pos < n ? r->len - r->pos : n;
+  memcpy(dst, r->buf + r->pos, k);
+  r->pos += k;
+  if (k == n)
+    return 1;
+  size_t got = fread((uint8_t*)dst + k, 1, n - k, r->f);
+  r->fpos += (long long)got;
+  return got == n - k;
+}
+
+int PgmSkipBytes(PgmReader r, size_t n)
+{ ///
+  size_t k = r->len - r->pos < n ? r->len - r->pos : n;
+  r->pos += k;
+  if (k == n)
+    return 1;
+  // fseeko past the end of a file succeeds: check it against the file size
+  long long target = r->fpos + (long long)(n - k);
+  struct stat st;
+  if (fstat(fileno(r->f), &st) == 0 && S_ISREG(st.st_mode) && target > (long long)st.st_size) {
+    r->eof = 1;
+    return 0;
+  }
+  return PgmSeek(r, target);
+}
+
+int PgmAtEnd(PgmReader r)
+{ ///
+  need(r, 1);
+  return r->pos == r->len;
+}
+
+long long PgmTell(PgmReader r)
+{ ///
+  return r->fpos - (long long)(r->len - r->pos);
+}
+
+int PgmSeek(PgmReader r, long long offset)
+{ ///
+  if (fseeko(r->f, (off_t)offset, SEEK_SET) != 0)
+    return 0;
+  r->pos = r->len = 0;
+  r->eof = 0;
+  r->fpos = offset;
+  r->buf[0] = 0;
+  return 1;
+}
+
+// Skip the whitespace before a level (it may cross the end of the buffer),
+// and parse the level.
+static inline int readLevel(PgmReader r, int* v)
+{
+  do {
+    need(r, 16);
+    while (r->pos < r->len && isWhite(r->buf[r->pos]))
+      r->pos++;
+  } while (r->pos == r->len && !r->eof);
+  return readNumber(r, v);
+}
+
+int PgmReadPlain8(PgmReader r, uint8_t* dst, int n, int maxval)
+{ ///
+  for (int i = 0; i < n; i++) {
+    int v;
+    if (!readLevel(r, &v) || v > maxval)
+      return 0;
+    dst[i] = (uint8_t)v;
+  }
+  return 1;
+}
+
+int PgmReadPlain16(PgmReader r, uint16_t* dst, int n, int maxval)
+{ ///
+  for (int i = 0; i < n; i++) {
+    int v;
+    if (!readLevel(r, &v) || v > maxval)
+      return 0;
+    dst[i] = (uint16_t)v;
+  }
+  return 1;
+}
@@ -0,0 +1,78 @@
+/// pgmReader - Buffered reading of PGM files.
+///
+/// The header and the levels of plain (P2) files are parsed directly from
+/// a buffer, instead of with fscanf, and raw (P5) samples are read in bulk.
+/// This module is shared by the image8bit and image16bit modules, which
+/// use the functions below to parse each header field in turn, and then
+/// read the samples row by row.
+///
+/// Several images may be read in turn from one file (a PGM stream), and
+/// PgmTell and PgmSeek allow going back to any of them.
+///
+/// Reading functions return nonzero on success, or 0 if the expected item
+/// is not there (invalid format, end of file, or read error), leaving the
+/// error message to the caller.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef PGMREADER_H
+#define PGMREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Type PgmReader is a pointer to reader objects
+typedef struct pgmReader *PgmReader;
+
+/// Create a reader for file f, which must be open for reading.
+/// The reader does not close f.
+/// On failure, returns NULL and errno is set.
+PgmReader PgmReaderCreate(FILE* f) ;
+
+/// Destroy the reader pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void PgmReaderDestroy(PgmReader* rp) ;
+
+/// Parse the magic number: P5 (raw) or P2 (plain).
+/// On success, (*plain) is set to 1 for plain files, 0 for raw files.
+int PgmReadMagic(PgmReader r, int* plain) ;
+
+/// Match and skip whitespace and comments, which may appear between
+/// header fields.
+/// Comments start with a # and continue until the end-of-line, inclusive.
+/// Returns the number of comments skipped.
+int PgmSkipComments(PgmReader r) ;
+
+/// Parse a decimal number with at most 9 digits into (*v).
+int PgmReadNumber(PgmReader r, int* v) ;
+
+/// Match and skip the single whitespace character that ends the header.
+int PgmSkipOneWhite(PgmReader r) ;
+
+/// Read n bytes of raw samples into dst.
+int PgmReadBytes(PgmReader r, void* dst, size_t n) ;
+
+/// Skip n bytes of raw samples (seeking past those not buffered).
+/// Returns 0 if the file (a regular file) ends before those n bytes.
+int PgmSkipBytes(PgmReader r, size_t n) ;
+
+/// Check if the end of the file was reached (no more bytes to read).
+int PgmAtEnd(PgmReader r) ;
+
+/// File position of the next byte to read.
+long long PgmTell(PgmReader r) ;
+
+/// Move to file position offset (as given by PgmTell), for the next read.
+int PgmSeek(PgmReader r, long long offset) ;
+
+/// Read n levels of a plain file into dst.
+/// Fails if a level is missing or above maxval.
+int PgmReadPlain8(PgmReader r, uint8_t* dst, int n, int maxval) ;
+
+/// Same as PgmReadPlain8, for levels up to 65535.
+int PgmReadPlain16(PgmReader r, uint16_t* dst, int n, int maxval) ;
+
+#endif
@@ -0,0 +1,152 @@
+/// pixelKernels - Pixel loops, generated once per pixel type.
+///
+/// This file is a template, included by image8bit.c and image16bit.c
+/// after defining:
+///   PIXEL         the pixel type (uint8 or uint16)
+///   PIXELSUM      the type used to add up pixels (in blurRows)
+///   KERNEL(name)  the name of a kernel for this pixel type
+///                 (e.g. name##8, so that negativeRow becomes negativeRow8)
+/// Each kernel is a plain loop over a row (or a block of rows) of pixels,
+/// which the compiler vectorizes for the width it is generated for, so the
+/// 8-bit and the 16-bit images get their own kernels from the same code.
+/// Strides are in pixels.
+///
+/// Do not include it anywhere else!
+
+#if !defined(PIXEL) || !defined(PIXELSUM) || !defined(KERNEL)
+#error "define PIXEL, PIXELSUM and KERNEL before including pixelKernels.h"
+#endif
+
+#include <stddef.h>
+
+// Side of the square blocks used to rotate an image (cache blocking).
+#ifndef ROTBLOCK
+#define ROTBLOCK 64
+#endif
+
+// Transform n pixels to their negative.
+static inline void KERNEL(negativeRow)(PIXEL *r, int n, PIXEL maxval)
+{
+  for (int x = 0; x < n; x++)
+    r[x] = maxval - r[x];
+}
+
+// Transform n pixels to black (below thr) or white (maxval).
+static inline void KERNEL(thresholdRow)(PIXEL *r, int n, PIXEL thr, PIXEL maxval)
+{
+  for (int x = 0; x < n; x++)
+    r[x] = r[x] < thr ? 0 : maxval;
+}
+
+// Multiply n pixels by factor, rounding, and saturating at maxval.
+static inline void KERNEL(brightenRow)(PIXEL *r, int n, double factor, PIXEL maxval)
+{
+  for (int x = 0; x < n; x++)
+  {
+    double v = r[x] * factor;
+    r[x] = v > maxval ? maxval : (PIXEL)(v + 0.5);
+  }
+}
+
+// Update (*min) and (*max) with n pixels.
+static inline void KERNEL(minMaxRow)(const PIXEL *r, int n, PIXEL *min, PIXEL *max)
+{
+  PIXEL lo = *min, hi = *max;
+  for (int x = 0; x < n; x++)
+  {
+    if (hi < r[x])
+      hi = r[x];
+    if (lo > r[x])
+      lo = r[x];
+  }
+  *min = lo;
+  *max = hi;
+}
+
+// Copy n pixels from src to dst, in reverse order.
+static inline void KERNEL(mirrorRow)(PIXEL *restrict dst, const PIXEL *restrict src, int n)
+{
+  for (int x = 0; x < n; x++)
+    dst[n - x - 1] = src[x];
+}
+
+// Reverse the order of n pixels, in-place.
+static inline void KERNEL(reverseRow)(PIXEL *r, int n)
+{
+  for (int x = 0; x < n / 2; x++)
+  {
+    PIXEL left = r[x];
+    r[x] = r[n - x - 1];
+    r[n - x - 1] = left;
+  }
+}
+
+// Blend n pixels of src into dst, saturating at maxval.
+// (The blended level is converted to PIXEL before it is compared with maxval.)
+static inline void KERNEL(blendRow)(PIXEL *dst, const PIXEL *src, int n, double alpha, PIXEL maxval)
+{
+  for (int x = 0; x < n; x++)
+  {
+    PIXEL v = (PIXEL)(alpha * src[x] + (1.0 - alpha) * dst[x] + 0.5);
+    dst[x] = v > maxval ? maxval : v;
+  }
+}
+
+// Rotate the width x height pixels of src 90 degrees anti-clockwise,
+// into the height x width pixels of dst.
+// The pixels are visited in square blocks, so that the rows of src and
+// of dst of each block fit in the cache.
+static void KERNEL(rotateRows)(PIXEL *restrict dst, size_t dstStride,
+                               const PIXEL *restrict src, size_t srcStride,
+                               int width, int height)
+{
+  for (int y0 = 0; y0 < height; y0 += ROTBLOCK)
+    for (int x0 = 0; x0 < width; x0 += ROTBLOCK)
+    {
+      int y1 = y0 + ROTBLOCK < height ? y0 + ROTBLOCK : height;
+      int x1 = x0 + ROTBLOCK < width ? x0 + ROTBLOCK : width;
+      for (int y = y0; y < y1; y++)
+      {
+        const PIXEL *s = src + srcStride * y;
+        for (int x = x0; x < x1; x++)
+          dst[dstStride * (width - x - 1) + y] = s[x];
+      }
+    }
+}
+
+// Mean filter: each pixel of dst gets the mean of the pixels of src in the
+// rectangle [x-dx, x+dx]x[y-dy, y+dy], clipped to the image.
+// Returns the number of pixel accesses.
+static inline unsigned long KERNEL(blurRows)(PIXEL *restrict dst, size_t dstStride,
+                                      const PIXEL *restrict src, size_t srcStride,
+                                      int width, int height, int dx, int dy)
+{
+  unsigned long count = 0;
+  for (int i = 0; i < height; i++)
+  {
+    // usamos apenas as linhas do retangulo que estão dentro da imagem
+    int i0 = i - dy < 0 ? 0 : i - dy;
+    int i1 = i + dy >= height ? height - 1 : i + dy;
+    PIXEL *out = dst + dstStride * i;
+    for (int j = 0; j < width; j++)
+    {
+      int j0 = j - dx < 0 ? 0 : j - dx;
+      int j1 = j + dx >= width ? width - 1 : j + dx;
+      PIXELSUM sum = 0;
+      for (int k = i0; k <= i1; k++)
+      {
+        const PIXEL *r = src + srcStride * k;
+        for (int l = j0; l <= j1; l++)
+          sum += r[l];
+      }
+      int num = (i1 - i0 + 1) * (j1 - j0 + 1);
+      out[j] = (PIXEL)(int)(sum / num + 0.5);
+      count += (unsigned long)num + 1; // leituras do retangulo e escrita do pixel
+    }
+  }
+  return count;
+}
+
+#undef PIXEL
+#undef PIXELSUM
+#undef KERNEL
@@ -0,0 +1,183 @@
+/// pixelPool - A pool allocator for pixel buffers.
+///
+/// Buffers are grouped in size classes (4 per power of two, so at most 25%
+/// is wasted), aligned to POOL_ALIGN bytes, and freed buffers are kept in
+/// the pool to be reused by later allocations of the same class.
+
+#include "pixelPool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Each buffer is preceded by a header, padded to POOL_ALIGN bytes so that
+// the data stays aligned.  The reference count is last, just before the
+// data, where the inline PoolShared (pixelPool.h) finds it.
+typedef struct block {
+  struct block* next;  // next free block of the same class
+  size_t size;         // total size of the block, with the header
+  int cls;             // size class
+  int mapped;          // 1 if allocated with mmap, 0 with posix_memalign
+  int fresh;           // 1 if never used (mmap memory is zero-filled)
+  char pad[POOL_ALIGN - sizeof(void*) - sizeof(size_t) - 4 * sizeof(int)];
+  int refs;            // number of references (see PoolRetain)
+} Block;
+
+#define HEADER POOL_ALIGN
+_Static_assert(sizeof(Block) == HEADER, "refs must be just before the data");
+
+// Blocks at least this large are mmap'ed (and may use huge pages)
+#define MMAP_MIN (1ul << 20)
+#define HUGEPAGE (2ul << 20)
+
+// Size classes: 4 per power of two, up to 2^47 bytes
+#define NUMCLASSES (48 * 4)
+// Limits on the blocks kept in the pool
+#define MAXPERCLASS 8
+#define MAXCACHED (512ul << 20)
+
+static Block* freelist[NUMCLASSES];
+static int nfree[NUMCLASSES];
+static size_t cached = 0;   // bytes in free lists
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static int hugepages = -1;  // unknown yet
+
+// Size class of a buffer of size bytes.
+// Class c holds (5 + c%4) << (c/4 - 2) bytes: 80, 96, 112, 128, 160, ...
+static int sizeClass(size_t size)
+{
+  if (size < 64) size = 64;
+  size_t s = size - 1;
+  int e = 63 - __builtin_clzl(s);   // floor(log2(s)), >= 6
+  int sub = (int)((s >> (e - 2)) & 3);
+  return e * 4 + sub;
+}
+
+static size_t classSize(int cls)
+{
+  return (size_t)(5 + (cls & 3)) << ((cls >> 2) - 2);
+}
+
+// Get a new block from the system.
+static Block* newBlock(int cls)
+{
+  size_t size = HEADER + classSize(cls);
+  Block* b;
+  int mapped = size >= MMAP_MIN;
+  if (mapped) {
+    if (hugepages < 0) {
+      const char* env = getenv("POOL_HUGEPAGES");
+      hugepages = env != NULL && strcmp(env, "1") == 0;
+    }
+    if (hugepages) size = (size + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (hugepages) madvise(p, size, MADV_HUGEPAGE);
+#endif
+    b = p;
+  } else {
+    void* p;
+    int e = posix_memalign(&p, POOL_ALIGN, size);
+    if (e != 0) { errno = e; return NULL; }
+    b = p;
+  }
+  b->size = size;
+  b->cls = cls;
+  b->mapped = mapped;
+  b->fresh = 1;
+  return b;
+}
+
+static void freeBlock(Block* b)
+{
+  if (b->mapped)
+    munmap(b, b->size);
+  else
+    free(b);
+}
+
+// Get a block of class cls, from the pool if possible.
+static Block* getBlock(int cls, int* hit)
+{
+  if (cls >= NUMCLASSES) {  // larger than any class: cannot be allocated
+    if (hit != NULL) *hit = 0;
+    errno = ENOMEM;
+    return NULL;
+  }
+  pthread_mutex_lock(&poollock);
+  Block* b = freelist[cls];
+  if (b != NULL) {
+    freelist[cls] = b->next;
+    nfree[cls]--;
+    cached -= b->size;
+  }
+  pthread_mutex_unlock(&poollock);
+  if (hit != NULL) *hit = b != NULL;
+  if (b == NULL) b = newBlock(cls);
+  if (b != NULL) b->refs = 1;
+  return b;
+}
+
+void* PoolAlloc(size_t size, int* hit)
+{ ///
+  Block* b = getBlock(sizeClass(size), hit);
+  return b == NULL ? NULL : (char*)b + HEADER;
+}
+
+void* PoolCalloc(size_t size, int* hit)
+{ ///
+  Block* b = getBlock(sizeClass(size), hit);
+  if (b == NULL) return NULL;
+  void* ptr = (char*)b + HEADER;
+  // Fresh mmap'ed memory is already zero, and untouched: keep it that way.
+  if (!(b->fresh && b->mapped))
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+void PoolFree(void* ptr)
+{ ///
+  if (ptr == NULL) return;
+  Block* b = (Block*)((char*)ptr - HEADER);
+  assert(0 <= b->cls && b->cls < NUMCLASSES);
+  assert(b->refs > 0);
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;  // still referenced
+  b->fresh = 0;
+  pthread_mutex_lock(&poollock);
+  int keep = nfree[b->cls] < MAXPERCLASS && cached + b->size <= MAXCACHED;
+  if (keep) {
+    b->next = freelist[b->cls];
+    freelist[b->cls] = b;
+    nfree[b->cls]++;
+    cached += b->size;
+  }
+  pthread_mutex_unlock(&poollock);
+  if (!keep) freeBlock(b);
+}
+
+void PoolRetain(void* ptr)
+{ ///
+  Block* b = (Block*)((char*)ptr - HEADER);
+  assert(b->refs > 0);
+  __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void PoolTrim(void)
+{ ///
+  pthread_mutex_lock(&poollock);
+  for (int c = 0; c < NUMCLASSES; c++) {
+    while (freelist[c] != NULL) {
+      Block* b = freelist[c];
+      freelist[c] = b->next;
+      freeBlock(b);
+    }
+    nfree[c] = 0;
+  }
+  cached = 0;
+  pthread_mutex_unlock(&poollock);
+}
@@ -0,0 +1,51 @@
+/// pixelPool - A pool allocator for pixel buffers.
+///
+/// Buffers are grouped in size classes (4 per power of two, so at most 25%
+/// is wasted), aligned to POOL_ALIGN bytes, and freed buffers are kept in
+/// the pool to be reused by later allocations of the same class.
+/// This avoids the cost of going back to the system allocator and of
+/// page-faulting fresh memory, for programs that create and destroy many
+/// images of similar sizes.
+/// Large buffers may be backed by transparent huge pages: set the
+/// environment variable POOL_HUGEPAGES=1.
+///
+/// All functions are thread-safe.
+
+#ifndef PIXELPOOL_H
+#define PIXELPOOL_H
+
+#include <stddef.h>
+
+/// Alignment of all buffers (a cache line)
+#define POOL_ALIGN 64
+
+/// Allocate a buffer with at least size bytes, with undefined contents.
+/// If hit is not NULL, (*hit) is set to 1 if the buffer came from the pool,
+/// or 0 if it was newly allocated.
+/// On failure, returns NULL and errno is set.
+void* PoolAlloc(size_t size, int* hit) ;
+
+/// Same as PoolAlloc, but the buffer is filled with zeros.
+void* PoolCalloc(size_t size, int* hit) ;
+
+/// Return buffer ptr (from PoolAlloc or PoolCalloc) to the pool.
+/// If ptr is NULL, no operation is performed.
+/// If the buffer was shared with PoolRetain, this only drops one reference:
+/// the buffer goes back to the pool when the last reference is dropped.
+void PoolFree(void* ptr) ;
+
+/// Add a reference to buffer ptr, which must then be freed once more.
+void PoolRetain(void* ptr) ;
+
+/// Return nonzero if buffer ptr has more than one reference.
+/// Inline, as it is checked before every write to a possibly shared buffer:
+/// the reference count is the int just before the buffer.
+static inline int PoolShared(void* ptr)
+{ ///
+  return __atomic_load_n((int*)ptr - 1, __ATOMIC_ACQUIRE) > 1;
+}
+
+/// Release all buffers kept in the pool back to the system.
+void PoolTrim(void) ;
+
+#endif
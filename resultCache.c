@@ -0,0 +1,324 @@
+/// resultCache - A persistent cache of pipeline results.
+///
+/// Entries are indexed in memory (key, size, last use), and the least
+/// recently used ones are found by a linear scan when the size bound is
+/// exceeded: the cost is negligible next to the image files themselves.
+
+#include "resultCache.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "instrumentation.h"
+
+// First line of the .txt files (changed if the format of entries changes)
+#define MAGIC "imageTool result cache 1\n"
+
+// Room for "/KEY.tmpPID.N" after the directory name
+#define MAXDIR (PATH_MAX - 64)
+
+typedef struct {
+  uint64_t key;
+  long long bytes;   // size of both files
+  long long used;    // time of last use (ticks of the cache clock)
+} Entry;
+
+struct resultCache {
+  char* dir;
+  long long maxbytes;
+  long long bytes;   // total size of the entries
+  Entry* entries;
+  long n, cap;
+  long long clock;   // incremented on each use
+  unsigned long temps;  // temporary files created
+  pthread_mutex_t lock;
+};
+
+// Key of an entry: a hash of the input hash and the operations
+// (FNV-1a, with the splitmix64 finalizer).
+static uint64_t entryKey(uint64_t input, const char* ops) {
+  uint64_t h = 0xcbf29ce484222325ull ^ input;
+  for (const unsigned char* p = (const unsigned char*)ops; *p != '\0'; p++)
+    h = (h ^ *p) * 0x100000001b3ull;
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ h >> 31;
+}
+
+// Path of file ext ("pgm", "txt") of entry key, into path.
+static void entryPath(ResultCache c, uint64_t key, const char* ext, char* path) {
+  snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".%s", c->dir, key, ext);
+}
+
+// A new temporary file name for entry key, into path.
+static void tempPath(ResultCache c, uint64_t key, char* path) {
+  unsigned long n = __atomic_fetch_add(&c->temps, 1, __ATOMIC_RELAXED);
+  snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".tmp%ld.%lu", c->dir, key, (long)getpid(), n);
+}
+
+// Index of the entry with key in c, or -1.  (Called with the lock held.)
+static long findEntry(ResultCache c, uint64_t key) {
+  for (long i = 0; i < c->n; i++)
+    if (c->entries[i].key == key) return i;
+  return -1;
+}
+
+// Remove entry i of c and its files.  (Called with the lock held.)
+static void removeEntry(ResultCache c, long i) {
+  char path[PATH_MAX];
+  entryPath(c, c->entries[i].key, "txt", path);
+  unlink(path);   // first: the entry is no longer complete
+  entryPath(c, c->entries[i].key, "pgm", path);
+  unlink(path);
+  c->bytes -= c->entries[i].bytes;
+  c->entries[i] = c->entries[--c->n];
+}
+
+// Remove the least recently used entries until c is within its bound.
+// (Called with the lock held.)
+static void evict(ResultCache c) {
+  while (c->bytes > c->maxbytes && c->n > 0) {
+    long lru = 0;
+    for (long i = 1; i < c->n; i++)
+      if (c->entries[i].used < c->entries[lru].used) lru = i;
+    removeEntry(c, lru);
+  }
+}
+
+// Add (or update) entry key of c.  Returns 0 if out of memory.
+// (Called with the lock held.)
+static int addEntry(ResultCache c, uint64_t key, long long bytes, long long used) {
+  long i = findEntry(c, key);
+  if (i < 0) {
+    if (c->n == c->cap) {
+      long cap = c->cap > 0 ? 2 * c->cap : 256;
+      Entry* entries = realloc(c->entries, sizeof(Entry) * cap);
+      if (entries == NULL) return 0;
+      c->entries = entries;
+      c->cap = cap;
+    }
+    i = c->n++;
+    c->entries[i].key = key;
+    c->entries[i].bytes = 0;
+  }
+  c->bytes += bytes - c->entries[i].bytes;
+  c->entries[i].bytes = bytes;
+  c->entries[i].used = used;
+  return 1;
+}
+
+// Size of file path, or -1 if it does not exist.
+static long long fileBytes(const char* path, struct stat* st) {
+  return stat(path, st) == 0 ? (long long)st->st_size : -1;
+}
+
+static int cmpUsed(const void* a, const void* b) {
+  long long ua = ((const Entry*)a)->used, ub = ((const Entry*)b)->used;
+  return (ua > ub) - (ua < ub);
+}
+
+// Index the complete entries in the directory of c.  Returns 0 on failure.
+static int scanEntries(ResultCache c) {
+  DIR* d = opendir(c->dir);
+  if (d == NULL) return 0;
+  int ok = 1;
+  struct dirent* e;
+  while (ok && (e = readdir(d)) != NULL) {
+    if (strlen(e->d_name) != 20 || strcmp(e->d_name + 16, ".txt") != 0 ||
+        strspn(e->d_name, "0123456789abcdef") != 16)
+      continue;
+    uint64_t key = strtoull(e->d_name, NULL, 16);
+    char path[PATH_MAX];
+    struct stat txt, pgm;
+    entryPath(c, key, "txt", path);
+    long long bytes = fileBytes(path, &txt);
+    entryPath(c, key, "pgm", path);
+    long long pgmbytes = fileBytes(path, &pgm);
+    if (bytes < 0 || pgmbytes < 0) continue;
+    // Last use from the modification time, in nanoseconds
+    ok = addEntry(c, key, bytes + pgmbytes,
+                  (long long)txt.st_mtim.tv_sec * 1000000000 + txt.st_mtim.tv_nsec);
+  }
+  closedir(d);
+  if (!ok) errno = ENOMEM;
+  // Renumber the uses in order, as ticks of the cache clock
+  qsort(c->entries, c->n, sizeof(Entry), cmpUsed);
+  for (long i = 0; i < c->n; i++) c->entries[i].used = i + 1;
+  c->clock = c->n;
+  return ok;
+}
+
+ResultCache ResultCacheOpen(const char* dir, long long maxbytes) {
+  assert(dir != NULL);
+  assert(maxbytes >= 0);
+  if (strlen(dir) > MAXDIR) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) return NULL;
+  ResultCache c = calloc(1, sizeof(*c));
+  if (c == NULL) return NULL;
+  c->maxbytes = maxbytes;
+  pthread_mutex_init(&c->lock, NULL);
+  if ((c->dir = strdup(dir)) == NULL || !scanEntries(c)) {
+    int saved = errno;
+    ResultCacheClose(&c);
+    errno = saved;
+    return NULL;
+  }
+  evict(c);
+  InstrName[INSTR_CACHEHIT] = "cachehit";
+  InstrName[INSTR_CACHEMISS] = "cachemiss";
+  return c;
+}
+
+void ResultCacheClose(ResultCache* cp) {
+  assert(cp != NULL);
+  ResultCache c = *cp;
+  if (c == NULL) return;
+  pthread_mutex_destroy(&c->lock);
+  free(c->entries);
+  free(c->dir);
+  free(c);
+  *cp = NULL;
+}
+
+// Read the text file of an entry, checking that it is for input and ops.
+// Returns the text output in a new buffer, or NULL.
+static char* readText(const char* path, uint64_t input, const char* ops, size_t* outlen) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return NULL;
+  char* out = NULL;
+  size_t opslen = strlen(ops);
+  char* stored = malloc(opslen + 1);
+  char magic[sizeof(MAGIC)];
+  uint64_t hash;
+  size_t len, textlen;
+  if (stored != NULL && fread(magic, 1, sizeof(MAGIC) - 1, f) == sizeof(MAGIC) - 1 &&
+      memcmp(magic, MAGIC, sizeof(MAGIC) - 1) == 0 &&
+      fscanf(f, "input %" SCNx64 " ops %zu text %zu", &hash, &len, &textlen) == 3 &&
+      fgetc(f) == '\n' && hash == input && len == opslen &&
+      fread(stored, 1, len, f) == len && memcmp(stored, ops, len) == 0 &&
+      (out = malloc(textlen + 1)) != NULL) {
+    if (fread(out, 1, textlen, f) == textlen) {
+      out[textlen] = '\0';
+      *outlen = textlen;
+    } else {
+      free(out);
+      out = NULL;
+    }
+  }
+  free(stored);
+  fclose(f);
+  return out;
+}
+
+Image ResultCacheGet(ResultCache c, uint64_t input, const char* ops,
+                     char** out, size_t* outlen) {
+  assert(c != NULL);
+  assert(ops != NULL);
+  assert(out != NULL && outlen != NULL);
+  uint64_t key = entryKey(input, ops);
+  pthread_mutex_lock(&c->lock);
+  int found = findEntry(c, key) >= 0;
+  pthread_mutex_unlock(&c->lock);
+
+  Image img = NULL;
+  char path[PATH_MAX];
+  int saved = errno;
+  if (found) {
+    entryPath(c, key, "txt", path);
+    char* text = readText(path, input, ops, outlen);
+    entryPath(c, key, "pgm", path);
+    if (text != NULL && (img = ImageLoad(path)) != NULL) {
+      *out = text;
+      entryPath(c, key, "txt", path);
+      utimensat(AT_FDCWD, path, NULL, 0);  // recency, for other processes
+    } else {
+      free(text);
+    }
+  }
+  errno = saved;
+
+  pthread_mutex_lock(&c->lock);
+  long i = findEntry(c, key);
+  if (img != NULL) {
+    InstrCount[INSTR_CACHEHIT]++;
+    if (i >= 0) c->entries[i].used = ++c->clock;
+  } else {
+    InstrCount[INSTR_CACHEMISS]++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return img;
+}
+
+int ResultCachePut(ResultCache c, uint64_t input, const char* ops,
+                   Image img, const char* out, size_t outlen) {
+  assert(c != NULL);
+  assert(ops != NULL);
+  assert(img != NULL);
+  assert(out != NULL || outlen == 0);
+  uint64_t key = entryKey(input, ops);
+  char temp[PATH_MAX], path[PATH_MAX];
+  struct stat st;
+  long long bytes = 0;
+
+  // The image first, then the text, which completes the entry
+  tempPath(c, key, temp);
+  entryPath(c, key, "pgm", path);
+  if (!ImageSave(img, temp)) {
+    int saved = errno;
+    unlink(temp);
+    errno = saved;
+    return 0;
+  }
+  if (rename(temp, path) != 0 || (bytes = fileBytes(path, &st)) < 0) {
+    int saved = errno;
+    unlink(temp);
+    errno = saved;
+    return 0;
+  }
+  tempPath(c, key, temp);
+  entryPath(c, key, "txt", path);
+  FILE* f = fopen(temp, "w");
+  if (f == NULL) return 0;
+  size_t opslen = strlen(ops);
+  fprintf(f, "%sinput %016" PRIx64 " ops %zu text %zu\n", MAGIC, input, opslen, outlen);
+  fwrite(ops, 1, opslen, f);
+  if (outlen > 0) fwrite(out, 1, outlen, f);
+  int ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  long long txtbytes = -1;
+  if (!ok || rename(temp, path) != 0 || (txtbytes = fileBytes(path, &st)) < 0) {
+    int saved = errno;
+    unlink(temp);
+    errno = saved;
+    return 0;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  ok = addEntry(c, key, bytes + txtbytes, ++c->clock);
+  evict(c);
+  pthread_mutex_unlock(&c->lock);
+  if (!ok) errno = ENOMEM;
+  return ok;
+}
+
+void ResultCacheUsage(ResultCache c, long* entries, long long* bytes) {
+  assert(c != NULL);
+  pthread_mutex_lock(&c->lock);
+  *entries = c->n;
+  *bytes = c->bytes;
+  pthread_mutex_unlock(&c->lock);
+}
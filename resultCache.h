@@ -0,0 +1,62 @@
+/// resultCache - A persistent cache of pipeline results.
+///
+/// Maps an input image (by its content hash, see ImageHash) and a text
+/// describing the operations applied to it to the resulting image and the
+/// text output of those operations.  Entries are kept as files in a
+/// directory, so repeated runs over identical inputs skip the work, even
+/// across processes.  The total size of the files is bounded: when it goes
+/// over the limit, the least recently used entries are removed.  Recency
+/// is kept in the modification time of the entry files, updated on hits.
+///
+/// Each entry KEY (16 hex digits) has two files: KEY.pgm, the image, and
+/// KEY.txt, with the input hash, the operations and the text output.
+/// Both are written to temporary files and then renamed, the .txt last, so
+/// an entry is complete once its .txt file exists.  Several processes may
+/// share a directory, each with its own index of the entries, so the size
+/// bound is only approximate then, and entries removed by other processes
+/// are misses.
+///
+/// Hits and misses are counted in InstrCount[INSTR_CACHEHIT] and
+/// InstrCount[INSTR_CACHEMISS] (see instrumentation.h), named "cachehit"
+/// and "cachemiss".
+///
+/// All functions are thread-safe.
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image8bit.h"
+
+// Type ResultCache is a pointer to cache objects
+typedef struct resultCache *ResultCache;
+
+/// Open the cache in directory dir, creating it if needed, with at most
+/// maxbytes in its files (removing entries over the limit).
+/// On failure, returns NULL and errno is set.
+ResultCache ResultCacheOpen(const char* dir, long long maxbytes) ;
+
+/// Close the cache pointed to by (*cp), keeping its files.
+/// If (*cp)==NULL, no operation is performed.
+/// Ensures: (*cp)==NULL.
+void ResultCacheClose(ResultCache* cp) ;
+
+/// Look up the result of operations ops on the image with hash input.
+/// On a hit, returns a new image, and (*out) is set to a new buffer with
+/// the (*outlen) bytes of text output (the caller must free both).
+/// On a miss (or failure to read the entry), returns NULL.
+Image ResultCacheGet(ResultCache c, uint64_t input, const char* ops,
+                     char** out, size_t* outlen) ;
+
+/// Store img and the outlen bytes of text out as the result of operations
+/// ops on the image with hash input, replacing any previous entry.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set.
+int ResultCachePut(ResultCache c, uint64_t input, const char* ops,
+                   Image img, const char* out, size_t outlen) ;
+
+/// Get the number of entries and their total size in bytes.
+void ResultCacheUsage(ResultCache c, long* entries, long long* bytes) ;
+
+#endif
@@ -0,0 +1,194 @@
+/// tileCodec - A fast lossless codec for tiles of 8-bit pixels.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#include "tileCodec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Coding of the differences (TILE_DELTA):
+// a control byte c < 128 is followed by c+1 literal bytes, and a control
+// byte c >= 128 is followed by one byte to repeat c-128+MINRUN times.
+#define MAXLITERAL 128
+#define MINRUN 3
+#define MAXRUN (MINRUN + 127)
+
+// Literals and runs up to this length are expanded without calls
+#define SHORTITEM 16
+
+size_t TileBound(int w, int h)
+{ ///
+  return 1 + (size_t)w * h;
+}
+
+// Append the n literal bytes at lit to out, in chunks of MAXLITERAL.
+// Returns the new end of out.
+static uint8_t* putLiterals(uint8_t* out, const uint8_t* lit, size_t n)
+{
+  while (n > 0) {
+    size_t len = n < MAXLITERAL ? n : MAXLITERAL;
+    *out++ = (uint8_t)(len - 1);
+    memcpy(out, lit, len);
+    out += len;
+    lit += len;
+    n -= len;
+  }
+  return out;
+}
+
+size_t TileEncode(const uint8_t* src, size_t stride, int w, int h, uint8_t* out)
+{ ///
+  size_t n = (size_t)w * h;
+  if (n == 0) {
+    out[0] = TILE_RAW;
+    return 1;
+  }
+
+  // Differences, row by row
+  uint8_t* d = malloc(n);
+  if (d == NULL)
+    return 0;
+  for (int y = 0; y < h; y++) {
+    const uint8_t* r = src + stride * y;
+    uint8_t* dr = d + (size_t)w * y;
+    dr[0] = (uint8_t)(r[0] - (y > 0 ? r[-(ptrdiff_t)stride] : 0));
+    for (int x = 1; x < w; x++)
+      dr[x] = (uint8_t)(r[x] - r[x - 1]);
+  }
+
+  // All pixels are equal when all differences after the first are 0
+  int uniform = 1;
+  for (size_t i = 1; uniform && i < n; i++)
+    uniform = d[i] == 0;
+  if (uniform) {
+    out[0] = TILE_UNIFORM;
+    out[1] = src[0];
+    free(d);
+    return 2;
+  }
+
+  // Runs of at least MINRUN equal differences, and literals in between.
+  // Give up as soon as the coded tile would be larger than the raw one.
+  uint8_t* end = out + TileBound(w, h);
+  uint8_t* o = out + 1;
+  size_t lit = 0;  // start of the pending literals
+  size_t i = 0;
+  while (i < n && o + (i - lit) + (i - lit) / MAXLITERAL + 3 < end) {
+    size_t run = 1;
+    while (i + run < n && run < MAXRUN && d[i + run] == d[i])
+      run++;
+    if (run >= MINRUN) {
+      o = putLiterals(o, d + lit, i - lit);
+      *o++ = (uint8_t)(128 + run - MINRUN);
+      *o++ = d[i];
+      i += run;
+      lit = i;
+    } else {
+      i += run;
+    }
+  }
+  if (i == n && o + (n - lit) + (n - lit + MAXLITERAL - 1) / MAXLITERAL < end) {
+    o = putLiterals(o, d + lit, n - lit);
+    free(d);
+    out[0] = TILE_DELTA;
+    return (size_t)(o - out);
+  }
+  free(d);
+
+  // Does not compress: store the pixels
+  out[0] = TILE_RAW;
+  for (int y = 0; y < h; y++)
+    memcpy(out + 1 + (size_t)w * y, src + stride * y, (size_t)w);
+  return 1 + n;
+}
+
+int TileDecode(const uint8_t* in, size_t n, uint8_t* dst, size_t stride, int w, int h)
+{ ///
+  if (n < 1)
+    return 0;
+  size_t npix = (size_t)w * h;
+  switch (in[0]) {
+  case TILE_RAW:
+    if (n != 1 + npix)
+      return 0;
+    for (int y = 0; y < h; y++)
+      memcpy(dst + stride * y, in + 1 + (size_t)w * y, (size_t)w);
+    return 1;
+  case TILE_UNIFORM:
+    if (n != 2)
+      return 0;
+    for (int y = 0; y < h; y++)
+      memset(dst + stride * y, in[1], (size_t)w);
+    return 1;
+  case TILE_DELTA:
+    break;
+  default:
+    return 0;
+  }
+
+  // Expand the differences into the rows of dst (runs and literals may
+  // cross the end of a row), ...
+  const uint8_t* p = in + 1;
+  const uint8_t* end = in + n;
+  int x = 0, y = 0;
+  size_t done = 0;
+  while (p < end) {
+    int c = *p++;
+    size_t len = c < 128 ? (size_t)c + 1 : (size_t)c - 128 + MINRUN;
+    if (p + (c < 128 ? len : 1) > end || done + len > npix)
+      return 0;
+    done += len;
+    if (len <= SHORTITEM && w - x >= SHORTITEM && (c >= 128 || end - p >= SHORTITEM)) {
+      // Short item, not near the end of the row: copy a fixed SHORTITEM
+      // bytes, which compiles to a few moves instead of a call (the bytes
+      // past len are in this tile's row, and are rewritten by next items)
+      uint8_t* r = dst + stride * y + x;
+      if (c < 128) {
+        memcpy(r, p, SHORTITEM);
+        p += len;
+      } else {
+        memset(r, *p++, SHORTITEM);
+      }
+      x += (int)len;
+      if (x == w) {
+        x = 0;
+        y++;
+      }
+      continue;
+    }
+    while (len > 0) {
+      size_t k = (size_t)(w - x) < len ? (size_t)(w - x) : len;
+      uint8_t* r = dst + stride * y + x;
+      if (c < 128) {
+        memcpy(r, p, k);
+        p += k;
+      } else {
+        memset(r, *p, k);
+      }
+      len -= k;
+      x += (int)k;
+      if (x == w) {
+        x = 0;
+        y++;
+      }
+    }
+    if (c >= 128)
+      p++;
+  }
+  if (done != npix)
+    return 0;
+
+  // ... and add them up
+  // (keeping the running sum in a register, not reloading r[x-1])
+  for (y = 0; y < h; y++) {
+    uint8_t* r = dst + stride * y;
+    uint8_t sum = y > 0 ? r[-(ptrdiff_t)stride] : 0;
+    for (x = 0; x < w; x++) {
+      sum += r[x];
+      r[x] = sum;
+    }
+  }
+  return 1;
+}
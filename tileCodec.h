@@ -0,0 +1,40 @@
+/// tileCodec - A fast lossless codec for tiles of 8-bit pixels.
+///
+/// Each tile is coded on its own (so tiles may be coded and decoded in
+/// any order, and in parallel), in one of three ways, given by the first
+/// byte of the coded tile:
+///   TILE_RAW:     the pixels, row by row;
+///   TILE_UNIFORM: a single level, for tiles with all pixels equal;
+///   TILE_DELTA:   each pixel minus its left neighbour (or, for the first
+///                 column, minus the pixel above), modulo 256, with runs
+///                 of equal differences coded as (count, value) pairs.
+/// Smooth and flat areas give long runs of small differences, and tiles
+/// that do not compress are stored raw, so a coded tile is never more than
+/// 1 byte larger than the raw pixels.
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+
+#ifndef TILECODEC_H
+#define TILECODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Ways of coding a tile
+enum { TILE_RAW, TILE_UNIFORM, TILE_DELTA };
+
+/// Maximum size of a coded tile of w x h pixels.
+size_t TileBound(int w, int h) ;
+
+/// Code the w x h pixels at src (with rows stride bytes apart) into out,
+/// which must have room for TileBound(w, h) bytes.
+/// Returns the size of the coded tile, or 0 if out of memory.
+size_t TileEncode(const uint8_t* src, size_t stride, int w, int h, uint8_t* out) ;
+
+/// Decode the coded tile of n bytes at in into the w x h pixels at dst
+/// (with rows stride bytes apart).
+/// Returns nonzero on success, or 0 if the coded tile is invalid.
+int TileDecode(const uint8_t* in, size_t n, uint8_t* dst, size_t stride, int w, int h) ;
+
+#endif
@@ -0,0 +1,109 @@
+/// A minimal event tracing module.
+///
+/// Records timed spans and writes them in the Chrome trace-event JSON format,
+/// which may be viewed with https://ui.perfetto.dev or chrome://tracing.
+/// Each thread that records spans gets its own track.
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Nonzero while a trace file is open
+int TraceOn = 0;  ///extern
+
+// The trace file, and the lock serializing writes to it
+static FILE* tracef = NULL;
+static pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;
+// Number of events written (to place the commas)
+static long nevents = 0;
+
+// Track of the calling thread: assigned on first use, in order.
+static _Thread_local int tid = 0;
+static int ntids = 0;
+
+// Write string s as a JSON string literal.
+static void putString(const char* s)
+{
+  fputc('"', tracef);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(tracef, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(tracef, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, tracef);
+  }
+  fputc('"', tracef);
+}
+
+// Write the separator and common fields of one event.
+// Must be called with tracelock held.
+static void eventStart(const char* ph, const char* name)
+{
+  if (tid == 0) tid = ++ntids;
+  fprintf(tracef, "%s\n{\"name\": ", nevents++ > 0 ? "," : "");
+  putString(name);
+  fprintf(tracef, ", \"ph\": \"%s\", \"pid\": %ld, \"tid\": %d", ph, (long)getpid(), tid);
+}
+
+int TraceOpen(const char* filename)
+{ ///
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) return 0;
+  pthread_mutex_lock(&tracelock);
+  tracef = f;
+  nevents = 0;
+  fprintf(tracef, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  TraceOn = 1;
+  pthread_mutex_unlock(&tracelock);
+  return 1;
+}
+
+int TraceClose(void)
+{ ///
+  pthread_mutex_lock(&tracelock);
+  int success = 1;
+  if (tracef != NULL) {
+    fprintf(tracef, "\n]}\n");
+    success = fclose(tracef) == 0;
+    tracef = NULL;
+  }
+  TraceOn = 0;
+  pthread_mutex_unlock(&tracelock);
+  return success;
+}
+
+double TraceNow(void)
+{ ///
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1.0e6 + 1.0e-3 * (double)t.tv_nsec;
+}
+
+void TraceSpan(const char* name, double start, double end, const char* args)
+{ ///
+  pthread_mutex_lock(&tracelock);
+  if (tracef != NULL) {
+    eventStart("X", name);
+    fprintf(tracef, ", \"ts\": %.3f, \"dur\": %.3f", start, end - start);
+    if (args != NULL)
+      fprintf(tracef, ", \"args\": {%s}", args);
+    fputc('}', tracef);
+  }
+  pthread_mutex_unlock(&tracelock);
+}
+
+void TraceThreadName(const char* name)
+{ ///
+  pthread_mutex_lock(&tracelock);
+  if (tracef != NULL) {
+    eventStart("M", "thread_name");
+    fprintf(tracef, ", \"args\": {\"name\": ");
+    putString(name);
+    fprintf(tracef, "}}");
+  }
+  pthread_mutex_unlock(&tracelock);
+}
@@ -0,0 +1,50 @@
+/// A minimal event tracing module.
+///
+/// Records timed spans and writes them in the Chrome trace-event JSON format,
+/// which may be viewed with https://ui.perfetto.dev or chrome://tracing.
+/// Each thread that records spans gets its own track.
+///
+/// Use as follows:
+///
+/// TraceOpen("trace.json");
+/// ...
+/// double t0 = TraceNow();
+/// doSomething();
+/// TraceSpan("something", t0, TraceNow(), "\"size\": 100");
+/// ...
+/// TraceClose();
+///
+/// Spans recorded while no trace is open are ignored, so calls may be
+/// left in place (guarded by TraceOn, to skip building the arguments).
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/// Nonzero while a trace file is open
+extern int TraceOn;  ///extern
+
+/// Open trace file and start recording.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set.
+int TraceOpen(const char* filename) ;
+
+/// Finish the trace file and stop recording.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set.  If no trace is open, returns 1.
+int TraceClose(void) ;
+
+/// Current time in microseconds, the time unit of trace events.
+double TraceNow(void) ;
+
+/// Record a complete span from start to end (as given by TraceNow).
+///   name : the span name.
+///   args : NULL, or JSON object members, e.g. "\"w\": 10, \"h\": 20".
+/// The span goes to the track of the calling thread.
+/// Thread-safe.
+void TraceSpan(const char* name, double start, double end, const char* args) ;
+
+/// Name the track of the calling thread.
+/// Thread-safe.
+void TraceThreadName(const char* name) ;
+
+#endif